@@ -0,0 +1,58 @@
+//
+// Created by Shihao Jing on 9/7/17.
+//
+
+// Replaces the global operator new and delete with ones that count calls
+// and bytes, for the benchmarks that report allocations. Include it from
+// one translation unit only.
+
+#ifndef ZION_BENCH_ALLOC_COUNTER_H
+#define ZION_BENCH_ALLOC_COUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace bench {
+
+// Calls to operator new so far, and the bytes asked for, on threads that
+// count them.
+static std::atomic<std::size_t> allocations{0};
+static std::atomic<std::size_t> allocated_bytes{0};
+
+// Cleared on threads whose allocations are not the ones being measured,
+// such as a benchmark's own client.
+static thread_local bool count_allocations = true;
+
+// For allocators other than operator new, OpenSSL's for one.
+inline void count_allocation(std::size_t size) {
+  if (count_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+
+} // namespace bench
+
+void* operator new(std::size_t size) {
+  bench::count_allocation(size);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// The replacements above and below are a matching pair; GCC cannot tell.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+#pragma GCC diagnostic pop
+
+#endif //ZION_BENCH_ALLOC_COUNTER_H
@@ -0,0 +1,91 @@
+//
+// Created by Shihao Jing on 8/21/17.
+//
+
+// Counts global allocator calls per request on the request path: parsing,
+// routing, the handler and serializing the response, the way a keep-alive
+// connection runs them. The same request is served once with its headers and
+// route args in a per-request arena and once on the heap, for comparison. The
+// handler builds its reply, a few hundred bytes of JSON and a Content-Type,
+// in the request's arena when there is one.
+
+#include "zion.h"
+#include "alloc_counter.h"
+#include <cstdio>
+#include <cstdlib>
+
+using bench::allocations;
+
+static const char raw[] =
+    "GET /user/alice%20smith/post/42 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:55.0) Gecko/20100101 Firefox/55.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Cookie: session=4f9a2c8e1b7d6035a9e8f1c2d3b4a596; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// One request as a connection handles it; returns allocator calls.
+static std::size_t serve(zion::Zion &app, zion::request &req, zion::arena *arena,
+                         zion::request_parser &parser, zion::response &res,
+                         std::vector<boost::asio::const_buffer> &buffers) {
+  std::size_t before = allocations;
+  parser.reset(&req);
+  size_t consumed;
+  if (parser.parse(raw, sizeof(raw) - 1, consumed) != zion::request_parser::good)
+    std::abort();
+  res = app.handle(req);
+  res.keep_alive = req.keep_alive;
+  res.to_buffers(buffers);
+  if (buffers.empty())
+    std::abort();
+  req.clear();
+  res.clear();
+  if (arena)
+    arena->reset();
+  return allocations - before;
+}
+
+static void run(const char *name, zion::Zion &app, zion::request &req, zion::arena *arena) {
+  const int warmup = 100, iterations = 100000;
+  zion::request_parser parser;
+  zion::response res;
+  std::vector<boost::asio::const_buffer> buffers;
+  for (int i = 0; i < warmup; ++i)
+    serve(app, req, arena, parser, res, buffers);
+  std::size_t total = 0;
+  for (int i = 0; i < iterations; ++i)
+    total += serve(app, req, arena, parser, res, buffers);
+  std::printf("%-8s %6.2f allocator calls per request\n", name, double(total) / iterations);
+}
+
+int main() {
+  zion::Zion app;
+
+  ROUTE(app, "/user/<string>/post/<int>")
+      ([](const zion::request &req, std::string user, int64_t post) {
+        // A JSON body of a few hundred bytes, written straight into the
+        // response's content.
+        zion::response res(req.arena);
+        res.add_header("Content-Type", "application/json");
+        std::string::size_type size = 1024;
+        res.arena_content.resize(size);
+        int n = std::snprintf(&res.arena_content[0], size,
+                              "{\"user\":\"%s\",\"post\":%lld,\"title\":\"Notes on allocation\","
+                              "\"tags\":[\"c++\",\"http\",\"memory\"],\"body\":\"%s\"}",
+                              user.c_str(), static_cast<long long>(post),
+                              "Each request gets a bump-pointer arena, reset in one go once its response "
+                              "has been written, and the response can live there too.");
+        res.arena_content.resize(n);
+        return res;
+      });
+
+  zion::arena arena;
+  zion::request with_arena(&arena);
+  zion::request on_heap;
+  run("arena", app, with_arena, &arena);
+  run("heap", app, on_heap, nullptr);
+  return 0;
+}
@@ -0,0 +1,137 @@
+//
+// Created by Shihao Jing on 9/6/17.
+//
+
+// The client side the benchmarks share: loopback connections and blocking
+// HTTP/1.1 round trips, one request at a time.
+
+#ifndef ZION_BENCH_UTIL_H
+#define ZION_BENCH_UTIL_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace bench {
+
+using clock_type = std::chrono::steady_clock;
+
+inline void fail(const char *what) {
+  std::fprintf(stderr, "%s failed\n", what);
+  std::exit(1);
+}
+
+inline sockaddr_in loopback(int port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return addr;
+}
+
+// A connection to port on the loopback, -1 if refused. Nagle is turned off
+// unless no_delay is false.
+inline int try_connect(int port, bool no_delay = true) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = loopback(port);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  if (no_delay) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+inline int connect_to(int port, bool no_delay = true) {
+  int fd = try_connect(port, no_delay);
+  if (fd < 0)
+    fail("connect");
+  return fd;
+}
+
+// Connect to a server just started, waiting up to two seconds for it to
+// listen.
+inline int wait_for_server(int port, bool no_delay = true) {
+  for (int i = 0; i < 200; ++i) {
+    int fd = try_connect(port, no_delay);
+    if (fd >= 0)
+      return fd;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  fail("server start");
+  return -1;
+}
+
+inline std::string get_request(const std::string &path, bool close = false) {
+  return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n" + (close ? "Connection: close\r\n" : "") + "\r\n";
+}
+
+// Read one response, through the Content-Length bytes of its body. False if
+// the connection ends first.
+inline bool read_response(int fd, std::size_t *body_size = nullptr) {
+  std::string head;
+  char buf[65536];
+  std::size_t body_start = std::string::npos;
+  while (body_start == std::string::npos) {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return false;
+    head.append(buf, n);
+    body_start = head.find("\r\n\r\n");
+  }
+  std::size_t field = head.find("Content-Length: ");
+  std::size_t length = field < body_start ? std::strtoul(head.c_str() + field + 16, nullptr, 10) : 0;
+  std::size_t have = head.size() - body_start - 4;
+  while (have < length) {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return false;
+    have += n;
+  }
+  if (body_size)
+    *body_size = length;
+  return true;
+}
+
+// Send request and read its response. False if the connection fails.
+inline bool try_get(int fd, const std::string &request, std::size_t *body_size = nullptr) {
+  if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+    return false;
+  return read_response(fd, body_size);
+}
+
+// As try_get, failing the benchmark if the connection does. Returns the
+// body's size.
+inline std::size_t get(int fd, const std::string &request) {
+  std::size_t body_size = 0;
+  if (!try_get(fd, request, &body_size))
+    fail("get");
+  return body_size;
+}
+
+inline double seconds_since(clock_type::time_point start) {
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+inline double micros_since(clock_type::time_point start) {
+  return std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+}
+
+inline double percentile(const std::vector<double> &sorted, double p) {
+  return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+}
+
+} // namespace bench
+
+#endif //ZION_BENCH_UTIL_H
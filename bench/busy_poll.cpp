@@ -0,0 +1,113 @@
+//
+// Created by Shihao Jing on 8/31/17.
+//
+
+// Request latency against the CPU the io thread burns, with and without
+// busy polling: p50/p99/p99.9 of back-to-back requests on one keep-alive
+// connection, then the server's CPU use under a paced light load and while
+// idle. The server runs in a child process, once per spin budget.
+//
+//   busy_poll [--cpu n] [port] [spin_us ...]
+//
+// --cpu pins the server's io thread. Spinning only pays off when the io
+// thread has a core of its own; on one shared core it competes with the
+// client.
+
+#include "zion.h"
+#include "bench_util.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace bench;
+
+static const std::string hello_request = get_request("/hello");
+
+// User plus system CPU time of a process so far, in seconds.
+static double cpu_seconds(pid_t pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/stat";
+  FILE *f = std::fopen(path.c_str(), "r");
+  if (!f)
+    fail("reading /proc");
+  char buf[1024];
+  std::size_t n = std::fread(buf, 1, sizeof(buf) - 1, f);
+  std::fclose(f);
+  buf[n] = '\0';
+  // Fields 14 and 15, counted after the parenthesised command name.
+  const char *p = std::strrchr(buf, ')');
+  unsigned long utime = 0, stime = 0;
+  std::sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+  return double(utime + stime) / ::sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char **argv) {
+  int cpu = -1;
+  if (argc > 2 && std::string(argv[1]) == "--cpu") {
+    cpu = std::atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  int port = argc > 1 ? std::atoi(argv[1]) : 18081;
+  std::vector<int> spins;
+  for (int i = 2; i < argc; ++i)
+    spins.push_back(std::atoi(argv[i]));
+  if (spins.empty())
+    spins = {0, 50, 1000};
+
+  std::printf("%8s %9s %9s %9s %12s %10s\n", "spin us", "p50 us", "p99 us", "p99.9 us", "CPU at 1k/s", "CPU idle");
+  for (int spin : spins) {
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      zion::Zion app;
+      ROUTE(app, "/hello")([] { return "hello"; });
+      zion::busy_poll_options options;
+      options.spin = std::chrono::microseconds(spin);
+      options.cpu = cpu;
+      app.port(std::to_string(port)).bindaddr("127.0.0.1").busy_poll(options).run();
+      std::_Exit(0);
+    }
+    int fd = wait_for_server(port);
+
+    for (int i = 0; i < 1000; ++i)
+      get(fd, hello_request);
+    const int requests = 20000;
+    std::vector<double> latencies;
+    latencies.reserve(requests);
+    for (int i = 0; i < requests; ++i) {
+      auto start = clock_type::now();
+      get(fd, hello_request);
+      latencies.push_back(micros_since(start));
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    // One request a millisecond for a second: a spinning thread never gets
+    // to block between them.
+    double before = cpu_seconds(pid);
+    auto next = clock_type::now();
+    for (int i = 0; i < 1000; ++i) {
+      next += std::chrono::milliseconds(1);
+      get(fd, hello_request);
+      std::this_thread::sleep_until(next);
+    }
+    double loaded = cpu_seconds(pid) - before;
+
+    before = cpu_seconds(pid);
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    double idle = cpu_seconds(pid) - before;
+
+    std::printf("%8d %9.1f %9.1f %9.1f %11.0f%% %9.0f%%\n", spin, percentile(latencies, 0.5),
+                percentile(latencies, 0.99), percentile(latencies, 0.999), loaded * 100, idle * 100);
+    ::close(fd);
+    ::kill(pid, SIGTERM);
+    ::waitpid(pid, nullptr, 0);
+  }
+  return 0;
+}
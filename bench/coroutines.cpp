@@ -0,0 +1,102 @@
+//
+// Created by Shihao Jing on 9/4/17.
+//
+
+// The cost of a handler returning task<response> against a plain handler
+// and a callback (.async) one: requests per second and allocator calls per
+// request on one io thread, the way a connection runs them, from routing to
+// the answer being delivered. Each asynchronous kind runs once answering at
+// once and once after suspending on a timer, the callback keeping its
+// timer in a shared_ptr and the coroutine in its frame.
+//
+// Needs -std=c++20.
+
+#include "zion.h"
+#include "alloc_counter.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#ifndef ZION_HAS_COROUTINES
+#error "coroutines need -std=c++20"
+#endif
+
+using bench::allocations;
+
+using clock_type = std::chrono::steady_clock;
+
+static bool answered = false;
+
+static void serve(zion::Zion &app, zion::request &req, boost::asio::io_service &io_service) {
+  zion::response res = app.handle(req);
+  if (res.is_async()) {
+    answered = false;
+    res.on_async(zion::detail::make_responder([&io_service](std::function<void()> handler)
+                                              {
+                                                boost::asio::post(io_service, std::move(handler));
+                                              },
+                                              [](zion::response res)
+                                              {
+                                                answered = res.status_ == zion::response::ok;
+                                              },
+                                              io_service.get_executor()));
+    io_service.restart();
+    io_service.run();
+    if (!answered)
+      std::abort();
+  }
+  res.clear();
+}
+
+static void run(const char *name, zion::Zion &app, const char *uri) {
+  const int warmup = 1000, iterations = 200000;
+  boost::asio::io_service io_service;
+  zion::request req;
+  req.method_code = (int)zion::HTTPMethod::GET;
+  req.uri = uri;
+  for (int i = 0; i < warmup; ++i)
+    serve(app, req, io_service);
+  std::size_t before = allocations;
+  clock_type::time_point start = clock_type::now();
+  for (int i = 0; i < iterations; ++i)
+    serve(app, req, io_service);
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  std::printf("%-16s %10.0f req/s %6.2f allocator calls per request\n",
+              name, iterations / seconds, double(allocations - before) / iterations);
+}
+
+int main() {
+  zion::Zion app;
+
+  ROUTE(app, "/sync/<int>")([](int64_t n) {
+    return zion::response(n == 1 ? "1" : "?");
+  });
+
+  ROUTE(app, "/callback/<int>").async([](zion::responder respond, int64_t n) {
+    respond(n == 1 ? "1" : "?");
+  });
+
+  ROUTE(app, "/callback/timer/<int>").async([](zion::responder respond, int64_t n) {
+    auto timer = std::make_shared<boost::asio::steady_timer>(respond.get_executor(), std::chrono::seconds(0));
+    timer->async_wait([timer, respond, n](boost::system::error_code) {
+      respond(n == 1 ? "1" : "?");
+    });
+  });
+
+  ROUTE(app, "/task/<int>")([](int64_t n) -> zion::task<zion::response> {
+    co_return n == 1 ? "1" : "?";
+  });
+
+  ROUTE(app, "/task/timer/<int>")([](int64_t n) -> zion::task<zion::response> {
+    co_await zion::sleep_for(std::chrono::seconds(0));
+    co_return n == 1 ? "1" : "?";
+  });
+
+  run("sync", app, "/sync/1");
+  run("callback", app, "/callback/1");
+  run("task", app, "/task/1");
+  run("callback+timer", app, "/callback/timer/1");
+  run("task+timer", app, "/task/timer/1");
+  return 0;
+}
@@ -0,0 +1,201 @@
+//
+// Created by Shihao Jing on 8/30/17.
+//
+
+// The asio (epoll) and io_uring engines side by side on loopback: keep-alive
+// request rate over a few concurrent connections, file throughput, and the
+// system calls the server makes per request. The server runs in a child
+// process; for the system call count it runs again under ptrace, which
+// counts every syscall entry of all its threads.
+//
+//   engines [port] [connections]
+
+#include "zion.h"
+#include "bench_util.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+using namespace bench;
+
+static const std::size_t file_size = 16 << 20;
+static const char *file_path = "/tmp/zion-bench-engines-file";
+static const std::string hello_request = get_request("/hello");
+static const std::string file_request = get_request("/file");
+
+static void serve(zion::io_engine engine, int port) {
+  zion::Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  ROUTE(app, "/file")([] { return zion::response::send_file(file_path); });
+  app.port(std::to_string(port)).bindaddr("127.0.0.1").engine(engine).run();
+}
+
+static void stop(pid_t pid) {
+  ::kill(pid, SIGTERM);
+  ::waitpid(pid, nullptr, 0);
+}
+
+// The server under ptrace: the tracer thread forks it and counts syscall
+// entries until it exits.
+class traced_server
+{
+public:
+  traced_server(zion::io_engine engine, int port) {
+    tracer_ = std::thread([this, engine, port] { trace(engine, port); });
+    while (!pid_)
+      std::this_thread::yield();
+    ::close(wait_for_server(port));
+  }
+
+  ~traced_server() {
+    ::kill(pid_, SIGKILL);
+    tracer_.join();
+  }
+
+  unsigned long syscalls() const { return syscalls_; }
+
+private:
+  void trace(zion::io_engine engine, int port) {
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      ::ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+      ::raise(SIGSTOP);
+      serve(engine, port);
+      std::_Exit(0);
+    }
+    ::waitpid(pid, nullptr, 0);
+    ::ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+             PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ::ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+    pid_ = pid;
+
+    int status;
+    pid_t tid;
+    while ((tid = ::waitpid(-1, &status, __WALL)) > 0) {
+      if (WIFEXITED(status) || WIFSIGNALED(status))
+        continue;
+      int signal = 0;
+      int stop = WSTOPSIG(status);
+      if (stop == (SIGTRAP | 0x80)) {
+        __ptrace_syscall_info info;
+        if (::ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+            info.op == PTRACE_SYSCALL_INFO_ENTRY)
+          ++syscalls_;
+      }
+      else if (stop != SIGTRAP && stop != SIGSTOP) {
+        signal = stop;
+      }
+      ::ptrace(PTRACE_SYSCALL, tid, nullptr, signal);
+    }
+  }
+
+  std::thread tracer_;
+  std::atomic<pid_t> pid_{0};
+  std::atomic<unsigned long> syscalls_{0};
+};
+
+struct result
+{
+  double requests_per_second;
+  double file_mb_per_second;
+  double syscalls_per_request;
+  double syscalls_per_file;
+};
+
+static result run(zion::io_engine engine, int port, int connections) {
+  result r;
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    serve(engine, port);
+    std::_Exit(0);
+  }
+  ::close(wait_for_server(port));
+
+  const int per_connection = 20000;
+  std::vector<std::thread> clients;
+  auto start = clock_type::now();
+  for (int i = 0; i < connections; ++i) {
+    clients.emplace_back([port] {
+      int fd = connect_to(port);
+      for (int j = 0; j < per_connection; ++j)
+        get(fd, hello_request);
+      ::close(fd);
+    });
+  }
+  for (auto &t : clients)
+    t.join();
+  r.requests_per_second = connections * per_connection / seconds_since(start);
+
+  const int files = 32;
+  int fd = connect_to(port);
+  start = clock_type::now();
+  std::size_t bytes = 0;
+  for (int i = 0; i < files; ++i)
+    bytes += get(fd, file_request);
+  r.file_mb_per_second = bytes / seconds_since(start) / (1 << 20);
+  ::close(fd);
+  stop(pid);
+
+  // Same requests again, one connection, counting the server's syscalls.
+  // Tracing makes every syscall far slower, so this run is not timed.
+  {
+    traced_server server(engine, port);
+    const int requests = 2000;
+    fd = connect_to(port);
+    get(fd, hello_request);
+    unsigned long before = server.syscalls();
+    for (int i = 0; i < requests; ++i)
+      get(fd, hello_request);
+    r.syscalls_per_request = double(server.syscalls() - before) / requests;
+
+    before = server.syscalls();
+    for (int i = 0; i < 4; ++i)
+      get(fd, file_request);
+    r.syscalls_per_file = double(server.syscalls() - before) / 4;
+    ::close(fd);
+  }
+  return r;
+}
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? std::atoi(argv[1]) : 18080;
+  int connections = argc > 2 ? std::atoi(argv[2]) : 4;
+  {
+    FILE *f = std::fopen(file_path, "w");
+    std::string block(1 << 20, 'x');
+    for (std::size_t i = 0; i < file_size; i += block.size())
+      std::fwrite(block.data(), 1, block.size(), f);
+    std::fclose(f);
+  }
+
+  struct
+  {
+    const char *name;
+    zion::io_engine engine;
+  } engines[] = {{"asio", zion::io_engine::asio}, {"io_uring", zion::io_engine::io_uring}};
+#ifdef ZION_HAS_IO_URING
+  bool have_uring = zion::uring::supported();
+#else
+  bool have_uring = false;
+#endif
+
+  std::printf("%-10s %12s %12s %16s %16s\n", "engine", "requests/s", "file MB/s", "syscalls/request", "syscalls/file");
+  for (auto &e : engines) {
+    if (e.engine == zion::io_engine::io_uring && !have_uring) {
+      std::printf("%-10s not supported here\n", e.name);
+      continue;
+    }
+    result r = run(e.engine, port, connections);
+    std::printf("%-10s %12.0f %12.1f %16.2f %16.1f\n", e.name, r.requests_per_second, r.file_mb_per_second,
+                r.syscalls_per_request, r.syscalls_per_file);
+  }
+  std::remove(file_path);
+  return 0;
+}
@@ -0,0 +1,97 @@
+//
+// Created by Shihao Jing on 9/5/17.
+//
+
+// Latency of a cheap route while a CPU-heavy one is under load, with the
+// heavy handler on the io thread and then offloaded: p50/p99/p99.9 of
+// back-to-back requests to /hello on one connection, while other clients
+// keep /heavy (a few ms of CPU each) busy. The server runs in a child
+// process with one io thread.
+//
+//   offload [port] [heavy clients]
+
+#include "zion.h"
+#include "bench_util.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace bench;
+
+static const std::string hello_request = get_request("/hello");
+static const std::string heavy_request = get_request("/heavy");
+
+// A few ms of arithmetic.
+static std::string heavy() {
+  uint64_t x = 1;
+  for (int i = 0; i < 4000000; ++i)
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+  return std::to_string(x & 1) + ".";
+}
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? std::atoi(argv[1]) : 18082;
+  int clients = argc > 2 ? std::atoi(argv[2]) : 2;
+
+  std::printf("%-10s %9s %9s %9s %12s\n", "heavy on", "p50 us", "p99 us", "p99.9 us", "heavy req/s");
+  for (bool offload : {false, true}) {
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      zion::Zion app;
+      ROUTE(app, "/hello")([] { return "hello."; });
+      if (offload)
+        ROUTE(app, "/heavy").offload()([] { return heavy(); });
+      else
+        ROUTE(app, "/heavy")([] { return heavy(); });
+      app.port(std::to_string(port)).bindaddr("127.0.0.1").workers(1).run();
+      std::_Exit(0);
+    }
+    int fd = wait_for_server(port);
+
+    std::atomic<bool> done{false};
+    std::atomic<long> heavy_done{0};
+    std::vector<std::thread> load;
+    for (int c = 0; c < clients; ++c) {
+      load.emplace_back([&] {
+        int hfd = try_connect(port);
+        while (!done && try_get(hfd, heavy_request))
+          ++heavy_done;
+        ::close(hfd);
+      });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const int requests = 2000;
+    std::vector<double> latencies;
+    latencies.reserve(requests);
+    long heavy_before = heavy_done;
+    auto begin = clock_type::now();
+    for (int i = 0; i < requests; ++i) {
+      auto start = clock_type::now();
+      get(fd, hello_request);
+      latencies.push_back(micros_since(start));
+    }
+    double seconds = seconds_since(begin);
+    double heavy_rate = (heavy_done - heavy_before) / seconds;
+    std::sort(latencies.begin(), latencies.end());
+
+    done = true;
+    ::kill(pid, SIGTERM);
+    for (auto &t : load)
+      t.join();
+    ::waitpid(pid, nullptr, 0);
+    ::close(fd);
+
+    std::printf("%-10s %9.1f %9.1f %9.1f %12.0f\n", offload ? "pool" : "io thread", percentile(latencies, 0.5),
+                percentile(latencies, 0.99), percentile(latencies, 0.999), heavy_rate);
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+//
+// Created by Shihao Jing on 9/1/17.
+//
+
+// What each tcp_options setting does on loopback. For every configuration
+// the server runs in a child process and is measured three ways:
+//
+//   - small: latency of a small response on a keep-alive connection;
+//   - file:  latency of a 4 KB send_file response, and the TCP segments it
+//            arrives in, which is what no_delay and cork change: with
+//            neither, Nagle holds the body back behind the headers until
+//            the client's delayed ack;
+//   - connect: new connections per second, one request each, which
+//            defer_accept and fast_open speed up (fast open only once
+//            net.ipv4.tcp_fastopen has the server bit, 2, set).
+//
+//   tcp_options [port]
+
+#include "zion.h"
+#include "bench_util.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <csignal>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace bench;
+
+static const char *file_path = "/tmp/zion-bench-tcp-file";
+
+// glibc's tcp_info stops short of the segment counters Linux 4.2 added.
+struct tcp_info_counters : tcp_info
+{
+  uint64_t pacing_rate;
+  uint64_t max_pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t bytes_received;
+  uint32_t segs_out;
+  uint32_t segs_in;
+};
+
+static unsigned segments_in(int fd) {
+  tcp_info_counters info{};
+  socklen_t size = sizeof(info);
+  ::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size);
+  return info.segs_in;
+}
+
+static const std::string small_request = get_request("/hello");
+static const std::string file_request = get_request("/file");
+static const std::string close_request = get_request("/hello", true);
+static const std::size_t file_size = 4096;
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? std::atoi(argv[1]) : 18082;
+  {
+    FILE *f = std::fopen(file_path, "w");
+    std::string body(file_size, 'x');
+    std::fwrite(body.data(), 1, body.size(), f);
+    std::fclose(f);
+  }
+
+  struct configuration
+  {
+    const char *name;
+    zion::tcp_options options;
+  };
+  std::vector<configuration> configurations(6);
+  configurations[0].name = "default";
+  configurations[1].name = "nagle";
+  configurations[1].options.no_delay = false;
+  configurations[2].name = "nagle+cork";
+  configurations[2].options.no_delay = false;
+  configurations[2].options.cork = true;
+  configurations[3].name = "cork";
+  configurations[3].options.cork = true;
+  configurations[4].name = "defer_accept";
+  configurations[4].options.defer_accept = std::chrono::seconds(1);
+  configurations[5].name = "fast_open";
+  configurations[5].options.fast_open_queue = 256;
+
+  std::printf("%-14s %10s %10s %14s %12s\n", "options", "small us", "file us", "file segments", "connects/s");
+  for (auto &config : configurations) {
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      zion::Zion app;
+      ROUTE(app, "/hello")([] { return "hello"; });
+      ROUTE(app, "/file")([] { return zion::response::send_file(file_path); });
+      app.port(std::to_string(port)).bindaddr("127.0.0.1").tcp(config.options).run();
+      std::_Exit(0);
+    }
+    // The client keeps Nagle on, as most do.
+    int fd = wait_for_server(port, false);
+
+    const int requests = 2000;
+    auto start = clock_type::now();
+    for (int i = 0; i < requests; ++i)
+      get(fd, small_request);
+    double small = micros_since(start) / requests;
+
+    const int files = 200;
+    unsigned before = segments_in(fd);
+    start = clock_type::now();
+    for (int i = 0; i < files; ++i)
+      get(fd, file_request);
+    double file = micros_since(start) / files;
+    double segments = double(segments_in(fd) - before) / files;
+    ::close(fd);
+
+    // A fresh connection per request; with fast open the request rides in
+    // the SYN once the first connection has fetched a cookie.
+    const int connects = 2000;
+    sockaddr_in addr = loopback(port);
+    start = clock_type::now();
+    for (int i = 0; i < connects; ++i) {
+      int c = ::socket(AF_INET, SOCK_STREAM, 0);
+      if (config.options.fast_open_queue) {
+        if (::sendto(c, close_request.data(), close_request.size(), MSG_FASTOPEN,
+                     reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != static_cast<ssize_t>(close_request.size()))
+          fail("sendto");
+      }
+      else {
+        if (::connect(c, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+          fail("connect");
+        if (::send(c, close_request.data(), close_request.size(), 0) != static_cast<ssize_t>(close_request.size()))
+          fail("send");
+      }
+      if (!read_response(c))
+        fail("recv");
+      ::close(c);
+    }
+    double rate = connects / (micros_since(start) / 1e6);
+
+    std::printf("%-14s %10.1f %10.1f %14.2f %12.0f\n", config.name, small, file, segments, rate);
+    ::kill(pid, SIGTERM);
+    ::waitpid(pid, nullptr, 0);
+  }
+  std::remove(file_path);
+  return 0;
+}
@@ -0,0 +1,220 @@
+//
+// Created by Shihao Jing on 8/26/17.
+//
+
+// TLS handshake rate and bulk throughput against a local OpenSSL client:
+// full handshakes, handshakes resumed from a session ticket, and large
+// bodies, from memory and from a file, over one keep-alive connection.
+// Also counts what the server allocates per resumed connection, through
+// OpenSSL and operator new. Build with ZION_ENABLE_SSL.
+//
+//   tls [--ktls] [port] [certificate.pem key.pem]
+//
+// --ktls serves with ssl_options::kernel_tls. Without a certificate a
+// throwaway self-signed P-256 one is generated.
+
+#include "zion.h"
+#include "alloc_counter.h"
+#include "bench_util.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+using namespace bench;
+
+// OpenSSL's allocations are the server's as much as operator new's.
+static void* crypto_malloc(std::size_t size, const char*, int) {
+  count_allocation(size);
+  return std::malloc(size);
+}
+
+static void* crypto_realloc(void *p, std::size_t size, const char*, int) {
+  count_allocation(size);
+  return std::realloc(p, size);
+}
+
+static void crypto_free(void *p, const char*, int) {
+  std::free(p);
+}
+
+static const std::size_t big_size = 16 << 20;
+
+static void make_certificate(const std::string &cert_path, const std::string &key_path) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *x509 = X509_new();
+  if (!key || !x509)
+    fail("key generation");
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+  X509_set_pubkey(x509, key);
+  X509_NAME *name = X509_get_subject_name(x509);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(x509, name);
+  if (!X509_sign(x509, key, EVP_sha256()))
+    fail("certificate signing");
+
+  FILE *f = std::fopen(cert_path.c_str(), "w");
+  PEM_write_X509(f, x509);
+  std::fclose(f);
+  f = std::fopen(key_path.c_str(), "w");
+  PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+  std::fclose(f);
+  X509_free(x509);
+  EVP_PKEY_free(key);
+}
+
+// Send one request and read its response, returning the body size.
+static std::size_t get(SSL *ssl, const char *path) {
+  std::string request = get_request(path);
+  if (SSL_write(ssl, request.data(), static_cast<int>(request.size())) <= 0)
+    fail("SSL_write");
+
+  std::string head;
+  char buf[65536];
+  std::size_t body_start = std::string::npos;
+  while (body_start == std::string::npos) {
+    int n = SSL_read(ssl, buf, sizeof(buf));
+    if (n <= 0)
+      fail("SSL_read");
+    head.append(buf, n);
+    body_start = head.find("\r\n\r\n");
+  }
+  std::size_t length = std::strtoul(head.c_str() + head.find("Content-Length: ") + 16, nullptr, 10);
+  std::size_t have = head.size() - body_start - 4;
+  while (have < length) {
+    int n = SSL_read(ssl, buf, sizeof(buf));
+    if (n <= 0)
+      fail("SSL_read");
+    have += n;
+  }
+  return length;
+}
+
+// One connection: handshake, one request, close. Returns the session for
+// resumption when asked to.
+static SSL_SESSION* one_request(SSL_CTX *ctx, int port, SSL_SESSION *resume, bool *reused) {
+  int fd = connect_to(port);
+  SSL *ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (resume)
+    SSL_set_session(ssl, resume);
+  if (SSL_connect(ssl) != 1)
+    fail("SSL_connect");
+  get(ssl, "/hello");
+  if (reused)
+    *reused = SSL_session_reused(ssl) == 1;
+  // TLS 1.3 tickets arrive after the handshake, so the session is taken
+  // once a response has been read.
+  SSL_SESSION *session = SSL_get1_session(ssl);
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  ::close(fd);
+  return session;
+}
+
+int main(int argc, char **argv) {
+  // Only the server's allocations count.
+  count_allocations = false;
+  CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free);
+  bool ktls = argc > 1 && std::string(argv[1]) == "--ktls";
+  if (ktls) {
+    --argc;
+    ++argv;
+  }
+  int port = argc > 1 ? std::atoi(argv[1]) : 18443;
+  std::string cert = "/tmp/zion-bench-cert.pem", key = "/tmp/zion-bench-key.pem";
+  if (argc > 3) {
+    cert = argv[2];
+    key = argv[3];
+  }
+  else {
+    make_certificate(cert, key);
+  }
+
+  zion::Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  ROUTE(app, "/big")([] { return std::string(big_size, 'x'); });
+  const std::string file = "/tmp/zion-bench-file";
+  {
+    FILE *f = std::fopen(file.c_str(), "w");
+    std::string block(1 << 20, 'x');
+    for (std::size_t i = 0; i < big_size; i += block.size())
+      std::fwrite(block.data(), 1, block.size(), f);
+    std::fclose(f);
+  }
+  ROUTE(app, "/file")([file] { return zion::response::send_file(file); });
+  zion::ssl_options options;
+  options.certificate_chain_file = cert;
+  options.private_key_file = key;
+  options.kernel_tls = ktls;
+  app.port(std::to_string(port)).bindaddr("127.0.0.1").ssl(options);
+  std::thread server([&app] { app.run(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+  const int handshakes = 500;
+  auto start = clock_type::now();
+  SSL_SESSION *session = nullptr;
+  for (int i = 0; i < handshakes; ++i) {
+    SSL_SESSION *s = one_request(ctx, port, nullptr, nullptr);
+    if (session)
+      SSL_SESSION_free(session);
+    session = s;
+  }
+  double full = seconds_since(start);
+
+  int reused = 0;
+  std::size_t allocations_before = allocations, bytes_before = allocated_bytes;
+  start = clock_type::now();
+  for (int i = 0; i < handshakes; ++i) {
+    bool was_reused = false;
+    SSL_SESSION *s = one_request(ctx, port, session, &was_reused);
+    reused += was_reused;
+    SSL_SESSION_free(session);
+    session = s;
+  }
+  double resumed = seconds_since(start);
+  double per_connection = double(allocations - allocations_before) / handshakes;
+  double allocated = double(allocated_bytes - bytes_before) / handshakes;
+  SSL_SESSION_free(session);
+
+  int fd = connect_to(port);
+  SSL *ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (SSL_connect(ssl) != 1)
+    fail("SSL_connect");
+  const int bodies = 16;
+  start = clock_type::now();
+  std::size_t bytes = 0;
+  for (int i = 0; i < bodies; ++i)
+    bytes += get(ssl, "/big");
+  double bulk = seconds_since(start);
+  start = clock_type::now();
+  std::size_t file_bytes = 0;
+  for (int i = 0; i < bodies; ++i)
+    file_bytes += get(ssl, "/file");
+  double file_bulk = seconds_since(start);
+  std::printf("cipher          %s%s\n", SSL_get_cipher(ssl), ktls ? " (kernel_tls requested)" : "");
+  SSL_free(ssl);
+  ::close(fd);
+
+  std::printf("full handshake  %8.0f connections/s\n", handshakes / full);
+  std::printf("resumed         %8.0f connections/s (%d of %d resumed)\n", handshakes / resumed, reused, handshakes);
+  std::printf("server memory   %8.0f allocations, %.0f bytes per resumed connection\n", per_connection, allocated);
+  std::printf("bulk            %8.1f MB/s\n", bytes / bulk / (1 << 20));
+  std::printf("file            %8.1f MB/s\n", file_bytes / file_bulk / (1 << 20));
+
+  app.stop();
+  server.join();
+  SSL_CTX_free(ctx);
+  return 0;
+}
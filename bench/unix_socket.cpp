@@ -0,0 +1,86 @@
+//
+// Created by Shihao Jing on 9/2/17.
+//
+
+// Loopback TCP against a Unix domain socket, for clients on the same host:
+// latency of small requests on a keep-alive connection, and new
+// connections per second with one request each. One server listens on
+// both.
+//
+//   unix_socket [port] [path]
+
+#include "zion.h"
+#include "bench_util.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace bench;
+
+static int connect_unix(const std::string &path) {
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    fail("connect");
+  return fd;
+}
+
+static const std::string keep_alive_request = get_request("/hello");
+static const std::string close_request = get_request("/hello", true);
+
+template <typename Connect>
+static void measure(const char *name, Connect connect) {
+  int fd = connect();
+  for (int i = 0; i < 1000; ++i)
+    get(fd, keep_alive_request);
+  const int requests = 20000;
+  std::vector<double> latencies;
+  latencies.reserve(requests);
+  for (int i = 0; i < requests; ++i) {
+    auto start = clock_type::now();
+    get(fd, keep_alive_request);
+    latencies.push_back(micros_since(start));
+  }
+  ::close(fd);
+  std::sort(latencies.begin(), latencies.end());
+
+  const int connections = 2000;
+  auto start = clock_type::now();
+  for (int i = 0; i < connections; ++i) {
+    int c = connect();
+    get(c, close_request);
+    ::close(c);
+  }
+  double seconds = seconds_since(start);
+
+  std::printf("%-6s %9.1f %9.1f %14.0f\n", name, latencies[requests / 2], latencies[requests * 99 / 100],
+              connections / seconds);
+}
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? std::atoi(argv[1]) : 18083;
+  std::string path = argc > 2 ? argv[2] : "/tmp/zion-bench.sock";
+
+  zion::Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  app.port(std::to_string(port)).bindaddr("127.0.0.1").unix_socket(path);
+  std::thread server([&app] { app.run(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  std::printf("%-6s %9s %9s %14s\n", "", "p50 us", "p99 us", "connections/s");
+  measure("tcp", [port] { return connect_to(port); });
+  measure("unix", [&path] { return connect_unix(path); });
+
+  app.stop();
+  server.join();
+  return 0;
+}
@@ -4,6 +4,8 @@
 
 #include "zion.h"
 #include <sstream>
+#include <thread>
+#include <chrono>
 
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
@@ -38,7 +40,7 @@ int main() {
         return zion::response(os.str());
       });
 
-  ROUTE(app, "/id/<string>")
+  ROUTE(app, "/id/<string>").offload()   // rendered on the offload pool, the io thread is not held
       ([](std::string name) {
         mustache tmpl{"<html> <h1>Hello {{name}}!</h1> </html>"};
         return zion::response(tmpl.render({"name", name}));
@@ -51,13 +53,56 @@ int main() {
         return zion::response(os.str());
       });
 
+  ROUTE(app, "/count/<int>")
+      ([](int64_t n) {   // body is streamed one line per chunk
+        auto i = std::make_shared<int64_t>(0);
+        return zion::response(zion::body_producer([n, i](std::string &chunk) {
+          chunk = std::to_string((*i)++) + "\n";
+          return *i < n;
+        }));
+      });
+
+  ROUTE(app, "/ticks/<int>")
+      .sse([](std::shared_ptr<zion::event_stream> stream, int64_t n) {   // events may be pushed from any thread
+        std::thread([stream, n] {
+          for (int64_t i = 0; i < n && stream->push(std::to_string(i), "tick"); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          stream->close();
+        }).detach();
+      });
+
+  ROUTE(app, "/echo")
+      .websocket([](std::shared_ptr<zion::websocket::session> ws) {
+        ws->on_message([](zion::websocket::session &s, const std::string &data, bool is_binary) {
+          if (is_binary)
+            s.send_binary(data);
+          else
+            s.send_text(data);
+        });
+      });
+
+  ROUTE(app, "/later/<int>")
+      .async([](zion::responder respond, int64_t ms) {   // answered from another thread, the io thread is not held
+        std::thread([respond, ms] {
+          std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+          respond("done after " + std::to_string(ms) + " ms");
+        }).detach();
+      });
+
+#ifdef ZION_HAS_COROUTINES
+  ROUTE(app, "/sleep/<int>")([](int64_t ms) -> zion::task<zion::response> {   // -std=c++20
+    co_await zion::sleep_for(std::chrono::milliseconds(ms));
+    co_return "slept " + std::to_string(ms) + " ms";
+  });
+#endif
+
   ROUTE(app, "/hello")([](const request &req){
     string url = req.uri;
     string method = req.method;
     return "hello world!";
   });
 
-  ROUTE(app, "/index")([](const zion::request &req){
+  ROUTE(app, "/index").offload()([](const zion::request &req){
     Document d;
     d.Parse(req.body.data());
     // 2. Modify it by DOM.
@@ -68,10 +113,11 @@ int main() {
     StringBuffer buffer;
     Writer<StringBuffer> writer(buffer);
     d.Accept(writer);
-    return buffer.GetString();
+    return std::string(buffer.GetString());
   });
 
   app.port("8080")
       .bindaddr("127.0.0.1")
+      .access_log("-")
       .run();
 }
\ No newline at end of file
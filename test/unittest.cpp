@@ -85,4 +85,1655 @@ TEST(Routing, Tagging) {
   EXPECT_EQ(util::get_parameter_tag("<int><int>"), 7);
   EXPECT_EQ(util::get_parameter_tag("<float><float>"), 14);
   EXPECT_EQ(util::get_parameter_tag("<string><string>"), 21);
-}
\ No newline at end of file
+}
+
+TEST(Utility, UrlDecode) {
+  {
+    string s = "/search/a%20b%2Fc";
+    ASSERT_TRUE(util::url_decode(s));
+    EXPECT_EQ("/search/a b/c", s);
+  }
+  {
+    string s = "a+b%2b%e4%B8%AD";
+    ASSERT_TRUE(util::url_decode(s));
+    EXPECT_EQ("a+b+\xe4\xb8\xad", s);
+  }
+  {
+    string s = "a+b";
+    ASSERT_TRUE(util::url_decode(s, true));
+    EXPECT_EQ("a b", s);
+  }
+  {
+    string s = "plain";
+    ASSERT_TRUE(util::url_decode(s));
+    EXPECT_EQ("plain", s);
+  }
+  {
+    string s = "%";
+    EXPECT_FALSE(util::url_decode(s));
+    s = "%2";
+    EXPECT_FALSE(util::url_decode(s));
+    s = "%zz";
+    EXPECT_FALSE(util::url_decode(s));
+    s = "ab%g1";
+    EXPECT_FALSE(util::url_decode(s));
+  }
+  {
+    Trie trie;
+    trie.insert("/name/<string>", 0);
+    util::routing_param routing_params;
+    ASSERT_EQ(0, trie.search("/name/John%20Doe", routing_params));
+    EXPECT_EQ("John Doe", routing_params.string_params.back());
+  }
+}
+
+TEST(Utility, NormalizePath) {
+  auto normalized = [](string s) {
+    return util::normalize_path(s) ? s : string("<rejected>");
+  };
+  EXPECT_EQ("/", normalized("/"));
+  EXPECT_EQ("/", normalized("//"));
+  EXPECT_EQ("/a/b/d", normalized("/a//b/./c/../d"));
+  EXPECT_EQ("/a..b/c", normalized("/a..b/c"));
+  EXPECT_EQ("/.hidden", normalized("/.hidden"));
+  EXPECT_EQ("/a/", normalized("/a/"));
+  EXPECT_EQ("/a/", normalized("/a/."));
+  EXPECT_EQ("/a/", normalized("/a/b/.."));
+  EXPECT_EQ("/", normalized("/a/.."));
+  EXPECT_EQ("<rejected>", normalized("/.."));
+  EXPECT_EQ("<rejected>", normalized("/a/../../etc/passwd"));
+  EXPECT_EQ("<rejected>", normalized("a/b"));
+  EXPECT_EQ("<rejected>", normalized(""));
+  EXPECT_EQ("<rejected>", normalized(string("/a\0b", 4)));
+}
+
+TEST(StaticFiles, StayBeneathDocRoot) {
+  char base[] = "/tmp/zion-static-XXXXXX";
+  ASSERT_NE(nullptr, ::mkdtemp(base));
+  string root = string(base) + "/root";
+  auto write = [](const string &path, const string &content) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_EQ(static_cast<ssize_t>(content.size()), ::write(fd, content.data(), content.size()));
+    ::close(fd);
+  };
+  ASSERT_EQ(0, ::mkdir(root.c_str(), 0755));
+  ASSERT_EQ(0, ::mkdir((root + "/sub").c_str(), 0755));
+  write(root + "/index.html", "home");
+  write(root + "/a..b", "dots");
+  write(root + "/sub/page.txt", "page");
+  write(string(base) + "/secret", "secret");
+  ASSERT_EQ(0, ::symlink("../secret", (root + "/leak").c_str()));
+  ASSERT_EQ(0, ::symlink("..", (root + "/up").c_str()));
+
+  Zion app;
+  app.static_files(root);
+  auto get = [&app](const string &uri) {
+    request req;
+    req.method_code = (int)HTTPMethod::GET;
+    req.uri = uri;
+    response res = app.handle(req);
+    return res.file ? to_string(res.file->size) : to_string(res.status_);
+  };
+  EXPECT_EQ("4", get("/"));
+  EXPECT_EQ("4", get("/a..b"));
+  EXPECT_EQ("4", get("/sub/page.txt?v=1"));
+  EXPECT_EQ("4", get("/sub/../index.html"));
+  EXPECT_EQ(to_string(response::bad_request), get("/../secret"));
+  EXPECT_EQ(to_string(response::bad_request), get("/%2e%2e/secret"));
+  EXPECT_EQ(to_string(response::not_found), get("/leak"));
+  EXPECT_EQ(to_string(response::not_found), get("/up/secret"));
+  EXPECT_EQ(to_string(response::not_found), get("/sub"));
+
+  for (const char *name : {"/root/leak", "/root/up", "/root/sub/page.txt", "/root/sub", "/root/a..b",
+                           "/root/index.html", "/root", "/secret", ""})
+    ::remove((string(base) + name).c_str());
+}
+
+TEST(Response, StreamingHeaders) {
+  auto flatten = [](const vector<boost::asio::const_buffer> &buffers) {
+    string out;
+    for (auto &b : buffers)
+      out.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+    return out;
+  };
+
+  response plain("hello");
+  EXPECT_EQ("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 5\r\n\r\nhello", flatten(plain.to_buffers()));
+  plain.keep_alive = true;
+  EXPECT_EQ("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Length: 5\r\n\r\nhello", flatten(plain.to_buffers()));
+
+  response streamed(body_producer([](string &chunk) {
+    chunk = "ignored";
+    return false;
+  }));
+  EXPECT_TRUE(streamed.is_streaming());
+  EXPECT_EQ("HTTP/1.1 200 OK\r\nConnection: close\r\nTransfer-Encoding: chunked\r\n\r\n",
+            flatten(streamed.to_buffers()));
+}
+
+TEST(Response, SendFile) {
+  char path[] = "/tmp/zion-send-file-XXXXXX";
+  int fd = ::mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(5, ::write(fd, "hello", 5));
+  ::close(fd);
+
+  // The body stays in the file; only the head is in buffers.
+  response file = response::send_file(path);
+  ASSERT_TRUE(file.is_file());
+  EXPECT_EQ(5u, file.file->size);
+  EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length: 5\r\n\r\n",
+            [&] {
+              string out;
+              for (auto &b : file.to_buffers())
+                out.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+              return out;
+            }());
+  ::unlink(path);
+
+  EXPECT_EQ(response::not_found, response::send_file(path).status_);
+  EXPECT_EQ(response::not_found, response::send_file("/tmp").status_);
+}
+
+TEST(Response, Responder) {
+  // Handlers run only once posted, as on the io thread.
+  vector<function<void()>> posted;
+  auto post = [&posted](function<void()> handler) { posted.push_back(std::move(handler)); };
+  vector<response> delivered;
+  boost::asio::io_service io_service;
+  auto deliver = [&delivered](response res) { delivered.push_back(std::move(res)); };
+
+  responder respond = detail::make_responder(post, deliver, io_service.get_executor());
+  responder copy = respond;
+  respond("first");
+  copy(response::not_found);
+  EXPECT_TRUE(delivered.empty());
+  ASSERT_EQ(1u, posted.size());
+  posted[0]();
+  ASSERT_EQ(1u, delivered.size());
+  EXPECT_EQ("first", delivered[0].content);
+
+  // Dropped unanswered: a 500.
+  posted.clear();
+  delivered.clear();
+  detail::make_responder(post, deliver, io_service.get_executor());
+  ASSERT_EQ(1u, posted.size());
+  posted[0]();
+  ASSERT_EQ(1u, delivered.size());
+  EXPECT_EQ(response::internal_server_error, delivered[0].status_);
+}
+
+TEST(CpuPool, RunsEveryJob) {
+  atomic<int> done{0};
+  {
+    cpu_pool pool(3);
+    // Jobs posted by a job queue on its worker, for the others to steal.
+    for (int i = 0; i < 100; ++i) {
+      pool.post([&pool, &done] {
+        for (int j = 0; j < 10; ++j)
+          pool.post([&done] { ++done; });
+        ++done;
+      });
+    }
+    pool.post([] { throw runtime_error("dropped"); });
+  }
+  // Destroying the pool runs what is left.
+  EXPECT_EQ(1100, done);
+}
+
+TEST(CpuPool, OffloadedRoute) {
+  boost::asio::io_service io_service;
+  vector<response> delivered;
+  thread::id handler_thread;
+  auto handler = [&handler_thread](int n) {
+    handler_thread = this_thread::get_id();
+    return to_string(2 * n);
+  };
+  response res = detail::offload_handler(std::false_type(), handler, 21);
+  ASSERT_TRUE(res.is_async());
+  res.on_async(detail::make_responder([&io_service](function<void()> handler) { boost::asio::post(io_service, std::move(handler)); },
+                                      [&delivered](response res) { delivered.push_back(std::move(res)); },
+                                      io_service.get_executor()));
+  while (delivered.empty()) {
+    io_service.restart();
+    io_service.run_one_for(std::chrono::seconds(1));
+  }
+  EXPECT_EQ("42", delivered[0].content);
+  EXPECT_NE(this_thread::get_id(), handler_thread);
+}
+
+#ifdef ZION_HAS_COROUTINES
+TEST(Task, AnswersWhenDone) {
+  boost::asio::io_service io_service;
+  vector<response> delivered;
+  auto serve = [&](response res) {
+    ASSERT_TRUE(res.is_async());
+    res.on_async(detail::make_responder([&io_service](function<void()> handler) { boost::asio::post(io_service, std::move(handler)); },
+                                        [&delivered](response res) { delivered.push_back(std::move(res)); },
+                                        io_service.get_executor()));
+    // Offloaded work holds no work on io_service: run until answered.
+    size_t answered = delivered.size() + 1;
+    while (delivered.size() < answered) {
+      io_service.restart();
+      io_service.run_one_for(std::chrono::seconds(1));
+    }
+  };
+
+  auto twice = [](int n) -> task<response> {
+    co_await sleep_for(std::chrono::milliseconds(1));
+    int doubled = co_await offload([n] { return 2 * n; });
+    co_return response(std::to_string(doubled));
+  };
+  serve(detail::call_handler(twice, 21));
+  ASSERT_EQ(1u, delivered.size());
+  EXPECT_EQ("42", delivered[0].content);
+
+  auto fails = [](int n) -> task<response> {
+    co_await offload([] { throw std::runtime_error("no"); });
+    co_return response(std::to_string(n));
+  };
+  serve(detail::call_handler(fails, 1));
+  ASSERT_EQ(2u, delivered.size());
+  EXPECT_EQ(response::internal_server_error, delivered[1].status_);
+}
+#endif
+
+namespace {
+
+class recording_event_stream : public event_stream
+{
+public:
+  using event_stream::take_pending;
+  using event_stream::mark_closed;
+  int flushes = 0;
+
+private:
+  void schedule_flush() override { ++flushes; }
+};
+
+} // namespace
+
+TEST(EventStream, Batching) {
+  recording_event_stream stream;
+  EXPECT_TRUE(stream.push("one"));
+  EXPECT_TRUE(stream.push("two\nlines", "update", "7"));
+  EXPECT_EQ(1, stream.flushes);
+
+  string out;
+  ASSERT_TRUE(stream.take_pending(out));
+  EXPECT_EQ("data: one\n\nevent: update\nid: 7\ndata: two\ndata: lines\n\n", out);
+
+  EXPECT_TRUE(stream.push("three"));
+  EXPECT_EQ(2, stream.flushes);
+
+  stream.close();
+  EXPECT_FALSE(stream.push("dropped"));
+  ASSERT_TRUE(stream.take_pending(out));
+  EXPECT_EQ("data: three\n\n", out);
+  EXPECT_FALSE(stream.take_pending(out));
+}
+
+TEST(WebSocket, Handshake) {
+  // Example from RFC 6455 section 1.3.
+  EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", websocket::accept_key("dGhlIHNhbXBsZSBub25jZQ=="));
+}
+
+TEST(WebSocket, Framing) {
+  const unsigned char key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  for (size_t size : {0, 1, 5, 8, 15, 16, 17, 33, 200}) {
+    string payload(size, '\0');
+    for (size_t i = 0; i < size; ++i)
+      payload[i] = static_cast<char>(i * 7 + 3);
+    string masked = payload;
+    for (size_t i = 0; i < size; ++i)
+      masked[i] ^= key[i % 4];
+    websocket::unmask(&masked[0], masked.size(), key);
+    EXPECT_EQ(payload, masked);
+  }
+
+  {
+    // Masked "Hello" from RFC 6455 section 5.7.
+    const char frame[] = "\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58";
+    websocket::frame_header h;
+    EXPECT_EQ(0, websocket::parse_frame_header(frame, 5, h));
+    ASSERT_EQ(1, websocket::parse_frame_header(frame, sizeof(frame) - 1, h));
+    EXPECT_TRUE(h.fin);
+    EXPECT_EQ(websocket::text, h.opcode);
+    EXPECT_TRUE(h.masked);
+    ASSERT_EQ(5u, h.payload_length);
+    string payload(frame + h.size, h.payload_length);
+    websocket::unmask(&payload[0], payload.size(), h.mask);
+    EXPECT_EQ("Hello", payload);
+  }
+
+  for (size_t size : {125, 126, 65535, 65536}) {
+    auto frame = websocket::make_frame(websocket::binary, string(size, 'x'));
+    websocket::frame_header h;
+    ASSERT_EQ(1, websocket::parse_frame_header(frame->data(), frame->size(), h));
+    EXPECT_FALSE(h.masked);
+    EXPECT_EQ(size, h.payload_length);
+    EXPECT_EQ(frame->size(), h.size + size);
+  }
+}
+
+TEST(AccessLog, Ring) {
+  spsc_ring<int, 4> ring;
+  EXPECT_EQ(nullptr, ring.front());
+  for (int i = 0; i < 4; ++i) {
+    int *slot = ring.begin_push();
+    ASSERT_NE(nullptr, slot);
+    *slot = i;
+    ring.end_push();
+  }
+  EXPECT_EQ(nullptr, ring.begin_push());
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_NE(nullptr, ring.front());
+    EXPECT_EQ(i, *ring.front());
+    ring.pop();
+  }
+  EXPECT_EQ(nullptr, ring.front());
+}
+
+TEST(AccessLog, RingPerThreadPerLog) {
+  access_log a("/dev/null"), b("/dev/null");
+  // Writing to two logs in turn keeps one ring in each.
+  for (int i = 0; i < 3; ++i) {
+    for (access_log *log : {&a, &b}) {
+      access_record *rec = log->reserve();
+      ASSERT_NE(nullptr, rec);
+      *rec = access_record();
+      log->commit();
+    }
+  }
+  EXPECT_EQ(1u, a.rings());
+  EXPECT_EQ(1u, b.rings());
+}
+
+TEST(AccessLog, Format) {
+  access_record rec = {};
+  rec.timestamp_us = 1500000000LL * 1000000;
+  rec.duration_us = 42;
+  rec.status = 404;
+  rec.method = HTTP_GET;
+  rec.address_family = 4;
+  rec.address[0] = 127;
+  rec.address[3] = 1;
+  rec.bytes_sent = 120;
+  rec.uri_length = 5;
+  memcpy(rec.uri, "/nope", 5);
+
+  string line;
+  access_log::format(rec, line);
+  EXPECT_EQ("127.0.0.1 - - [14/Jul/2017:02:40:00 +0000] \"GET /nope\" 404 120 42\n", line);
+
+  // Garbage never reaches a method.
+  request req;
+  request_parser parser;
+  parser.reset(&req);
+  size_t consumed = 0;
+  ASSERT_EQ(request_parser::bad, parser.parse("\x01\x02\r\n\r\n", 6, consumed));
+  rec.method = static_cast<uint8_t>(req.method_code);
+  rec.status = 400;
+  rec.uri_length = 0;
+  line.clear();
+  access_log::format(rec, line);
+  EXPECT_EQ("127.0.0.1 - - [14/Jul/2017:02:40:00 +0000] \"- \" 400 120 42\n", line);
+}
+
+TEST(RequestParser, Pipelining) {
+  const string input =
+      "GET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+      "POST /b HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody"
+      "GET /c HTTP/1.0\r\n";
+
+  request req;
+  request_parser parser;
+  parser.reset(&req);
+  size_t pos = 0, consumed = 0;
+
+  ASSERT_EQ(request_parser::good, parser.parse(input.data(), input.size(), consumed));
+  EXPECT_EQ("/a", req.uri);
+  EXPECT_TRUE(req.keep_alive);
+  pos += consumed;
+
+  req = request();
+  parser.reset(&req);
+  // Feed the second request in two pieces.
+  ASSERT_EQ(request_parser::indeterminate, parser.parse(input.data() + pos, 20, consumed));
+  EXPECT_EQ(20u, consumed);
+  pos += consumed;
+  ASSERT_EQ(request_parser::good, parser.parse(input.data() + pos, input.size() - pos, consumed));
+  EXPECT_EQ("/b", req.uri);
+  EXPECT_EQ("body", req.body);
+  EXPECT_EQ(static_cast<unsigned>(HTTP_POST), req.method_code);
+  pos += consumed;
+
+  req = request();
+  parser.reset(&req);
+  ASSERT_EQ(request_parser::indeterminate, parser.parse(input.data() + pos, input.size() - pos, consumed));
+  EXPECT_TRUE(parser.headers_complete() == false);
+  ASSERT_EQ(request_parser::good, parser.parse("\r\n", 2, consumed));
+  EXPECT_EQ("/c", req.uri);
+  EXPECT_FALSE(req.keep_alive);
+
+  req = request();
+  parser.reset(&req);
+  EXPECT_EQ(request_parser::bad, parser.parse("BOGUS\r\n\r\n", 9, consumed));
+}
+
+namespace {
+
+struct counting_entry : timer_wheel::entry
+{
+  std::vector<int> *fired;
+  int id;
+  void on_expire() override { fired->push_back(id); }
+};
+
+} // namespace
+
+TEST(TimerWheel, ExpiresInOrder) {
+  boost::asio::io_service io_service;
+  timer_wheel wheel(io_service, std::chrono::milliseconds(5), 8);
+  std::vector<int> fired;
+  counting_entry a, b, c, d;
+  a.fired = b.fired = c.fired = d.fired = &fired;
+  a.id = 1; b.id = 2; c.id = 3; d.id = 4;
+
+  wheel.schedule(c, std::chrono::milliseconds(60));   // longer than one turn of the wheel
+  wheel.schedule(a, std::chrono::milliseconds(5));
+  wheel.schedule(b, std::chrono::milliseconds(20));
+  wheel.schedule(d, std::chrono::milliseconds(10));
+  EXPECT_EQ(4u, wheel.size());
+  d.cancel();
+  EXPECT_FALSE(d.active());
+  EXPECT_EQ(3u, wheel.size());
+
+  io_service.run();
+  EXPECT_EQ((std::vector<int>{1, 2, 3}), fired);
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(TimerWheel, ManualAdvance) {
+  timer_wheel wheel(std::chrono::milliseconds(20), 4);
+  std::vector<int> fired;
+  counting_entry a, b;
+  a.fired = b.fired = &fired;
+  a.id = 1; b.id = 2;
+
+  wheel.schedule(a, std::chrono::milliseconds(20));
+  wheel.schedule(b, std::chrono::milliseconds(400));  // wraps the wheel
+  wheel.advance();
+  EXPECT_TRUE(fired.empty());
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  wheel.advance();
+  EXPECT_EQ((std::vector<int>{1}), fired);
+  EXPECT_TRUE(b.active());
+  b.cancel();
+  EXPECT_EQ(0u, wheel.size());
+}
+
+namespace {
+
+struct pooled_connection
+{
+  explicit pooled_connection(int s) : socket(s) {}
+  void reset(int s) { socket = s; }
+  void recycle() { ++recycled; socket = -1; }
+  int socket;
+  int recycled = 0;
+};
+
+} // namespace
+
+TEST(ConnectionPool, Recycles) {
+  auto pool = std::make_shared<connection_pool<pooled_connection>>(1);
+  int made = 0;
+  auto make = [&made](int s) {
+    ++made;
+    return new pooled_connection(s);
+  };
+
+  int released = 0;
+  pool->on_release([&released] { ++released; });
+
+  pooled_connection *first;
+  {
+    auto a = pool->acquire(1, make);
+    auto b = pool->acquire(2, make);
+    first = a.get();
+    EXPECT_EQ(2, made);
+    EXPECT_EQ(2u, pool->active());
+    int sockets = 0;
+    pool->for_each_active([&sockets](pooled_connection *c) { sockets += c->socket; });
+    EXPECT_EQ(3, sockets);
+  }
+  // Only one idle connection is kept.
+  EXPECT_EQ(1u, pool->idle());
+  EXPECT_EQ(0u, pool->active());
+  EXPECT_EQ(2, released);
+
+  auto c = pool->acquire(3, make);
+  EXPECT_EQ(2, made);
+  EXPECT_EQ(3, c->socket);
+  EXPECT_EQ(1, c->recycled);
+  EXPECT_TRUE(c.get() == first || pool->idle() == 0);
+
+  // Connections released after the pool is gone are deleted.
+  pool.reset();
+  c.reset();
+}
+
+TEST(BufferPool, Reuse) {
+  buffer_pool pool(1);
+  char *a = pool.acquire();
+  char *b = pool.acquire();
+  EXPECT_NE(a, b);
+  pool.release(a);
+  pool.release(b);   // over the idle limit, freed
+  EXPECT_EQ(1u, pool.idle());
+  EXPECT_EQ(a, pool.acquire());
+  EXPECT_EQ(0u, pool.idle());
+  pool.release(a);
+}
+
+TEST(Arena, RequestHeaders) {
+  zion::arena arena(256);
+  request req(&arena);
+  request_parser parser;
+  size_t consumed;
+  const string input = "GET /a HTTP/1.1\r\nHost: x\r\nX-Long-Header-Name: a value well past the small string buffer\r\n\r\n";
+
+  for (int i = 0; i < 3; ++i) {
+    parser.reset(&req);
+    ASSERT_EQ(request_parser::good, parser.parse(input.data(), input.size(), consumed));
+    EXPECT_EQ("x", req.get_header("HOST"));
+    EXPECT_EQ("a value well past the small string buffer", req.get_header("x-long-header-name"));
+    EXPECT_GT(arena.used(), 0u);
+    req.clear();
+    arena.reset();
+    EXPECT_EQ(0u, arena.used());
+  }
+  // Overflowing blocks are merged on the first reset; later requests fit.
+  EXPECT_LE(arena.blocks_allocated(), 3u);
+  std::size_t blocks = arena.blocks_allocated();
+  parser.reset(&req);
+  ASSERT_EQ(request_parser::good, parser.parse(input.data(), input.size(), consumed));
+  EXPECT_EQ(blocks, arena.blocks_allocated());
+}
+
+TEST(Arena, Response) {
+  zion::arena arena;
+  response held;
+  for (int i = 0; i < 2; ++i) {
+    response res(&arena);
+    res.add_header("Content-Type", "application/json; charset=utf-8");
+    res.arena_content.assign("{\"message\":\"a body well past the small string buffer\"}");
+    std::size_t used = arena.used();
+    EXPECT_GT(used, 0u);
+
+    // Handed over as a handler's reply is, it stays in the arena.
+    held = std::move(res);
+    EXPECT_EQ(&arena, held.headers.get_allocator().get_arena());
+    EXPECT_EQ(used, arena.used());
+    held.keep_alive = true;
+    string out;
+    for (auto &b : held.to_buffers())
+      out.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nConnection: keep-alive\r\n"
+              "Content-Length: 54\r\n\r\n{\"message\":\"a body well past the small string buffer\"}", out);
+
+    // A copy escapes the request, so it is on the heap.
+    response copy = held;
+    EXPECT_EQ(nullptr, copy.headers.get_allocator().get_arena());
+    EXPECT_EQ("application/json; charset=utf-8", copy.headers[0].value);
+
+    held.clear();
+    EXPECT_EQ(nullptr, held.headers.get_allocator().get_arena());
+    EXPECT_EQ(0u, held.body().size());
+    arena.reset();
+  }
+  EXPECT_EQ(1u, arena.blocks_allocated());
+}
+
+TEST(Handoff, PassesFds) {
+  int pair[2], pipe_fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  ASSERT_EQ(0, ::pipe(pipe_fds));
+
+  ASSERT_TRUE(handoff::send_fds(pair[0], {pipe_fds[1]}));
+  std::vector<int> received = handoff::receive_fds(pair[1]);
+  ASSERT_EQ(1u, received.size());
+  EXPECT_NE(pipe_fds[1], received[0]);
+
+  // The received fd is the same pipe.
+  ASSERT_EQ(1, ::write(received[0], "x", 1));
+  char c = 0;
+  ASSERT_EQ(1, ::read(pipe_fds[0], &c, 1));
+  EXPECT_EQ('x', c);
+
+  ::close(pair[0]);
+  EXPECT_TRUE(handoff::receive_fds(pair[1]).empty());
+  for (int fd : {pair[1], pipe_fds[0], pipe_fds[1], received[0]})
+    ::close(fd);
+}
+
+TEST(BusyPoll, PinsThread) {
+  std::thread t([] {
+    EXPECT_TRUE(detail::pin_thread(-1));
+    int cpu = sched_getcpu();
+    EXPECT_TRUE(detail::pin_thread(cpu));
+    EXPECT_EQ(cpu, sched_getcpu());
+    EXPECT_FALSE(detail::pin_thread(CPU_SETSIZE - 1));
+  });
+  t.join();
+}
+
+TEST(Workers, ShareThePort) {
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 0);
+  server_config config;
+  config.workers = 2;
+  boost::asio::ip::tcp::acceptor first(io_service), second(io_service);
+  detail::open_listener(first, endpoint, config);
+  endpoint.port(first.local_endpoint().port());
+  detail::open_listener(second, endpoint, config);
+  EXPECT_EQ(first.local_endpoint(), second.local_endpoint());
+
+  boost::asio::ip::tcp::acceptor single(io_service);
+  config.workers = 1;
+  EXPECT_THROW(detail::open_listener(single, endpoint, config), boost::system::system_error);
+}
+
+TEST(Listeners, Ipv4AndIpv6OnOnePort) {
+  boost::asio::io_service io_service;
+  server_config config;
+  boost::asio::ip::tcp::acceptor v4(io_service), v6(io_service);
+  detail::open_listener(v4, {boost::asio::ip::address_v4::any(), 0}, config);
+  detail::open_listener(v6, {boost::asio::ip::address_v6::any(), v4.local_endpoint().port()}, config);
+  boost::asio::ip::v6_only v6_only;
+  v6.get_option(v6_only);
+  EXPECT_TRUE(v6_only.value());
+}
+
+TEST(Tcp, ListenerOptionsInherited) {
+  boost::asio::io_service io_service;
+  server_config config;
+  config.tcp.no_delay = true;
+  config.tcp.defer_accept = std::chrono::seconds(5);
+  boost::asio::ip::tcp::acceptor acceptor(io_service);
+  detail::open_listener(acceptor, {boost::asio::ip::address_v4::loopback(), 0}, config);
+  int value = 0;
+  socklen_t size = sizeof(value);
+  ASSERT_EQ(0, ::getsockopt(acceptor.native_handle(), IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, &size));
+  EXPECT_GT(value, 0);
+
+  boost::asio::ip::tcp::socket client(io_service), accepted(io_service);
+  client.connect(acceptor.local_endpoint());
+  boost::asio::write(client, boost::asio::buffer("x", 1));
+  acceptor.accept(accepted);
+  boost::asio::ip::tcp::no_delay no_delay;
+  accepted.get_option(no_delay);
+  EXPECT_TRUE(no_delay.value());
+}
+
+TEST(UnixSocket, ReplacesStaleSocketFile) {
+  boost::asio::io_service io_service;
+  server_config config;
+  std::string path = "/tmp/zion-unittest-" + std::to_string(::getpid()) + ".sock";
+  boost::asio::local::stream_protocol::endpoint endpoint(path);
+  {
+    // Closed without unlinking, as by a crashed server.
+    boost::asio::local::stream_protocol::acceptor stale(io_service);
+    detail::open_listener(stale, endpoint, config);
+  }
+  boost::asio::local::stream_protocol::acceptor acceptor(io_service);
+  detail::open_listener(acceptor, endpoint, config);
+
+  boost::asio::local::stream_protocol::acceptor second(io_service);
+  EXPECT_THROW(detail::open_listener(second, endpoint, config), boost::system::system_error);
+
+  boost::asio::local::stream_protocol::socket client(io_service), accepted(io_service);
+  client.connect(endpoint);
+  acceptor.accept(accepted);
+  access_record record;
+  record_peer(record, accepted);
+  EXPECT_EQ(0, record.address_family);
+  ::unlink(path.c_str());
+}
+
+namespace {
+
+unsigned short local_port(int fd) {
+  sockaddr_in addr{};
+  socklen_t size = sizeof(addr);
+  ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size);
+  return ntohs(addr.sin_port);
+}
+
+// Blocking client on a loopback port. Reads give up after the timeout, so
+// a server that never answers fails the test instead of hanging it; calls
+// interrupted by a signal, as with SO_RCVTIMEO they are even under
+// SA_RESTART, are retried.
+class loopback_client
+{
+public:
+  explicit loopback_client(unsigned short port)
+      : fd_(::socket(AF_INET, SOCK_STREAM, 0))
+  {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+      close();
+    timeout(std::chrono::seconds(2));
+  }
+
+  loopback_client(const loopback_client&) = delete;
+  loopback_client& operator=(const loopback_client&) = delete;
+
+  ~loopback_client() { close(); }
+
+  int fd() const { return fd_; }
+
+  void timeout(std::chrono::milliseconds t) {
+    timeval tv;
+    tv.tv_sec = t.count() / 1000;
+    tv.tv_usec = t.count() % 1000 * 1000;
+    ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  bool send(const string &bytes) {
+    for (std::size_t sent = 0; sent < bytes.size();) {
+      ssize_t n = ::send(fd_, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      sent += n;
+    }
+    return true;
+  }
+
+  // The next response, head and Content-Length body; empty if it has not
+  // all come before the connection closed or the timeout passed.
+  string response() {
+    std::size_t head;
+    while ((head = in_.find("\r\n\r\n")) == string::npos) {
+      if (!receive())
+        return string();
+    }
+    head += 4;
+    std::size_t length = 0;
+    std::size_t at = in_.find("Content-Length: ");
+    if (at != string::npos && at < head)
+      length = std::stoul(in_.substr(at + 16));
+    while (in_.size() < head + length) {
+      if (!receive())
+        return string();
+    }
+    string out = in_.substr(0, head + length);
+    in_.erase(0, head + length);
+    return out;
+  }
+
+  // Whether the server closes the connection within the timeout. What it
+  // sends first is discarded, and counted into discarded.
+  bool closed(std::size_t *discarded = nullptr) {
+    char buf[65536];
+    for (;;) {
+      ssize_t n = ::recv(fd_, buf, sizeof(buf), 0);
+      if (n == 0 || (n < 0 && errno == ECONNRESET))
+        return true;
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return false;
+      if (discarded)
+        *discarded += n;
+    }
+  }
+
+  void close() {
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+private:
+  bool receive() {
+    char buf[65536];
+    ssize_t n;
+    do
+      n = ::recv(fd_, buf, sizeof(buf), 0);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return false;
+    in_.append(buf, n);
+    return true;
+  }
+
+  int fd_;
+  string in_;
+};
+
+string get(const string &path) {
+  return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+string body_of(const string &response) {
+  std::size_t head = response.find("\r\n\r\n");
+  return head == string::npos ? string() : response.substr(head + 4);
+}
+
+// Runs a server's run() on a thread of its own. The destructor shuts the
+// server down if the test has not.
+template <typename S>
+class server_thread
+{
+public:
+  explicit server_thread(S &server)
+      : server_(&server),
+        done_future_(done_.get_future()),
+        thread_([this] { serve(); })
+  {
+  }
+
+  // Makes the server on the new thread, as the io_uring engine needs.
+  explicit server_thread(std::function<std::unique_ptr<S>()> make)
+      : done_future_(done_.get_future()),
+        thread_([this, make]
+                {
+                  owned_ = make();
+                  server_ = owned_.get();
+                  made_.set_value();
+                  serve();
+                })
+  {
+    made_.get_future().wait();
+  }
+
+  ~server_thread() {
+    server_->shutdown();
+    thread_.join();
+  }
+
+  S& server() { return *server_; }
+
+  // Whether run() returns within the timeout.
+  bool returns_within(std::chrono::milliseconds timeout) {
+    return done_future_.wait_for(timeout) == std::future_status::ready;
+  }
+
+private:
+  void serve() {
+    server_->run();
+    done_.set_value();
+  }
+
+  S *server_ = nullptr;
+  std::unique_ptr<S> owned_;
+  std::promise<void> made_;
+  std::promise<void> done_;
+  std::future<void> done_future_;
+  std::thread thread_;
+};
+
+// Length of a listening socket's accept queue, and the backlog it was
+// given: TCP_INFO reports them for a listener in place of the ack counts.
+std::pair<unsigned, unsigned> accept_queue(int listener) {
+  tcp_info info{};
+  socklen_t size = sizeof(info);
+  ::getsockopt(listener, IPPROTO_TCP, TCP_INFO, &info, &size);
+  return {info.tcpi_unacked, info.tcpi_sacked};
+}
+
+} // namespace
+
+TEST(Server, MaxConnectionsAndBacklog) {
+  Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  server_config config;
+  config.max_connections = 2;
+  config.backlog = 7;
+  Zion::server_t server(&app, config);
+  int listener = server.listen<tcp_adaptor>({boost::asio::ip::address_v4::loopback(), 0});
+  EXPECT_EQ(7u, accept_queue(listener).second);
+  unsigned short port = local_port(listener);
+  server_thread<Zion::server_t> running(server);
+
+  loopback_client first(port), second(port);
+  ASSERT_TRUE(first.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(first.response()));
+  ASSERT_TRUE(second.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(second.response()));
+
+  // Both are kept alive, so the third waits in the backlog, unaccepted.
+  loopback_client third(port);
+  ASSERT_TRUE(third.send(get("/hello")));
+  third.timeout(std::chrono::milliseconds(300));
+  EXPECT_EQ("", third.response());
+  EXPECT_EQ(1u, accept_queue(listener).first);
+
+  first.close();
+  third.timeout(std::chrono::seconds(2));
+  EXPECT_EQ("hello", body_of(third.response()));
+  EXPECT_EQ(0u, accept_queue(listener).first);
+  ASSERT_TRUE(second.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(second.response()));
+}
+
+TEST(Server, DrainsOnShutdown) {
+  Zion app;
+  std::mutex mutex;
+  std::vector<responder> waiting;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  ROUTE(app, "/wait").async([&](responder respond) {
+    std::lock_guard<std::mutex> lock(mutex);
+    waiting.push_back(respond);
+  });
+  auto wait_for_request = [&] {
+    for (int i = 0; i < 200; ++i) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!waiting.empty())
+          return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  };
+  server_config config;
+  config.drain_timeout = std::chrono::milliseconds(500);
+
+  {
+    Zion::server_t server(&app, config);
+    unsigned short port = local_port(server.listen<tcp_adaptor>({boost::asio::ip::address_v4::loopback(), 0}));
+    server_thread<Zion::server_t> running(server);
+    loopback_client idle(port), busy(port);
+    ASSERT_TRUE(idle.send(get("/hello")));
+    EXPECT_EQ("hello", body_of(idle.response()));
+    ASSERT_TRUE(busy.send(get("/wait")));
+    wait_for_request();
+
+    // The idle keep-alive connection is closed at once; the request in
+    // flight is answered, with the connection closed after it.
+    server.shutdown();
+    idle.timeout(std::chrono::milliseconds(300));
+    EXPECT_TRUE(idle.closed());
+    EXPECT_FALSE(running.returns_within(std::chrono::milliseconds(50)));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ASSERT_EQ(1u, waiting.size());
+      waiting[0]("done");
+      waiting.clear();
+    }
+    string reply = busy.response();
+    EXPECT_EQ("done", body_of(reply));
+    EXPECT_NE(string::npos, reply.find("Connection: close"));
+    EXPECT_TRUE(busy.closed());
+    EXPECT_TRUE(running.returns_within(std::chrono::milliseconds(300)));
+  }
+
+  {
+    // A request never answered holds run() up only until drain_timeout.
+    Zion::server_t server(&app, config);
+    unsigned short port = local_port(server.listen<tcp_adaptor>({boost::asio::ip::address_v4::loopback(), 0}));
+    server_thread<Zion::server_t> running(server);
+    loopback_client busy(port);
+    ASSERT_TRUE(busy.send(get("/wait")));
+    wait_for_request();
+    auto start = std::chrono::steady_clock::now();
+    server.shutdown();
+    EXPECT_TRUE(running.returns_within(std::chrono::seconds(2)));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(450));
+    // Dropped before the server, whose executor they post their reply to.
+    std::lock_guard<std::mutex> lock(mutex);
+    waiting.clear();
+  }
+}
+
+TEST(Server, ConnectionDeadlines) {
+  Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  ROUTE(app, "/big")([] { return string(16 << 20, 'x'); });
+  server_config config;
+  config.timeouts.header = std::chrono::milliseconds(300);
+  config.timeouts.body = std::chrono::milliseconds(300);
+  config.timeouts.write = std::chrono::milliseconds(300);
+  config.timeouts.keep_alive = std::chrono::milliseconds(300);
+  Zion::server_t server(&app, config);
+  unsigned short port = local_port(server.listen<tcp_adaptor>({boost::asio::ip::address_v4::loopback(), 0}));
+  server_thread<Zion::server_t> running(server);
+  typedef std::chrono::steady_clock clock;
+  auto within = [](clock::time_point start, std::chrono::milliseconds limit) {
+    return clock::now() - start < limit;
+  };
+
+  {
+    // A header trickled in a line at a time is cut off all the same.
+    loopback_client slowloris(port);
+    slowloris.timeout(std::chrono::milliseconds(50));
+    auto start = clock::now();
+    ASSERT_TRUE(slowloris.send("GET /hello HTTP/1.1\r\n"));
+    bool closed = false;
+    while (!closed && within(start, std::chrono::seconds(3)))
+      closed = !slowloris.send("X-Slow: 1\r\n") || slowloris.closed();
+    EXPECT_TRUE(closed);
+    EXPECT_TRUE(within(start, std::chrono::seconds(1)));
+  }
+  {
+    loopback_client stalled_body(port);
+    auto start = clock::now();
+    ASSERT_TRUE(stalled_body.send("POST /hello HTTP/1.1\r\nHost: localhost\r\nContent-Length: 10\r\n\r\nab"));
+    EXPECT_TRUE(stalled_body.closed());
+    EXPECT_TRUE(within(start, std::chrono::seconds(1)));
+  }
+  {
+    loopback_client idle(port);
+    ASSERT_TRUE(idle.send(get("/hello")));
+    EXPECT_EQ("hello", body_of(idle.response()));
+    auto start = clock::now();
+    EXPECT_TRUE(idle.closed());
+    EXPECT_TRUE(within(start, std::chrono::seconds(1)));
+  }
+  {
+    // A client that stops reading: the reply no longer fits in the socket
+    // buffers, and the write is abandoned. What the kernel already holds
+    // still arrives, the smaller the receive buffer the slower.
+    loopback_client not_reading(port);
+    int size = 256 * 1024;
+    ::setsockopt(not_reading.fd(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    ASSERT_TRUE(not_reading.send(get("/big")));
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::size_t received = 0;
+    EXPECT_TRUE(not_reading.closed(&received));
+    EXPECT_LT(received, 16u << 20);
+  }
+}
+
+#ifdef ZION_HAS_IO_URING
+namespace {
+
+// A uring_server on a loopback port of its own, made by the thread running it.
+std::function<std::unique_ptr<Zion::uring_server_t>()> uring_on_loopback(Zion &app,
+                                                                        const server_config &config = server_config()) {
+  return [&app, config]
+  {
+    return std::unique_ptr<Zion::uring_server_t>(
+        new Zion::uring_server_t({boost::asio::ip::address_v4::loopback(), 0}, &app, config));
+  };
+}
+
+} // namespace
+
+TEST(Uring, KeepAliveAndPipelining) {
+  if (!uring::supported())
+    GTEST_SKIP();
+  Zion app;
+  ROUTE(app, "/echo/<int>")([](int64_t n) { return to_string(n); });
+  server_thread<Zion::uring_server_t> running(uring_on_loopback(app));
+  loopback_client client(running.server().local_endpoint().port());
+
+  ASSERT_TRUE(client.send(get("/echo/1") + get("/echo/2")));
+  string first = client.response();
+  EXPECT_EQ("1", body_of(first));
+  EXPECT_NE(string::npos, first.find("Connection: keep-alive"));
+  EXPECT_EQ("2", body_of(client.response()));
+  ASSERT_TRUE(client.send(get("/echo/3")));
+  EXPECT_EQ("3", body_of(client.response()));
+}
+
+TEST(Uring, LargeFile) {
+  if (!uring::supported())
+    GTEST_SKIP();
+  // Several splices' worth, and not a whole number of them.
+  string content;
+  for (int i = 0; content.size() < (3u << 20) + 123; ++i)
+    content += to_string(i) + '\n';
+  char path[] = "/tmp/zion-uring-file-XXXXXX";
+  int fd = ::mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(static_cast<ssize_t>(content.size()), ::write(fd, content.data(), content.size()));
+  ::close(fd);
+
+  Zion app;
+  string file = path;
+  ROUTE(app, "/file")([&file] { return response::send_file(file); });
+  server_thread<Zion::uring_server_t> running(uring_on_loopback(app));
+  loopback_client client(running.server().local_endpoint().port());
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(client.send(get("/file")));
+    EXPECT_TRUE(body_of(client.response()) == content);
+  }
+  ::unlink(path);
+}
+
+TEST(Uring, PipelinedBeyondBufferedInput) {
+  if (!uring::supported())
+    GTEST_SKIP();
+  Zion app;
+  ROUTE(app, "/n/<int>")([](int64_t n) { return to_string(n) + string(8192, '.'); });
+  server_thread<Zion::uring_server_t> running(uring_on_loopback(app));
+  loopback_client client(running.server().local_endpoint().port());
+
+  // Some 170 KB of requests for 32 MB of replies, none read until all are
+  // sent: the replies back up and the requests pile up behind them.
+  const int count = 4000;
+  std::thread sender([&client] {
+    string requests;
+    for (int i = 0; i < count; ++i)
+      requests += get("/n/" + to_string(i));
+    EXPECT_TRUE(client.send(requests));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  for (int i = 0; i < count; ++i) {
+    string body = body_of(client.response());
+    ASSERT_EQ(to_string(i), body.substr(0, body.find('.'))) << "response " << i;
+  }
+  sender.join();
+}
+
+TEST(Uring, MaxConnections) {
+  if (!uring::supported())
+    GTEST_SKIP();
+  Zion app;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  server_config config;
+  config.max_connections = 2;
+  server_thread<Zion::uring_server_t> running(uring_on_loopback(app, config));
+  unsigned short port = running.server().local_endpoint().port();
+
+  loopback_client first(port), second(port);
+  ASSERT_TRUE(first.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(first.response()));
+  ASSERT_TRUE(second.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(second.response()));
+
+  loopback_client third(port);
+  ASSERT_TRUE(third.send(get("/hello")));
+  third.timeout(std::chrono::milliseconds(300));
+  EXPECT_EQ("", third.response());
+
+  first.close();
+  third.timeout(std::chrono::seconds(2));
+  EXPECT_EQ("hello", body_of(third.response()));
+}
+
+TEST(Uring, DrainsOnSigterm) {
+  if (!uring::supported())
+    GTEST_SKIP();
+  Zion app;
+  std::mutex mutex;
+  std::vector<responder> waiting;
+  ROUTE(app, "/hello")([] { return "hello"; });
+  ROUTE(app, "/wait").async([&](responder respond) {
+    std::lock_guard<std::mutex> lock(mutex);
+    waiting.push_back(respond);
+  });
+  server_thread<Zion::uring_server_t> running(uring_on_loopback(app));
+  unsigned short port = running.server().local_endpoint().port();
+
+  loopback_client idle(port), busy(port);
+  ASSERT_TRUE(idle.send(get("/hello")));
+  EXPECT_EQ("hello", body_of(idle.response()));
+  ASSERT_TRUE(busy.send(get("/wait")));
+  for (int i = 0; i < 200; ++i) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!waiting.empty())
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  ASSERT_EQ(0, ::kill(::getpid(), SIGTERM));
+  EXPECT_TRUE(idle.closed());
+  EXPECT_FALSE(running.returns_within(std::chrono::milliseconds(50)));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(1u, waiting.size());
+    waiting[0]("done");
+    waiting.clear();
+  }
+  string reply = busy.response();
+  EXPECT_EQ("done", body_of(reply));
+  EXPECT_NE(string::npos, reply.find("Connection: close"));
+  EXPECT_TRUE(busy.closed());
+  EXPECT_TRUE(running.returns_within(std::chrono::milliseconds(500)));
+}
+#endif
+
+TEST(Hpack, Rfc7541Examples) {
+  // Integers from RFC 7541 C.1.
+  string out;
+  hpack::encode_integer(out, 0, 5, 10);
+  hpack::encode_integer(out, 0, 5, 1337);
+  hpack::encode_integer(out, 0, 8, 42);
+  EXPECT_EQ(string("\x0a\x1f\x9a\x0a\x2a", 5), out);
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(out.data()) + 1;
+  uint64_t value = 0;
+  ASSERT_TRUE(hpack::decode_integer(p, p + 3, 5, value));
+  EXPECT_EQ(1337u, value);
+
+  // Requests with Huffman coding from C.4, decoded on one connection.
+  const vector<vector<uint8_t>> blocks = {
+    { 0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff },
+    { 0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf },
+    { 0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25,
+      0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf }
+  };
+  const vector<string> expected = {
+    ":method: GET|:scheme: http|:path: /|:authority: www.example.com|",
+    ":method: GET|:scheme: http|:path: /|:authority: www.example.com|cache-control: no-cache|",
+    ":method: GET|:scheme: https|:path: /index.html|:authority: www.example.com|custom-key: custom-value|"
+  };
+  hpack::decoder decoder;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    string fields;
+    ASSERT_TRUE(decoder.decode(blocks[i].data(), blocks[i].size(), [&fields](const string &name, const string &value)
+    {
+      fields += name + ": " + value + "|";
+    }));
+    EXPECT_EQ(expected[i], fields);
+  }
+
+  // What the encoder writes decodes back, and indexed fields shrink to a
+  // byte the second time; content-length stays a literal.
+  hpack::encoder encoder;
+  hpack::decoder peer;
+  for (int i = 0; i < 2; ++i) {
+    string block;
+    encoder.begin(block);
+    encoder.encode(block, ":status", "200");
+    encoder.encode(block, "x-request-id", "f81d4fae-7dec-11d0");
+    encoder.encode(block, "content-length", "12", false);
+    if (i == 1) {
+      EXPECT_EQ(1u + 1u + 5u, block.size());
+    }
+    string fields;
+    ASSERT_TRUE(peer.decode(reinterpret_cast<const uint8_t*>(block.data()), block.size(),
+                            [&fields](const string &name, const string &value)
+                            {
+                              fields += name + ": " + value + "|";
+                            }));
+    EXPECT_EQ(":status: 200|x-request-id: f81d4fae-7dec-11d0|content-length: 12|", fields);
+  }
+}
+
+TEST(Http2, Framing) {
+  string out;
+  http2::append_frame_header(out, 0x1234, http2::headers_frame, http2::flag_end_headers, 0x80000003);
+  ASSERT_EQ(http2::frame_header_size, out.size());
+  http2::frame_header h = http2::parse_frame_header(reinterpret_cast<const uint8_t*>(out.data()));
+  EXPECT_EQ(0x1234u, h.length);
+  EXPECT_EQ(http2::headers_frame, h.type);
+  EXPECT_EQ(http2::flag_end_headers, h.flags);
+  // The reserved bit is ignored.
+  EXPECT_EQ(3u, h.stream_id);
+
+  // HTTP2-Settings of an h2c upgrade: MAX_CONCURRENT_STREAMS 100 and
+  // INITIAL_WINDOW_SIZE 65535, base64url without padding.
+  string payload;
+  ASSERT_TRUE(http2::decode_settings_header("AAMAAABkAAQAAP__", payload));
+  EXPECT_EQ(string("\x00\x03\x00\x00\x00\x64\x00\x04\x00\x00\xff\xff", 12), payload);
+  EXPECT_FALSE(http2::decode_settings_header("AAMAAABk!", payload));
+
+  unsigned int code = 0;
+  ASSERT_TRUE(http2::method_code("DELETE", code));
+  EXPECT_EQ(static_cast<unsigned int>(HTTP_DELETE), code);
+  EXPECT_FALSE(http2::method_code("BREW", code));
+}
+
+namespace {
+
+// Answers with the path, and the body after a colon if there is one.
+struct h2_handler
+{
+  response handle(const request &req) {
+    if (req.uri == "/big")
+      return response(string(100000, 'x'));
+    return response(req.uri + (req.body.empty() ? "" : ":" + req.body));
+  }
+};
+
+struct h2_frame
+{
+  http2::frame_header header;
+  string payload;
+};
+
+string h2_frame_bytes(uint8_t type, uint8_t flags, uint32_t stream_id, const string &payload = string()) {
+  string out;
+  http2::append_frame_header(out, static_cast<uint32_t>(payload.size()), type, flags, stream_id);
+  return out + payload;
+}
+
+string h2_uint32(uint32_t v) {
+  string out;
+  http2::append_uint32(out, v);
+  return out;
+}
+
+// A client talking to a session over a socketpair. exchange() sends bytes,
+// runs the session until it is idle and returns the frames it wrote back.
+class h2_client
+{
+public:
+  using session_type = http2::session<h2_handler, boost::asio::local::stream_protocol::socket>;
+
+  explicit h2_client(const http2::settings &local = http2::settings())
+      : local_(local),
+        socket_(io_service_)
+  {
+    boost::asio::local::stream_protocol::socket server(io_service_);
+    boost::asio::local::connect_pair(server, socket_);
+    session = std::make_shared<session_type>(std::move(server), &handler_, local_, std::chrono::seconds(60),
+                                             std::chrono::seconds(60), true);
+  }
+
+  // Handlers still queued hold the session; it goes with them while the
+  // io_service is still there.
+  ~h2_client() {
+    session.reset();
+  }
+
+  // The preface and an empty SETTINGS, as every client opens with.
+  static string preface() {
+    return string(http2::client_preface, http2::client_preface_size) + h2_frame_bytes(http2::settings_frame, 0, 0);
+  }
+
+  string request_block(const string &method, const string &path) {
+    string block;
+    encoder.begin(block);
+    encoder.encode(block, ":method", method);
+    encoder.encode(block, ":scheme", "http");
+    encoder.encode(block, ":path", path);
+    encoder.encode(block, ":authority", "localhost");
+    return block;
+  }
+
+  vector<h2_frame> exchange(const string &bytes = string()) {
+    if (!bytes.empty())
+      boost::asio::write(socket_, boost::asio::buffer(bytes));
+    bool progress;
+    do {
+      io_service_.restart();
+      progress = io_service_.poll() > 0;
+      char buf[65536];
+      ssize_t n;
+      while ((n = ::recv(socket_.native_handle(), buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        received_.append(buf, n);
+        progress = true;
+      }
+      if (n == 0)
+        closed = true;
+    } while (progress);
+
+    vector<h2_frame> frames;
+    std::size_t pos = 0;
+    while (received_.size() - pos >= http2::frame_header_size) {
+      http2::frame_header h = http2::parse_frame_header(reinterpret_cast<const uint8_t*>(received_.data()) + pos);
+      if (received_.size() - pos - http2::frame_header_size < h.length)
+        break;
+      frames.push_back(h2_frame{h, received_.substr(pos + http2::frame_header_size, h.length)});
+      pos += http2::frame_header_size + h.length;
+    }
+    received_.erase(0, pos);
+    return frames;
+  }
+
+  std::shared_ptr<session_type> session;
+  hpack::encoder encoder;
+  bool closed = false;
+
+private:
+  http2::settings local_;
+  h2_handler handler_;
+  boost::asio::io_service io_service_;
+  boost::asio::local::stream_protocol::socket socket_;
+  string received_;
+};
+
+vector<h2_frame> h2_frames_of(const vector<h2_frame> &frames, uint8_t type, uint32_t stream_id) {
+  vector<h2_frame> out;
+  for (auto &f : frames) {
+    if (f.header.type == type && f.header.stream_id == stream_id)
+      out.push_back(f);
+  }
+  return out;
+}
+
+// The body a stream got in these frames, and whether it ended.
+string h2_body(const vector<h2_frame> &frames, uint32_t stream_id, bool *ended = nullptr) {
+  string body;
+  for (auto &f : h2_frames_of(frames, http2::data_frame, stream_id)) {
+    body += f.payload;
+    if (ended)
+      *ended = (f.header.flags & http2::flag_end_stream) != 0;
+  }
+  return body;
+}
+
+uint32_t h2_goaway_code(const vector<h2_frame> &frames) {
+  auto goaway = h2_frames_of(frames, http2::goaway_frame, 0);
+  if (goaway.size() != 1 || goaway[0].payload.size() < 8)
+    return 0xffffffff;
+  return http2::read_uint32(reinterpret_cast<const uint8_t*>(goaway[0].payload.data()) + 4);
+}
+
+} // namespace
+
+TEST(Http2, SessionFlowControl) {
+  h2_client c;
+  c.session->start("", 0);
+  auto frames = c.exchange(h2_client::preface() +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 1,
+                                          c.request_block("GET", "/big")));
+  ASSERT_FALSE(frames.empty());
+  EXPECT_EQ(http2::settings_frame, frames[0].header.type);
+  EXPECT_EQ(1u, h2_frames_of(frames, http2::settings_frame, 0).size() - 1);   // and the ack of ours
+  EXPECT_EQ(1u, h2_frames_of(frames, http2::headers_frame, 1).size());
+  // Both windows start at 65535.
+  bool ended = true;
+  EXPECT_EQ(65535u, h2_body(frames, 1, &ended).size());
+  EXPECT_FALSE(ended);
+
+  // Only the stream's credit: the connection's is still spent.
+  frames = c.exchange(h2_frame_bytes(http2::window_update_frame, 0, 1, h2_uint32(100000)));
+  EXPECT_TRUE(h2_body(frames, 1).empty());
+  frames = c.exchange(h2_frame_bytes(http2::window_update_frame, 0, 0, h2_uint32(100000)));
+  EXPECT_EQ(100000u - 65535u, h2_body(frames, 1, &ended).size());
+  EXPECT_TRUE(ended);
+}
+
+TEST(Http2, SessionRequestBodyLimit) {
+  http2::settings local;
+  local.max_request_body_size = 1000;
+  h2_client c(local);
+  c.session->start("", 0);
+  // Credited as it arrives, but reset once past the limit.
+  string one = c.request_block("POST", "/one");
+  auto frames = c.exchange(h2_client::preface() + h2_frame_bytes(http2::headers_frame, http2::flag_end_headers, 1, one) +
+                           h2_frame_bytes(http2::data_frame, 0, 1, string(600, 'a')));
+  EXPECT_TRUE(h2_frames_of(frames, http2::rst_stream_frame, 1).empty());
+  frames = c.exchange(h2_frame_bytes(http2::data_frame, 0, 1, string(600, 'a')));
+  auto reset = h2_frames_of(frames, http2::rst_stream_frame, 1);
+  ASSERT_EQ(1u, reset.size());
+  EXPECT_EQ(static_cast<uint32_t>(http2::enhance_your_calm),
+            http2::read_uint32(reinterpret_cast<const uint8_t*>(reset[0].payload.data())));
+
+  // Up to the limit is fine.
+  string three = c.request_block("POST", "/three");
+  frames = c.exchange(h2_frame_bytes(http2::headers_frame, http2::flag_end_headers, 3, three) +
+                      h2_frame_bytes(http2::data_frame, 0, 3, string(600, 'b')) +
+                      h2_frame_bytes(http2::data_frame, http2::flag_end_stream, 3, string(400, 'b')));
+  EXPECT_EQ("/three:" + string(1000, 'b'), h2_body(frames, 3));
+  EXPECT_FALSE(c.closed);
+}
+
+TEST(Http2, SessionMultiplexing) {
+  h2_client c;
+  c.session->start("", 0);
+  // Stream 1 waits for its body while stream 3 is answered. Blocks are
+  // encoded in the order they are sent.
+  string one = c.request_block("POST", "/one");
+  string three = c.request_block("GET", "/three");
+  auto frames = c.exchange(h2_client::preface() +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_headers, 1, one) +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 3,
+                                          three));
+  EXPECT_TRUE(h2_frames_of(frames, http2::headers_frame, 1).empty());
+  EXPECT_EQ("/three", h2_body(frames, 3));
+
+  frames = c.exchange(h2_frame_bytes(http2::data_frame, 0, 1, "bo") +
+                      h2_frame_bytes(http2::data_frame, http2::flag_end_stream, 1, "dy"));
+  EXPECT_EQ(1u, h2_frames_of(frames, http2::headers_frame, 1).size());
+  EXPECT_EQ("/one:body", h2_body(frames, 1));
+}
+
+TEST(Http2, SessionContinuation) {
+  h2_client c;
+  c.session->start("", 0);
+  string block = c.request_block("GET", "/split");
+  auto frames = c.exchange(h2_client::preface() +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_stream, 1, block.substr(0, 3)) +
+                           h2_frame_bytes(http2::continuation_frame, 0, 1, block.substr(3, 2)) +
+                           h2_frame_bytes(http2::continuation_frame, http2::flag_end_headers, 1, block.substr(5)));
+  EXPECT_EQ("/split", h2_body(frames, 1));
+
+  // Nothing may come between a block's frames.
+  frames = c.exchange(h2_frame_bytes(http2::headers_frame, http2::flag_end_stream, 3, c.request_block("GET", "/")) +
+                      h2_frame_bytes(http2::ping_frame, 0, 0, string(8, 'p')));
+  EXPECT_EQ(static_cast<uint32_t>(http2::protocol_error), h2_goaway_code(frames));
+  EXPECT_TRUE(c.closed);
+
+  // A block that keeps growing, and one dribbled in empty frames.
+  h2_client growing;
+  growing.session->start("", 0);
+  string flood = h2_client::preface() + h2_frame_bytes(http2::headers_frame, http2::flag_end_stream, 1);
+  for (int i = 0; i < 8; ++i)
+    flood += h2_frame_bytes(http2::continuation_frame, 0, 1, string(http2::default_max_frame_size, 'a'));
+  frames = growing.exchange(flood);
+  EXPECT_EQ(static_cast<uint32_t>(http2::enhance_your_calm), h2_goaway_code(frames));
+  EXPECT_TRUE(growing.closed);
+
+  h2_client empty;
+  empty.session->start("", 0);
+  flood = h2_client::preface() + h2_frame_bytes(http2::headers_frame, http2::flag_end_stream, 1);
+  for (int i = 0; i < 100; ++i)
+    flood += h2_frame_bytes(http2::continuation_frame, 0, 1);
+  frames = empty.exchange(flood);
+  EXPECT_EQ(static_cast<uint32_t>(http2::enhance_your_calm), h2_goaway_code(frames));
+  EXPECT_TRUE(empty.closed);
+}
+
+TEST(Http2, SessionHeaderListLimit) {
+  http2::settings local;
+  local.max_header_list_size = 4096;
+  h2_client c(local);
+  c.session->start("", 0);
+  // One 3000-byte field in the table, then referenced 200 times by a byte
+  // each: far past the limit once decoded.
+  string block = c.request_block("GET", "/bomb");
+  c.encoder.encode(block, "x-big", string(3000, 'a'));
+  block.append(200, static_cast<char>(0x80 | 62));
+  auto frames = c.exchange(h2_client::preface() +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 1,
+                                          block));
+  auto reset = h2_frames_of(frames, http2::rst_stream_frame, 1);
+  ASSERT_EQ(1u, reset.size());
+  EXPECT_EQ(static_cast<uint32_t>(http2::protocol_error),
+            http2::read_uint32(reinterpret_cast<const uint8_t*>(reset[0].payload.data())));
+
+  // The table stayed in step: the next block refers into it.
+  frames = c.exchange(h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 3,
+                                     c.request_block("GET", "/bomb")));
+  EXPECT_EQ("/bomb", h2_body(frames, 3));
+  EXPECT_FALSE(c.closed);
+}
+
+TEST(Http2, SessionResetStream) {
+  h2_client c;
+  c.session->start("", 0);
+  auto frames = c.exchange(h2_client::preface() +
+                           h2_frame_bytes(http2::headers_frame, http2::flag_end_headers, 1,
+                                          c.request_block("POST", "/reset")) +
+                           h2_frame_bytes(http2::rst_stream_frame, 0, 1, h2_uint32(http2::cancel)));
+  EXPECT_TRUE(h2_frames_of(frames, http2::headers_frame, 1).empty());
+
+  // Data on the reset stream is refused, and the connection goes on.
+  frames = c.exchange(h2_frame_bytes(http2::data_frame, http2::flag_end_stream, 1, "late") +
+                      h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 3,
+                                     c.request_block("GET", "/after")));
+  auto reset = h2_frames_of(frames, http2::rst_stream_frame, 1);
+  ASSERT_EQ(1u, reset.size());
+  EXPECT_EQ(static_cast<uint32_t>(http2::stream_closed),
+            http2::read_uint32(reinterpret_cast<const uint8_t*>(reset[0].payload.data())));
+  EXPECT_EQ("/after", h2_body(frames, 3));
+
+  // A client that provokes acknowledgements faster than it reads them.
+  string flood;
+  for (int i = 0; i < 1001; ++i)
+    flood += h2_frame_bytes(http2::ping_frame, 0, 0, string(8, 'p'));
+  frames = c.exchange(flood);
+  EXPECT_EQ(static_cast<uint32_t>(http2::enhance_your_calm), h2_goaway_code(frames));
+  EXPECT_TRUE(c.closed);
+}
+
+TEST(Http2, SessionGoawayDrains) {
+  h2_client c;
+  c.session->start("", 0);
+  c.exchange(h2_client::preface() +
+             h2_frame_bytes(http2::headers_frame, http2::flag_end_headers, 1, c.request_block("POST", "/one")));
+  c.session->shutdown();
+  auto frames = c.exchange();
+  auto goaway = h2_frames_of(frames, http2::goaway_frame, 0);
+  ASSERT_EQ(1u, goaway.size());
+  EXPECT_EQ(1u, http2::read_uint32(reinterpret_cast<const uint8_t*>(goaway[0].payload.data())));
+  EXPECT_EQ(static_cast<uint32_t>(http2::no_error), h2_goaway_code(frames));
+  EXPECT_FALSE(c.closed);
+
+  // New streams are ignored; the open one is answered, then the connection
+  // closes.
+  frames = c.exchange(h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 3,
+                                     c.request_block("GET", "/three")) +
+                      h2_frame_bytes(http2::data_frame, http2::flag_end_stream, 1, "body"));
+  EXPECT_TRUE(h2_frames_of(frames, http2::headers_frame, 3).empty());
+  EXPECT_EQ("/one:body", h2_body(frames, 1));
+  EXPECT_TRUE(c.closed);
+}
+
+TEST(Http2, SessionUpgrade) {
+  // The request that asked for h2c becomes stream 1, answered before the
+  // client's preface arrives.
+  h2_client c;
+  request upgraded;
+  upgraded.method = "GET";
+  upgraded.method_code = HTTP_GET;
+  upgraded.uri = "/upgraded";
+  string settings;
+  ASSERT_TRUE(http2::decode_settings_header("AAMAAABkAAQAAP__", settings));
+  c.session->start("", 0, &upgraded, settings);
+  auto frames = c.exchange();
+  EXPECT_EQ("/upgraded", h2_body(frames, 1));
+
+  frames = c.exchange(h2_client::preface() +
+                      h2_frame_bytes(http2::headers_frame, http2::flag_end_headers | http2::flag_end_stream, 3,
+                                     c.request_block("GET", "/next")));
+  EXPECT_EQ("/next", h2_body(frames, 3));
+}
+
+#ifdef ZION_ENABLE_SSL
+TEST(Ssl, SelectsAlpn) {
+  const std::string ours("\x02h2\x08http/1.1", 12);
+  const unsigned char theirs[] = "\x08http/1.1\x06spdy/3";
+  const unsigned char *out = nullptr;
+  unsigned char out_len = 0;
+  ASSERT_TRUE(detail::select_alpn(ours, theirs, sizeof(theirs) - 1, &out, &out_len));
+  EXPECT_EQ("http/1.1", std::string(reinterpret_cast<const char*>(out), out_len));
+
+  const unsigned char other[] = "\x06spdy/3";
+  EXPECT_FALSE(detail::select_alpn(ours, other, sizeof(other) - 1, &out, &out_len));
+}
+#endif
@@ -0,0 +1,282 @@
+//
+// Created by Shihao Jing on 8/10/17.
+//
+
+#ifndef ZION_ACCESS_LOG_H
+#define ZION_ACCESS_LOG_H
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "http_parser.h"
+#include "request.h"
+
+namespace zion {
+
+/// Single-producer single-consumer ring of fixed-size slots. The producer
+/// fills a slot in place between begin_push() and end_push(), so a record is
+/// copied once, straight into shared memory.
+template <typename T, std::size_t N>
+class spsc_ring
+{
+  static_assert((N & (N - 1)) == 0, "ring capacity must be a power of two");
+
+public:
+  /// Slot to fill, or nullptr when the ring is full.
+  T* begin_push() {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N)
+      return nullptr;
+    return &slots_[head & (N - 1)];
+  }
+
+  void end_push() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /// Oldest record, or nullptr when the ring is empty.
+  const T* front() const {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+      return nullptr;
+    return &slots_[tail & (N - 1)];
+  }
+
+  void pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+private:
+  // Padded apart so the producer and consumer indices do not share a cache
+  // line (alignas would need C++17 aligned new for heap-allocated rings).
+  std::atomic<std::size_t> head_{0};
+  char head_pad_[64 - sizeof(std::atomic<std::size_t>)];
+  std::atomic<std::size_t> tail_{0};
+  char tail_pad_[64 - sizeof(std::atomic<std::size_t>)];
+  T slots_[N];
+};
+
+/// One request as captured on the io thread. Formatting into text is left to
+/// the writer thread.
+struct access_record
+{
+  int64_t timestamp_us;     // wall clock when the request arrived
+  uint32_t duration_us;     // request arrival to response written
+  uint16_t status;
+  uint8_t method;           // http_method code, or no_method
+  uint8_t address_family;   // 4, 6, or 0 when unknown
+  unsigned char address[16];
+  uint64_t bytes_sent;
+  uint16_t uri_length;      // bytes of uri kept, the rest is truncated
+  char uri[214];
+};
+
+/// Fill in the client address of rec from its connected socket.
+template <typename Executor>
+void record_peer(access_record &rec, const boost::asio::basic_socket<boost::asio::ip::tcp, Executor> &socket) {
+  boost::system::error_code ec;
+  auto address = socket.remote_endpoint(ec).address();
+  if (ec) {
+    rec.address_family = 0;
+  }
+  else if (address.is_v4()) {
+    rec.address_family = 4;
+    auto bytes = address.to_v4().to_bytes();
+    std::memcpy(rec.address, bytes.data(), bytes.size());
+  }
+  else {
+    rec.address_family = 6;
+    auto bytes = address.to_v6().to_bytes();
+    std::memcpy(rec.address, bytes.data(), bytes.size());
+  }
+}
+
+/// Unix domain clients have no address and are logged as "-".
+template <typename Executor>
+void record_peer(access_record &rec, const boost::asio::basic_socket<boost::asio::local::stream_protocol, Executor> &) {
+  rec.address_family = 0;
+}
+
+/// Access log written by a background thread. Each io thread appends to its
+/// own lock-free ring; the writer drains every ring and issues one write per
+/// batch. Records are dropped, never waited for, when a ring is full.
+class access_log
+{
+public:
+  static const std::size_t ring_capacity = 1024;
+  using ring_t = spsc_ring<access_record, ring_capacity>;
+
+  /// Log to path ("-" for stdout), keeping one in every sample_every requests.
+  access_log(const std::string &path, unsigned sample_every = 1)
+      : id_(next_id()),
+        sample_every_(sample_every == 0 ? 1 : sample_every)
+  {
+    if (path == "-")
+      fd_ = ::dup(STDOUT_FILENO);
+    else
+      fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+      throw std::runtime_error("cannot open access log " + path);
+    writer_ = std::thread([this] { run(); });
+  }
+
+  access_log(const access_log&) = delete;
+  access_log& operator=(const access_log&) = delete;
+
+  ~access_log() {
+    stopping_.store(true, std::memory_order_release);
+    writer_.join();
+    ::close(fd_);
+  }
+
+  /// Whether the calling thread should record the current request. Sampling
+  /// is decided per thread, with no shared counter.
+  bool sample() {
+    if (sample_every_ == 1)
+      return true;
+    thread_local unsigned counter = 0;
+    return ++counter % sample_every_ == 0;
+  }
+
+  /// Slot in the calling thread's ring, or nullptr if it is full. A non-null
+  /// slot must be filled and handed back with commit().
+  access_record* reserve() {
+    ring_t *ring = local_ring();
+    access_record *record = ring->begin_push();
+    if (!record)
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    return record;
+  }
+
+  void commit() {
+    local_ring()->end_push();
+  }
+
+  /// Rings of the threads that have written to this log.
+  std::size_t rings() {
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    return rings_.size();
+  }
+
+  /// Records dropped because a ring was full.
+  uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  /// Append rec as a line in combined-log style:
+  /// address - - [time] "METHOD uri" status bytes duration_us
+  static void format(const access_record &rec, std::string &out) {
+    char address[64] = "-";
+    if (rec.address_family == 4)
+      std::snprintf(address, sizeof(address), "%u.%u.%u.%u",
+                    rec.address[0], rec.address[1], rec.address[2], rec.address[3]);
+    else if (rec.address_family == 6) {
+      int n = 0;
+      for (int i = 0; i < 16; i += 2)
+        n += std::snprintf(address + n, sizeof(address) - n, i ? ":%x" : "%x",
+                           (rec.address[i] << 8) | rec.address[i + 1]);
+    }
+
+    std::time_t seconds = static_cast<std::time_t>(rec.timestamp_us / 1000000);
+    std::tm tm;
+    ::gmtime_r(&seconds, &tm);
+    char time[32];
+    std::strftime(time, sizeof(time), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+    char line[128];
+    int n = std::snprintf(line, sizeof(line), "%s - - [%s] \"%s ", address, time,
+                          rec.method == no_method ? "-" : http_method_str(static_cast<http_method>(rec.method)));
+    out.append(line, n);
+    out.append(rec.uri, rec.uri_length);
+    n = std::snprintf(line, sizeof(line), "\" %u %llu %u\n", rec.status,
+                      static_cast<unsigned long long>(rec.bytes_sent), rec.duration_us);
+    out.append(line, n);
+  }
+
+private:
+  ring_t* local_ring() {
+    // One ring per thread per log; the log owns it and outlives the threads
+    // that write to it. Logs are told apart by id, not address, so a new log
+    // allocated where an old one lived never sees its stale ring. Rings of
+    // logs since destroyed are forgotten when the thread next adds one.
+    struct entry
+    {
+      uint64_t id;
+      ring_t *ring;
+      std::weak_ptr<ring_t> alive;
+    };
+    thread_local std::vector<entry> rings;
+    for (const entry &e : rings)
+      if (e.id == id_)
+        return e.ring;
+
+    rings.erase(std::remove_if(rings.begin(), rings.end(),
+                               [](const entry &e) { return e.alive.expired(); }),
+                rings.end());
+    // Not make_shared: the weak_ptr above would keep the ring itself alive.
+    std::shared_ptr<ring_t> fresh(new ring_t);
+    rings.push_back(entry{id_, fresh.get(), fresh});
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(std::move(fresh));
+    return rings.back().ring;
+  }
+
+  void run() {
+    std::string batch;
+    for (;;) {
+      bool stopping = stopping_.load(std::memory_order_acquire);
+      batch.clear();
+      {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        for (auto &ring : rings_) {
+          while (const access_record *rec = ring->front()) {
+            format(*rec, batch);
+            ring->pop();
+          }
+        }
+      }
+      std::size_t written = 0;
+      while (written < batch.size()) {
+        ssize_t n = ::write(fd_, batch.data() + written, batch.size() - written);
+        if (n <= 0)
+          break;
+        written += static_cast<std::size_t>(n);
+      }
+      if (stopping)
+        return;
+      if (batch.empty())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> id{0};
+    return ++id;
+  }
+
+  uint64_t id_;
+  unsigned sample_every_;
+  int fd_ = -1;
+  std::mutex rings_mutex_;
+  std::vector<std::shared_ptr<ring_t>> rings_;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> stopping_{false};
+  std::thread writer_;
+};
+
+} // namespace zion
+
+#endif //ZION_ACCESS_LOG_H
@@ -8,22 +8,44 @@
 #include "routing.h"
 #include "request.h"
 #include "server.h"
+#include "uring_server.h"
+#include "access_log.h"
+#include "request_handler.h"
+#include <algorithm>
+#include <exception>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define ROUTE(app, url) app.route<zion::util::get_parameter_tag(url)>(url)
 
 namespace zion {
 
+/// Settings of one listener of Zion::listen or Zion::unix_socket.
+struct listener_options
+{
+  // Connections served at once on this listener, by each worker, counted
+  // within max_connections as well; 0 for no limit of its own.
+  std::size_t max_connections = 0;
+};
+
 class Zion
 {
 public:
   typedef Server<Zion> server_t;
-
+#ifdef ZION_HAS_IO_URING
+  typedef uring_server<Zion> uring_server_t;
+#endif
   Zion() = default;
 
+  // Port of the default listener, at bindaddr; "" for none.
   Zion& port(std::string port) {
     port_ = port;
+    port_set_ = true;
     return *this;
   }
 
@@ -32,6 +54,159 @@ public:
     return *this;
   }
 
+  // Also serve at address and port, IPv4 or IPv6 ("::" accepts IPv6 only).
+  // May be called any number of times; every listener shares the workers
+  // and routes. Once it is used, the default listener at bindaddr and port
+  // is served only if port() is called too.
+  Zion& listen(std::string address, std::string port, const listener_options &options = listener_options()) {
+    listeners_.push_back(listener_spec(address, port, std::string(), options));
+    return *this;
+  }
+
+#ifdef ZION_ENABLE_SSL
+  // Also serve HTTPS at address and port, with certificates of its own.
+  Zion& listen(std::string address, std::string port, const ssl_options &tls,
+               const listener_options &options = listener_options()) {
+    listen(address, port, options);
+    listeners_.back().ssl = std::make_shared<ssl_options>(tls);
+    return *this;
+  }
+#endif
+
+  // Also listen on a Unix domain stream socket at path, for clients on the
+  // same host; with port(""), only there. Served by the asio engine, every
+  // worker accepting on the one socket.
+  Zion& unix_socket(std::string path, const listener_options &options = listener_options()) {
+    listeners_.push_back(listener_spec(std::string(), std::string(), path, options));
+    return *this;
+  }
+
+  // Serve the files under doc_root for GET requests no route matches.
+  // Paths are normalized and opened beneath doc_root, so neither "../" nor
+  // a symlink leads out of it.
+  Zion& static_files(const std::string &doc_root) {
+    auto files = std::make_shared<request_handler>(doc_root);
+    router_.fallback([files](const request &req)
+                     {
+                       if (req.method_code != (int)HTTPMethod::GET)
+                         return response(response::not_found);
+                       response res;
+                       files->handle_request(req, res);
+                       return res;
+                     });
+    return *this;
+  }
+
+  // Write an access log line per request to path ("-" for stdout), keeping
+  // one in every sample_every requests. Logging is off unless this is called.
+  Zion& access_log(std::string path, unsigned sample_every = 1) {
+    access_log_.reset(new zion::access_log(path, sample_every));
+    return *this;
+  }
+
+  // Time allowed for a request's headers to arrive.
+  Zion& header_timeout(std::chrono::milliseconds timeout) {
+    config_.timeouts.header = timeout;
+    return *this;
+  }
+
+  // Longest pause allowed between reads of a request body.
+  Zion& body_timeout(std::chrono::milliseconds timeout) {
+    config_.timeouts.body = timeout;
+    return *this;
+  }
+
+  // Time allowed for each response write to complete.
+  Zion& write_timeout(std::chrono::milliseconds timeout) {
+    config_.timeouts.write = timeout;
+    return *this;
+  }
+
+  // How long an idle keep-alive connection is kept open.
+  Zion& keep_alive_timeout(std::chrono::milliseconds timeout) {
+    config_.timeouts.keep_alive = timeout;
+    return *this;
+  }
+
+  // Most connections served at once, by each worker, over all listeners;
+  // beyond it clients queue in the listen backlog until a connection closes.
+  Zion& max_connections(std::size_t n) {
+    config_.max_connections = n;
+    return *this;
+  }
+
+  // Length of the kernel queue of connections waiting to be accepted.
+  Zion& backlog(int n) {
+    config_.backlog = n;
+    return *this;
+  }
+
+  // On shutdown, time given to requests in flight before connections are
+  // dropped.
+  Zion& drain_timeout(std::chrono::milliseconds timeout) {
+    config_.drain_timeout = timeout;
+    return *this;
+  }
+
+  // Hot restart through the Unix socket at path: a new process started
+  // with the same path takes over the listening socket of the running one,
+  // which then drains and exits.
+  Zion& handoff(std::string path) {
+    config_.handoff_path = path;
+    return *this;
+  }
+
+  // Spin on the io thread for a while before blocking, pin it to a core,
+  // and busy-poll sockets; see busy_poll_options.
+  Zion& busy_poll(const busy_poll_options &options) {
+    config_.busy_poll = options;
+    return *this;
+  }
+
+  // Socket options of the listener and accepted connections; see
+  // tcp_options.
+  Zion& tcp(const tcp_options &options) {
+    config_.tcp = options;
+    return *this;
+  }
+
+  // Serve with n io threads, each accepting on its own socket; see
+  // server_config::workers. run() serves on the calling thread and n - 1
+  // more. With a handoff path, worker i hands off at path.i.
+  Zion& workers(unsigned n) {
+    config_.workers = n;
+    return *this;
+  }
+
+  // Pin the io threads to these cores, in turn, and keep each one's memory
+  // on its own NUMA node.
+  Zion& cpus(std::vector<int> cpus) {
+    config_.cpus = std::move(cpus);
+    return *this;
+  }
+
+  // Drive plain HTTP connections with io_uring instead of asio's reactor,
+  // where the kernel allows; see io_engine.
+  Zion& engine(io_engine e) {
+    config_.engine = e;
+    return *this;
+  }
+
+  // HTTP/2 settings offered to clients; settings.enabled = false serves
+  // HTTP/1.1 only.
+  Zion& http2(const http2::settings &settings) {
+    config_.http2 = settings;
+    return *this;
+  }
+
+#ifdef ZION_ENABLE_SSL
+  // Serve HTTPS instead of plain HTTP on the default listener.
+  Zion& ssl(const ssl_options &options) {
+    ssl_options_ = std::make_shared<ssl_options>(options);
+    return *this;
+  }
+#endif
+
   template <int64_t Tag>
   auto route(std::string rule)
     -> typename std::result_of<decltype(&Router::new_param_rule<Tag>)(Router, std::string)>::type
@@ -50,15 +225,217 @@ public:
   }
 
   void run() {
-    server_ = std::move(std::unique_ptr<server_t>(new server_t(bindaddr_, port_, doc_root_, this)));
-    server_->run();
+    std::vector<listener_spec> specs = listeners();
+#ifdef ZION_ENABLE_SSL
+    for (auto &spec : specs) {
+      if (!spec.ssl)
+        continue;
+      // ALPN must not offer h2 when it is not going to be served.
+      ssl_options options = *spec.ssl;
+      if (!config_.http2.enabled)
+        options.alpn.erase(std::remove(options.alpn.begin(), options.alpn.end(), "h2"), options.alpn.end());
+      spec.context = std::make_shared<ssl_context>(options);
+    }
+#endif
+#ifdef ZION_HAS_IO_URING
+    if (config_.engine == io_engine::io_uring && specs.size() == 1 && specs[0].path.empty() &&
+        !encrypted(specs[0]) && !router_.uses_coroutines() && uring::supported()) {
+      boost::asio::ip::tcp::endpoint endpoint = detail::resolve(specs[0].address, specs[0].port);
+      std::size_t limit = specs[0].options.max_connections;
+      serve(uring_servers_, [this, &endpoint, limit](server_config config, unsigned)
+      {
+        if (limit)
+          config.max_connections = std::min(config.max_connections, limit);
+        return new uring_server_t(endpoint, this, config, access_log_.get());
+      });
+      return;
+    }
+#endif
+    // Workers other than the first accept on copies of its Unix sockets,
+    // which cannot be bound twice.
+    std::promise<std::vector<int>> bound;
+    std::shared_future<std::vector<int>> unix_fds = bound.get_future().share();
+    serve(servers_, [this, &specs, &bound, unix_fds](const server_config &config, unsigned i)
+    {
+      if (i > 0) {
+        std::unique_ptr<server_t> server(new server_t(this, config, access_log_.get()));
+        std::size_t next = 0;
+        for (auto &spec : specs) {
+          if (spec.path.empty()) {
+            listen(*server, spec);
+            continue;
+          }
+          const std::vector<int> &fds = unix_fds.get();
+          if (next == fds.size())
+            throw std::runtime_error("not listening on " + spec.path);
+          // The server owns the copy, even if listening on it throws.
+          listen(*server, spec, ::dup(fds[next++]));
+        }
+        return server.release();
+      }
+      // The other workers wait on bound, so it is set however this fails.
+      std::unique_ptr<server_t> server;
+      try {
+        server.reset(new server_t(this, config, access_log_.get()));
+        std::vector<int> fds;
+        for (auto &spec : specs) {
+          int fd = listen(*server, spec);
+          if (!spec.path.empty())
+            fds.push_back(fd);
+        }
+        bound.set_value(fds);
+      }
+      catch (...) {
+        bound.set_value(std::vector<int>());
+        throw;
+      }
+      return server.release();
+    });
+  }
+
+  // Stop accepting and return from run() once the open connections have
+  // drained. SIGINT and SIGTERM do the same.
+  void stop() {
+    std::lock_guard<std::mutex> lock(servers_mutex_);
+    stopping_ = true;
+    for (auto &server : servers_)
+      server->shutdown();
+#ifdef ZION_HAS_IO_URING
+    for (auto &server : uring_servers_)
+      server->shutdown();
+#endif
   }
 
 private:
+  // A socket to serve on: address and port, or a Unix socket path.
+  struct listener_spec
+  {
+    listener_spec(std::string address, std::string port, std::string path, const listener_options &options)
+        : address(std::move(address)), port(std::move(port)), path(std::move(path)), options(options)
+    {
+    }
+
+    std::string address;
+    std::string port;
+    std::string path;
+    listener_options options;
+#ifdef ZION_ENABLE_SSL
+    std::shared_ptr<ssl_options> ssl;
+    // Made from ssl by run(), and shared by every worker.
+    std::shared_ptr<ssl_context> context;
+#endif
+  };
+
+  // Every listener, in the order servers listen on them, which hot restarts
+  // rely on: the default one first, unless listen() replaced it.
+  std::vector<listener_spec> listeners() const {
+    bool other_ports = std::any_of(listeners_.begin(), listeners_.end(),
+                                   [](const listener_spec &spec) { return spec.path.empty(); });
+    std::vector<listener_spec> specs;
+    if (!port_.empty() && (port_set_ || !other_ports)) {
+      specs.push_back(listener_spec(bindaddr_, port_, std::string(), listener_options()));
+#ifdef ZION_ENABLE_SSL
+      specs.back().ssl = ssl_options_;
+#endif
+    }
+    specs.insert(specs.end(), listeners_.begin(), listeners_.end());
+    return specs;
+  }
+
+#ifdef ZION_ENABLE_SSL
+  static bool encrypted(const listener_spec &spec) {
+    return spec.ssl != nullptr;
+  }
+#else
+  static bool encrypted(const listener_spec &) {
+    return false;
+  }
+#endif
+
+  // With fd, accept on that copy of another worker's Unix socket.
+  int listen(server_t &server, const listener_spec &spec, int fd = -1) {
+    std::size_t limit = spec.options.max_connections;
+    if (!spec.path.empty())
+      return server.listen<unix_adaptor>(spec.path, nullptr, limit, fd);
+    boost::asio::ip::tcp::endpoint endpoint = detail::resolve(spec.address, spec.port);
+#ifdef ZION_ENABLE_SSL
+    if (spec.context && spec.ssl->kernel_tls)
+      return server.listen<ktls_adaptor>(endpoint, spec.context.get(), limit);
+    if (spec.context)
+      return server.listen<ssl_adaptor>(endpoint, spec.context.get(), limit);
+#endif
+    return server.listen<tcp_adaptor>(endpoint, nullptr, limit);
+  }
+
+  // One server per worker, made by make(config, i), the first on the calling
+  // thread. A worker that fails to start stops the others, and its error is
+  // rethrown here.
+  template <typename S, typename Make>
+  void serve(std::vector<std::unique_ptr<S>> &servers, Make make) {
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&](unsigned i)
+    {
+      try {
+        serve_one(servers, i, make);
+      }
+      catch (...) {
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = std::current_exception();
+        }
+        stop();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < config_.workers; ++i)
+      threads.emplace_back(worker, i);
+    worker(0);
+    for (auto &t : threads)
+      t.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  template <typename S, typename Make>
+  void serve_one(std::vector<std::unique_ptr<S>> &servers, unsigned i, Make &make) {
+    server_config config = config_;
+    if (!config_.cpus.empty())
+      config.busy_poll.cpu = config_.cpus[i % config_.cpus.size()];
+    if (config_.workers > 1 && !config_.handoff_path.empty())
+      config.handoff_path += "." + std::to_string(i);
+    // Pinned before the server allocates anything, so that its pools and
+    // connections land on the worker's own node.
+    if (config.busy_poll.cpu >= 0 && detail::pin_thread(config.busy_poll.cpu))
+      detail::prefer_local_memory();
+
+    S *server = make(config, i);
+    {
+      std::lock_guard<std::mutex> lock(servers_mutex_);
+      servers.emplace_back(server);
+      if (stopping_)
+        server->shutdown();
+    }
+    server->run();
+  }
+
   std::string port_ = "80";
+  bool port_set_ = false;
   std::string bindaddr_ = "0.0.0.0";
+  std::vector<listener_spec> listeners_;
   std::string doc_root_ = "/var/www/html";
-  std::unique_ptr<server_t> server_;
+  server_config config_;
+  std::unique_ptr<zion::access_log> access_log_;
+  std::mutex servers_mutex_;
+  bool stopping_ = false;
+  std::vector<std::unique_ptr<server_t>> servers_;
+#ifdef ZION_HAS_IO_URING
+  std::vector<std::unique_ptr<uring_server_t>> uring_servers_;
+#endif
+#ifdef ZION_ENABLE_SSL
+  std::shared_ptr<ssl_options> ssl_options_;
+#endif
   Router router_;
 };
 
@@ -0,0 +1,200 @@
+//
+// Created by Shihao Jing on 8/21/17.
+//
+
+#ifndef ZION_ARENA_H
+#define ZION_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <type_traits>
+
+namespace zion {
+
+/// Bump-pointer allocator for memory that lives exactly as long as one
+/// request. Allocation is a pointer increment; nothing is freed individually
+/// and reset() rewinds everything at once when the response is done. After a
+/// reset the arena keeps one block big enough for the previous request, so a
+/// connection in steady state allocates from it without calling malloc.
+/// Not thread-safe.
+class arena
+{
+public:
+  explicit arena(std::size_t block_size = 4096, std::size_t max_retained = 64 * 1024)
+      : block_size_(block_size),
+        max_retained_(max_retained)
+  {
+  }
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  ~arena() {
+    free_blocks(head_);
+  }
+
+  /// size bytes aligned to align, valid until the next reset().
+  void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) {
+    if (head_) {
+      char *p = align_up(cur_, align);
+      if (p + size <= head_->end()) {
+        cur_ = p + size;
+        return p;
+      }
+    }
+    return allocate_slow(size, align);
+  }
+
+  /// Copy of [s, s + n) with a terminating NUL.
+  char* copy(const char *s, std::size_t n) {
+    char *p = static_cast<char*>(allocate(n + 1, 1));
+    std::char_traits<char>::copy(p, s, n);
+    p[n] = '\0';
+    return p;
+  }
+
+  /// Release everything allocated since the last reset. When the previous
+  /// request overflowed into several blocks they are merged into one, up to
+  /// max_retained bytes, so the next request fits in a single block.
+  void reset() {
+    if (head_ && head_->next) {
+      std::size_t total = 0;
+      for (block *b = head_; b; b = b->next)
+        total += b->size;
+      free_blocks(head_);
+      head_ = nullptr;
+      if (total > max_retained_)
+        total = max_retained_;
+      push_block(total > block_size_ ? total : block_size_);
+    }
+    if (head_)
+      cur_ = head_->begin();
+    used_ = 0;
+  }
+
+  /// Bytes handed out since the last reset, excluding the current block.
+  std::size_t used() const {
+    return used_ + (head_ ? static_cast<std::size_t>(cur_ - head_->begin()) : 0);
+  }
+
+  /// Blocks obtained from the global allocator over the arena's lifetime.
+  std::size_t blocks_allocated() const { return blocks_allocated_; }
+
+private:
+  struct block
+  {
+    block *next;
+    std::size_t size;
+
+    char* begin() { return reinterpret_cast<char*>(this + 1); }
+    char* end() { return begin() + size; }
+  };
+
+  static char* align_up(char *p, std::size_t align) {
+    auto v = reinterpret_cast<std::uintptr_t>(p);
+    return reinterpret_cast<char*>((v + align - 1) & ~(static_cast<std::uintptr_t>(align) - 1));
+  }
+
+  void* allocate_slow(std::size_t size, std::size_t align) {
+    if (head_)
+      used_ += static_cast<std::size_t>(cur_ - head_->begin());
+    std::size_t need = size + align;
+    push_block(need > block_size_ ? need : block_size_);
+    char *p = align_up(cur_, align);
+    cur_ = p + size;
+    return p;
+  }
+
+  void push_block(std::size_t size) {
+    // Blocks start max_align_t aligned: the header is two words.
+    block *b = static_cast<block*>(::operator new(sizeof(block) + size));
+    b->next = head_;
+    b->size = size;
+    head_ = b;
+    cur_ = b->begin();
+    ++blocks_allocated_;
+  }
+
+  static void free_blocks(block *b) {
+    while (b) {
+      block *next = b->next;
+      ::operator delete(b);
+      b = next;
+    }
+  }
+
+  std::size_t block_size_;
+  std::size_t max_retained_;
+  block *head_ = nullptr;
+  char *cur_ = nullptr;
+  std::size_t used_ = 0;
+  std::size_t blocks_allocated_ = 0;
+};
+
+/// Standard allocator drawing from an arena. deallocate() is a no-op; the
+/// memory comes back when the arena is reset. A default-constructed
+/// allocator has no arena and uses the global heap, so containers using it
+/// still work outside a connection, in tests for instance.
+template <typename T>
+class arena_allocator
+{
+public:
+  using value_type = T;
+  // A container moved or swapped into another takes its arena along, so
+  // a response handed back by a handler keeps its storage where it is.
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  arena_allocator() noexcept = default;
+
+  arena_allocator(zion::arena *a) noexcept
+      : arena_(a)
+  {
+  }
+
+  template <typename U>
+  arena_allocator(const arena_allocator<U> &other) noexcept
+      : arena_(other.get_arena())
+  {
+  }
+
+  T* allocate(std::size_t n) {
+    if (arena_)
+      return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, std::size_t) noexcept {
+    if (!arena_)
+      ::operator delete(p);
+  }
+
+  // Copies of a container escape the request, so they use the heap.
+  arena_allocator select_on_container_copy_construction() const noexcept {
+    return arena_allocator();
+  }
+
+  zion::arena* get_arena() const noexcept { return arena_; }
+
+private:
+  zion::arena *arena_ = nullptr;
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b) noexcept {
+  return a.get_arena() == b.get_arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b) noexcept {
+  return !(a == b);
+}
+
+/// String whose storage comes from the request arena.
+using arena_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+} // namespace zion
+
+#endif //ZION_ARENA_H
@@ -0,0 +1,63 @@
+//
+// Created by Shihao Jing on 8/19/17.
+//
+
+#ifndef ZION_BUFFER_POOL_H
+#define ZION_BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+namespace zion {
+
+/// Receive buffers shared by the connections of one io thread. Connections
+/// wait for readability without a buffer and take one only for the read
+/// itself, handing it back once the bytes have been parsed, so idle
+/// keep-alive and event stream connections hold no receive memory. Not
+/// thread-safe: use it from its io thread only.
+class buffer_pool
+{
+public:
+  static const std::size_t buffer_size = 8192;
+
+  /// Free buffers kept beyond this are released to the allocator.
+  explicit buffer_pool(std::size_t max_idle = 256)
+      : max_idle_(max_idle)
+  {
+  }
+
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  ~buffer_pool() {
+    for (char *b : idle_)
+      delete[] b;
+  }
+
+  /// A buffer of buffer_size bytes.
+  char* acquire() {
+    if (idle_.empty())
+      return new char[buffer_size];
+    char *b = idle_.back();
+    idle_.pop_back();
+    return b;
+  }
+
+  void release(char *b) {
+    if (idle_.size() >= max_idle_)
+      delete[] b;
+    else
+      idle_.push_back(b);
+  }
+
+  /// Buffers waiting to be reused.
+  std::size_t idle() const { return idle_.size(); }
+
+private:
+  std::size_t max_idle_;
+  std::vector<char*> idle_;
+};
+
+} // namespace zion
+
+#endif //ZION_BUFFER_POOL_H
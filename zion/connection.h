@@ -6,76 +6,538 @@
 #define ZION_CONNECTION_H
 
 #include <boost/asio.hpp>
+#include <algorithm>
 #include <memory>
-#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <netinet/tcp.h>
+#include "access_log.h"
+#include "buffer_pool.h"
+#include "http2.h"
 #include "response.h"
 #include "request.h"
 #include "request_parser.h"
+#include "socket_adaptors.h"
+#include "sse.h"
+#include "timer_wheel.h"
+#include "websocket.h"
 
 namespace zion {
 
-template <typename Handler>
-class connection : public std::enable_shared_from_this<connection<Handler>>
+// Deadlines enforced on every connection, so a client that stalls cannot
+// hold a socket and its buffer forever.
+struct connection_timeouts
+{
+  // For the request line and headers, counted from the first byte (or from
+  // accept for a new connection), no matter how slowly they trickle in.
+  std::chrono::milliseconds header{std::chrono::seconds(10)};
+  // Longest pause between two reads of a request body.
+  std::chrono::milliseconds body{std::chrono::seconds(30)};
+  // For each write of a response (each chunk when streaming) to complete,
+  // and for an asynchronous route to respond.
+  std::chrono::milliseconds write{std::chrono::seconds(30)};
+  // How long a keep-alive connection may sit idle between requests.
+  std::chrono::milliseconds keep_alive{std::chrono::seconds(15)};
+};
+
+/// TCP options of the listening socket and the connections accepted on it.
+/// Apart from no_delay, all are off by default, leaving the kernel's
+/// defaults.
+struct tcp_options
+{
+  // TCP_NODELAY: segments go out at once instead of Nagle holding a small
+  // one back until the previous is acked. With Nagle, a file body written
+  // after its headers waits for the client's delayed ack, some 40ms. Set on
+  // the listener, which accepted sockets inherit.
+  bool no_delay = true;
+  // TCP_QUICKACK on accepted sockets: the first request is acked at once
+  // rather than delayed. The kernel drops back to delayed acks by itself.
+  bool quick_ack = false;
+  // TCP_DEFER_ACCEPT: a connection is only accepted once its first bytes
+  // have arrived, or this long after the handshake, saving a wakeup and a
+  // read attempt per connection. Zero accepts on the handshake.
+  std::chrono::seconds defer_accept{0};
+  // TCP_FASTOPEN queue length: clients holding a cookie send their request
+  // in the SYN, saving a round trip per new connection. Zero turns it off.
+  int fast_open_queue = 0;
+  // SO_SNDBUF and SO_RCVBUF of accepted sockets, in bytes; set on the
+  // listener so the window scale is chosen to match. Zero keeps the
+  // kernel's autotuning.
+  int send_buffer = 0;
+  int receive_buffer = 0;
+  // TCP_CORK around a file response, so its headers leave in the same
+  // segment as the start of the body instead of one of their own.
+  bool cork = false;
+};
+
+template <typename Handler, typename Adaptor = tcp_adaptor>
+class connection : public std::enable_shared_from_this<connection<Handler, Adaptor>>
 {
 public:
   connection(const connection&) = delete;
   connection& operator=(const connection&) = delete;
 
-  // Construct a connection with the given socket.
-  explicit connection(boost::asio::ip::tcp::socket socket,
-                      Handler *handler)
-      : socket_(std::move(socket)),
-        handler_(handler)
+  // Construct a connection with the given socket. Deadlines are kept on the
+  // timer wheel, and receive buffers come from the pool, of the io thread that
+  // serves the socket.
+  explicit connection(typename Adaptor::socket_type socket,
+                      Handler *handler,
+                      timer_wheel &wheel,
+                      const connection_timeouts &timeouts,
+                      const http2::settings &http2_settings,
+                      const tcp_options &tcp,
+                      std::shared_ptr<buffer_pool> buffers,
+                      typename Adaptor::context *adaptor_ctx,
+                      access_log *log = nullptr)
+      : adaptor_(std::move(socket), adaptor_ctx),
+        buffers_(std::move(buffers)),
+        request_(&arena_),
+        handler_(handler),
+        wheel_(wheel),
+        timeouts_(timeouts),
+        http2_settings_(http2_settings),
+        cork_(tcp.cork),
+        deadline_(*this),
+        log_(log)
   {
+    request_parser_.reset(&request_);
+  }
+
+  ~connection() {
+    release_buffer();
   }
 
   // Start the asynchronous operation for the connection
   void start() {
-    do_read();
+    // Reads happen only after a readiness wait and must never block.
+    boost::system::error_code ignored;
+    adaptor_.raw_socket().non_blocking(true, ignored);
+    // A TLS handshake counts against the header timeout.
+    begin_request();
+    auto self = this->shared_from_this();
+    adaptor_.start([this, self](boost::system::error_code ec)
+                   {
+                     if (ec) {
+                       stop();
+                       return;
+                     }
+                     if (http2_settings_.enabled && adaptor_.alpn_protocol() == "h2") {
+                       start_http2(nullptr);
+                       return;
+                     }
+                     do_read();
+                   });
+  }
+
+  // The server is shutting down: close now if no request is under way,
+  // otherwise once its response is out. Event streams are ended and
+  // WebSocket sessions sent a going-away close.
+  void drain() {
+    draining_ = true;
+    switch (state_) {
+      case state::idle:
+      case state::event_stream:
+        stop();
+        break;
+      case state::reading_header:
+        if (!request_parser_.started())
+          stop();
+        break;
+      case state::websocket:
+        if (auto session = websocket_.lock())
+          session->close(websocket::going_away);
+        break;
+      case state::http2:
+        if (auto session = http2_.lock())
+          session->shutdown();
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Rebind a recycled connection to a newly accepted socket.
+  void reset(typename Adaptor::socket_type socket) {
+    adaptor_.reset(std::move(socket));
+  }
+
+  // Drop everything tied to the last client so the object can be pooled.
+  // Buffers and string capacities are kept for the next one.
+  void recycle() {
+    stop();
+    request_.clear();
+    response_.clear();
+    arena_.reset();
+    request_parser_.reset(&request_);
+    chunk_.clear();
+    events_.reset();
+    event_buffer_.clear();
+    writing_events_ = false;
+    websocket_.reset();
+    http2_.reset();
+    h2c_settings_.clear();
+    upgrading_h2c_ = false;
+    served_ = false;
+    draining_ = false;
+    release_buffer();
+    buffer_begin_ = buffer_end_ = 0;
+    bytes_sent_ = 0;
+    state_ = state::idle;
   }
 
   // Stop all asynchronous operation associated with the connection
   void stop() {
-    socket_.close();
+    deadline_.cancel();
+    adaptor_.close();
   }
 
 private:
+  enum class state
+  {
+    idle,            // keep-alive, waiting for the next request
+    reading_header,
+    reading_body,
+    awaiting,        // for an asynchronous route's response
+    writing,
+    event_stream,    // Server-Sent Events, idle between pushes
+    websocket,       // upgraded; the socket belongs to websocket_
+    http2            // the socket belongs to http2_
+  };
+
+  // Deadline of the current state; expiry closes the connection.
+  struct deadline : timer_wheel::entry
+  {
+    explicit deadline(connection &c) : conn(c) {}
+    void on_expire() override { conn.stop(); }
+    connection &conn;
+  };
+
+  // A vector of buffers as a sequence the write operation can copy without
+  // copying the vector.
+  struct buffer_range
+  {
+    using value_type = boost::asio::const_buffer;
+    using const_iterator = const boost::asio::const_buffer*;
+
+    explicit buffer_range(const std::vector<boost::asio::const_buffer> &v)
+        : first(v.data()), last(v.data() + v.size()) {}
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+
+    const_iterator first;
+    const_iterator last;
+  };
+
+  void arm(std::chrono::milliseconds timeout) {
+    wheel_.schedule(deadline_, timeout);
+  }
+
+  void begin_request() {
+    state_ = state::reading_header;
+    arm(timeouts_.header);
+    if (log_) {
+      request_start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  // Wait until the socket is readable, holding no buffer in the meantime,
+  // then read into buffer_, borrowed from the thread's pool. on_read gets
+  // the bytes read; 0 without an error means the wakeup was spurious.
+  template <typename ReadHandler>
+  void async_read_pooled(ReadHandler on_read) {
+    auto self = this->shared_from_this();
+    adaptor_.async_wait_readable([this, self, on_read](boost::system::error_code ec)
+                                 {
+                                   if (ec) {
+                                     on_read(ec, 0);
+                                     return;
+                                   }
+                                   buffer_ = buffers_->acquire();
+                                   adaptor_.read_some(boost::asio::buffer(buffer_, buffer_pool::buffer_size),
+                                                      [this, self, on_read](boost::system::error_code ec, std::size_t n)
+                                                      {
+                                                        if (ec || n == 0) {
+                                                          release_buffer();
+                                                        }
+                                                        on_read(ec, n);
+                                                      });
+                                 });
+  }
+
+  void release_buffer() {
+    if (buffer_) {
+      buffers_->release(buffer_);
+      buffer_ = nullptr;
+    }
+  }
+
   // Perform an asynchronous read operation.
   void do_read() {
-    auto self = this->shared_from_this();
-    socket_.async_read_some(boost::asio::buffer(buffer_),
-                            [this, self](boost::system::error_code ec, std::size_t bytes_transferred)
-                            {
-                              std::cout << "start read" << std::endl;
-                              if (!ec) {
-                                request_parser_.parse(request_, buffer_.data(), bytes_transferred);
-                                std::cout << request_.uri << std::endl;
-                                std::cout << request_.method << std::endl;
-                                std::cout << request_.method_code << std::endl;
-                                handle();
-                              }
-                              else if (ec != boost::asio::error::operation_aborted) {
-                                stop();
-                              }
-                            });
+    async_read_pooled([this](boost::system::error_code ec, std::size_t bytes_transferred)
+                      {
+                        if (!ec) {
+                          if (bytes_transferred == 0) {
+                            do_read();
+                            return;
+                          }
+                          if (state_ == state::idle) {
+                            begin_request();
+                          }
+                          else if (state_ == state::reading_body) {
+                            arm(timeouts_.body);
+                          }
+                          buffer_begin_ = 0;
+                          buffer_end_ = bytes_transferred;
+                          process_buffer();
+                        }
+                        else if (ec != boost::asio::error::operation_aborted) {
+                          stop();
+                        }
+                      });
+  }
+
+  // Feed the unparsed part of the buffer to the parser, then either handle a
+  // complete request or read more.
+  void process_buffer() {
+    // An HTTP/2 client with prior knowledge opens with the preface instead
+    // of a request.
+    if (!served_ && !request_parser_.started() && is_http2_preface()) {
+      start_http2(nullptr);
+      return;
+    }
+    std::size_t consumed = 0;
+    auto result = request_parser_.parse(buffer_ + buffer_begin_, buffer_end_ - buffer_begin_, consumed);
+    buffer_begin_ += consumed;
+    // The parser has copied what it needs; keep the buffer only while it
+    // still holds pipelined bytes.
+    if (buffer_begin_ == buffer_end_) {
+      release_buffer();
+    }
+
+    if (result == request_parser::good) {
+      handle();
+      return;
+    }
+    if (result == request_parser::bad) {
+      response_ = response::stock_reply(response::bad_request);
+      response_.to_buffers(write_buffers_);
+      do_write();
+      return;
+    }
+    if (state_ == state::reading_header && request_parser_.headers_complete()) {
+      state_ = state::reading_body;
+      arm(timeouts_.body);
+    }
+    do_read();
   }
 
   void handle() {
+    served_ = true;
+    if (accept_h2c()) {
+      response_.to_buffers(write_buffers_);
+      do_write();
+      return;
+    }
     response_ = handler_->handle(request_);
-    auto write_buffer = response_.to_buffers();
-    do_write(write_buffer);
+    send_response();
   }
 
-  // Perform an asynchronous write operation.
-  void do_write(const std::vector<boost::asio::const_buffer>& buffers) {
+  // Write response_, or wait for it if the route answers asynchronously.
+  void send_response() {
+    if (response_.is_async()) {
+      await_response();
+      return;
+    }
+    if (response_.is_websocket()) {
+      accept_websocket();
+    }
+    response_.keep_alive = request_.keep_alive && !draining_ &&
+                           !response_.is_event_stream() && !response_.is_websocket();
+    response_.to_buffers(write_buffers_);
+    do_write();
+  }
+
+  // Give the route its responder. Until it answers, the responder holds the
+  // connection open and nothing is read: pipelined requests wait their turn.
+  void await_response() {
+    state_ = state::awaiting;
+    arm(timeouts_.write);
+    auto self = this->shared_from_this();
+    auto executor = adaptor_.raw_socket().get_executor();
+    auto on_async = std::move(response_.on_async);
+    response_.clear();
+    on_async(detail::make_responder([executor](auto handler) { boost::asio::post(executor, std::move(handler)); },
+                                    [this, self](response res)
+                                    {
+                                      // Closed by the timeout in the meantime.
+                                      if (state_ != state::awaiting || !adaptor_.raw_socket().is_open())
+                                        return;
+                                      deadline_.cancel();
+                                      response_ = std::move(res);
+                                      send_response();
+                                    },
+                                    executor));
+  }
+
+  // The response is out: reset for the next request on a keep-alive
+  // connection, starting with any pipelined bytes already buffered.
+  void finish_request() {
+    if (!response_.keep_alive || draining_) {
+      stop();
+      return;
+    }
+    request_.clear();
+    response_.clear();
+    arena_.reset();
+    request_parser_.reset(&request_);
+    bytes_sent_ = 0;
+
+    if (buffer_begin_ < buffer_end_) {
+      begin_request();
+      process_buffer();
+    }
+    else {
+      state_ = state::idle;
+      arm(timeouts_.keep_alive);
+      do_read();
+    }
+  }
+
+  // Turn the reply of a websocket route into the 101 handshake, or into a
+  // 400 if the request is not a valid upgrade.
+  void accept_websocket() {
+    std::string key = request_.get_header("Sec-WebSocket-Key");
+    std::string upgrade = request_.get_header("Upgrade");
+    if (!request_.upgrade || key.empty() || ::strcasecmp(upgrade.c_str(), "websocket") != 0) {
+      response_ = response::stock_reply(response::bad_request);
+      return;
+    }
+    response_.status_ = response::switching_protocols;
+    response_.headers.push_back({"Upgrade", "websocket"});
+    response_.headers.push_back({"Connection", "Upgrade"});
+    response_.headers.push_back({"Sec-WebSocket-Accept", websocket::accept_key(key)});
+  }
+
+  // The handshake is out: hand the socket over to a websocket session.
+  void start_websocket() {
+    deadline_.cancel();
+    state_ = state::websocket;
+    auto session = std::make_shared<websocket::session_impl<typename Adaptor::stream_type>>(std::move(adaptor_.stream()));
+    // The connection stays open, as far as the server is concerned, until
+    // the session is gone.
+    session->set_owner(this->shared_from_this());
+    websocket_ = session;
+    auto on_websocket = std::move(response_.on_websocket);
+    response_.clear();
+    on_websocket(session);
+    session->start();
+  }
+
+  bool is_http2_preface() const {
+    std::size_t n = std::min(buffer_end_ - buffer_begin_, http2::client_preface_size);
+    return http2_settings_.enabled && n >= 4 &&
+           std::memcmp(buffer_ + buffer_begin_, http2::client_preface, n) == 0;
+  }
+
+  // Answer a cleartext "Upgrade: h2c" request with the 101 that switches
+  // to HTTP/2. The request itself is then answered as stream 1.
+  bool accept_h2c() {
+    if (Adaptor::encrypted || !http2_settings_.enabled || !request_.upgrade || draining_)
+      return false;
+    std::string upgrade = request_.get_header("Upgrade");
+    if (upgrade.find("h2c") == std::string::npos ||
+        !http2::decode_settings_header(request_.get_header("HTTP2-Settings"), h2c_settings_))
+      return false;
+    upgrading_h2c_ = true;
+    response_.status_ = response::switching_protocols;
+    response_.headers.push_back({"Connection", "Upgrade"});
+    response_.headers.push_back({"Upgrade", "h2c"});
+    return true;
+  }
+
+  // Hand the socket over to an HTTP/2 session, with the bytes already read
+  // past the upgrade request if there was one.
+  void start_http2(const request *upgraded) {
+    deadline_.cancel();
+    state_ = state::http2;
+    auto session = std::make_shared<http2::session<Handler, typename Adaptor::stream_type>>(
+        std::move(adaptor_.stream()), handler_, http2_settings_, timeouts_.keep_alive, timeouts_.write,
+        static_cast<bool>(Adaptor::gathers_writes), log_);
+    // As for websocket sessions, the connection counts as open until the
+    // session is gone.
+    session->set_owner(this->shared_from_this());
+    http2_ = session;
+    const char *data = buffer_ ? buffer_ + buffer_begin_ : nullptr;
+    std::size_t size = buffer_ ? buffer_end_ - buffer_begin_ : 0;
+    session->start(data, size, upgraded, h2c_settings_);
+    release_buffer();
+    buffer_begin_ = buffer_end_ = 0;
+  }
+
+  // Streams that do not gather writes (TLS) send every buffer as a record of
+  // its own, and small ones then wait on each other's acks. Merge all but a
+  // large last buffer, the body, into one.
+  void coalesce(std::vector<boost::asio::const_buffer> &buffers) {
+    if (Adaptor::gathers_writes || buffers.size() < 2)
+      return;
+    const std::size_t large = 16 * 1024;
+    std::size_t merged = buffers.back().size() > large ? buffers.size() - 1 : buffers.size();
+    coalesced_.clear();
+    for (std::size_t i = 0; i < merged; ++i)
+      coalesced_.append(static_cast<const char*>(buffers[i].data()), buffers[i].size());
+    boost::asio::const_buffer body = buffers.back();
+    bool keep_body = merged < buffers.size();
+    buffers.clear();
+    buffers.push_back(boost::asio::buffer(coalesced_));
+    if (keep_body)
+      buffers.push_back(body);
+  }
+
+  // Hold partial segments back, or send what is held.
+  void set_cork(bool on) {
+    int value = on;
+    ::setsockopt(adaptor_.raw_socket().native_handle(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+  }
+
+  // Perform an asynchronous write operation of write_buffers_.
+  void do_write() {
+    coalesce(write_buffers_);
+    if (cork_ && response_.is_file())
+      set_cork(true);
+    state_ = state::writing;
+    arm(timeouts_.write);
     auto self = this->shared_from_this() ;
-    socket_.async_write_some(buffers,
+    boost::asio::async_write(adaptor_.stream(), buffer_range(write_buffers_),
                             [this, self](boost::system::error_code ec, std::size_t bytes_transferred)
                             {
-                              std::cout << "start write" << std::endl;
                               if (!ec) {
-                                std::cout << "response sent" << std::endl;
-                                stop();
+                                deadline_.cancel();
+                                bytes_sent_ += bytes_transferred;
+                                if (response_.is_streaming()) {
+                                  do_write_chunk();
+                                  return;
+                                }
+                                if (response_.is_file()) {
+                                  file_sent_ = 0;
+                                  do_write_file();
+                                  return;
+                                }
+                                // Upgraded and event stream connections are logged once
+                                // their handshake is out.
+                                log_access();
+                                if (response_.is_event_stream()) {
+                                  open_event_stream();
+                                  return;
+                                }
+                                if (response_.is_websocket()) {
+                                  start_websocket();
+                                  return;
+                                }
+                                if (upgrading_h2c_) {
+                                  start_http2(&request_);
+                                  return;
+                                }
+                                finish_request();
                               }
                               else if (ec != boost::asio::error::operation_aborted) {
                                 stop();
@@ -83,19 +545,252 @@ private:
                             });
   }
 
-  // Socket for the connection.
-  boost::asio::ip::tcp::socket socket_;
+  // Pull the next chunk from the response producer and write it with chunked
+  // framing. The producer is asked again only once the previous chunk has been
+  // fully written, so a slow client throttles the producer and the connection
+  // holds at most one chunk at a time.
+  void do_write_chunk() {
+    chunk_.clear();
+    bool more = response_.producer(chunk_);
+
+    std::vector<boost::asio::const_buffer> &buffers = write_buffers_;
+    buffers.clear();
+    if (!chunk_.empty()) {
+      char size_line[sizeof(std::size_t) * 2 + 2];
+      int n = std::snprintf(size_line, sizeof(size_line), "%zx", chunk_.size());
+      chunk_size_.assign(size_line, n).append("\r\n", 2);
+      buffers.push_back(boost::asio::buffer(chunk_size_));
+      buffers.push_back(boost::asio::buffer(chunk_));
+      buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+    }
+    if (!more) {
+      buffers.push_back(boost::asio::buffer(misc_strings::last_chunk, sizeof(misc_strings::last_chunk) - 1));
+    }
+
+    coalesce(buffers);
+    arm(timeouts_.write);
+    auto self = this->shared_from_this();
+    boost::asio::async_write(adaptor_.stream(), buffer_range(buffers),
+                             [this, self, more](boost::system::error_code ec, std::size_t bytes_transferred)
+                             {
+                               bytes_sent_ += bytes_transferred;
+                               if (!ec && more) {
+                                 do_write_chunk();
+                               }
+                               else if (!ec) {
+                                 deadline_.cancel();
+                                 log_access();
+                                 finish_request();
+                               }
+                               else if (ec != boost::asio::error::operation_aborted) {
+                                 stop();
+                               }
+                             });
+  }
+
+  // Send the file body of the response through the adaptor, sendfile where
+  // its stream allows. Each piece written re-arms the write timeout, as each
+  // chunk of a streaming reply does.
+  void do_write_file() {
+    const file_body &file = *response_.file;
+    if (file_sent_ == file.size) {
+      deadline_.cancel();
+      if (cork_)
+        set_cork(false);
+      log_access();
+      finish_request();
+      return;
+    }
+    arm(timeouts_.write);
+    auto self = this->shared_from_this();
+    adaptor_.async_send_file(file.fd, file.offset + static_cast<off_t>(file_sent_), file.size - file_sent_,
+                             [this, self](boost::system::error_code ec, std::size_t n)
+                             {
+                               bytes_sent_ += n;
+                               file_sent_ += n;
+                               if (!ec) {
+                                 do_write_file();
+                               }
+                               else if (ec != boost::asio::error::operation_aborted) {
+                                 stop();
+                               }
+                             });
+  }
+
+  // Record the finished request in the access log, if one is configured.
+  // This only copies into the thread's ring; formatting and I/O happen on the
+  // log's writer thread.
+  void log_access() {
+    if (!log_ || !log_->sample())
+      return;
+    access_record *rec = log_->reserve();
+    if (!rec)
+      return;
+
+    using namespace std::chrono;
+    int64_t duration = duration_cast<microseconds>(steady_clock::now() - request_start_).count();
+    rec->timestamp_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() - duration;
+    rec->duration_us = static_cast<uint32_t>(duration);
+    rec->status = static_cast<uint16_t>(response_.status_);
+    rec->method = static_cast<uint8_t>(request_.method_code);
+    rec->bytes_sent = bytes_sent_;
 
-  // Buffer for incoming data.
-  std::array<char, 8192> buffer_;
+    record_peer(*rec, adaptor_.raw_socket());
+
+    rec->uri_length = static_cast<uint16_t>(std::min(request_.uri.size(), sizeof(rec->uri)));
+    std::memcpy(rec->uri, request_.uri.data(), rec->uri_length);
+    log_->commit();
+  }
+
+  // Event stream bound to a connection. The connection owns it; the stream
+  // only refers back weakly, so an application holding a stream does not keep
+  // a disconnected client's socket alive.
+  class connection_event_stream : public event_stream
+  {
+  public:
+    explicit connection_event_stream(const std::shared_ptr<connection> &conn)
+        : conn_(conn),
+          executor_(conn->adaptor_.raw_socket().get_executor())
+    {
+    }
+
+    using event_stream::take_pending;
+    using event_stream::mark_closed;
+
+  private:
+    void schedule_flush() override {
+      std::weak_ptr<connection> weak = conn_;
+      boost::asio::post(executor_, [weak]
+      {
+        if (auto conn = weak.lock())
+          conn->flush_events();
+      });
+    }
+
+    std::weak_ptr<connection> conn_;
+    typename Adaptor::socket_type::executor_type executor_;
+  };
+
+  // Hand the stream to the route's handler, then keep a read outstanding so a
+  // client disconnect is noticed while the stream is idle.
+  void open_event_stream() {
+    // Event streams may idle indefinitely; only a disconnect ends them.
+    state_ = state::event_stream;
+    events_ = std::make_shared<connection_event_stream>(this->shared_from_this());
+    auto on_event_stream = std::move(response_.on_event_stream);
+    response_.clear();
+    on_event_stream(events_);
+    do_read_event_stream();
+  }
+
+  void do_read_event_stream() {
+    async_read_pooled([this](boost::system::error_code ec, std::size_t)
+                      {
+                        // Clients have nothing to say on an event stream; a closed
+                        // peer shows up as eof.
+                        release_buffer();
+                        if (!ec) {
+                          do_read_event_stream();
+                          return;
+                        }
+                        events_->mark_closed();
+                        if (ec != boost::asio::error::operation_aborted) {
+                          stop();
+                        }
+                      });
+  }
+
+  // Write everything pushed since the last flush in one write. Pushes that
+  // arrive while a write is in flight are picked up when it completes.
+  void flush_events() {
+    if (writing_events_ || !adaptor_.raw_socket().is_open())
+      return;
+    if (!events_->take_pending(event_buffer_)) {
+      stop();
+      return;
+    }
+    if (event_buffer_.empty())
+      return;
+
+    writing_events_ = true;
+    auto self = this->shared_from_this();
+    boost::asio::async_write(adaptor_.stream(), boost::asio::buffer(event_buffer_),
+                             [this, self](boost::system::error_code ec, std::size_t)
+                             {
+                               writing_events_ = false;
+                               if (!ec) {
+                                 flush_events();
+                               }
+                               else {
+                                 events_->mark_closed();
+                                 if (ec != boost::asio::error::operation_aborted) {
+                                   stop();
+                                 }
+                               }
+                             });
+  }
+
+  // Socket for the connection, plain or TLS.
+  Adaptor adaptor_;
+
+  // Borrowed receive buffer, null while waiting for data; [buffer_begin_,
+  // buffer_end_) is not parsed yet.
+  std::shared_ptr<buffer_pool> buffers_;
+  char *buffer_ = nullptr;
+  std::size_t buffer_begin_ = 0;
+  std::size_t buffer_end_ = 0;
+
+  // Memory of the request in flight: its headers, route args and handler
+  // scratch, and the response when the handler made it there. Reset
+  // wholesale once the response has been written.
+  arena arena_;
 
   response response_;
+
+  // Buffers of the write in progress, reused from one response to the next.
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  std::string coalesced_;
+  std::size_t file_sent_ = 0;
+
+  // Current body chunk of a streaming response and its hex size line.
+  std::string chunk_;
+  std::string chunk_size_;
+
+  // Server-Sent Events stream opened by the response, and the batch being written.
+  std::shared_ptr<connection_event_stream> events_;
+  std::string event_buffer_;
+  bool writing_events_ = false;
+
+  // Session the connection was upgraded to.
+  std::weak_ptr<websocket::session> websocket_;
+  std::weak_ptr<http2::session<Handler, typename Adaptor::stream_type>> http2_;
+  // HTTP2-Settings of an h2c upgrade whose 101 is being written.
+  std::string h2c_settings_;
+  bool upgrading_h2c_ = false;
+  // Whether a request has been handled on this connection; only the first
+  // may be an HTTP/2 preface.
+  bool served_ = false;
+
   // Incoming request
   request request_;
+  // Set once the server has asked the connection to drain.
+  bool draining_ = false;
 
   request_parser request_parser_;
 
   Handler *handler_;
+
+  timer_wheel &wheel_;
+  const connection_timeouts &timeouts_;
+  const http2::settings &http2_settings_;
+  bool cork_;
+  deadline deadline_;
+  state state_ = state::idle;
+
+  // Access log for finished requests, or nullptr when logging is off.
+  access_log *log_;
+  std::chrono::steady_clock::time_point request_start_;
+  std::size_t bytes_sent_ = 0;
 };
 
 } // namespace zion
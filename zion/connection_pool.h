@@ -0,0 +1,116 @@
+//
+// Created by Shihao Jing on 8/17/17.
+//
+
+#ifndef ZION_CONNECTION_POOL_H
+#define ZION_CONNECTION_POOL_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <utility>
+
+namespace zion {
+
+/// Free list of connection objects for one io thread. A connection goes back
+/// to the pool when its last shared_ptr is released, and is handed out again
+/// for the next accepted socket with its buffer and string capacities intact,
+/// so accepting does not allocate once the pool is warm.
+///
+/// Live and idle connections sit on two lists whose nodes move between them,
+/// so handing out and taking back a connection allocates no list node either.
+///
+/// Conn must provide recycle(), which drops per-connection state, and
+/// reset(socket), which rebinds a recycled object to a new socket. The pool
+/// must be owned by a shared_ptr; connections released after it is gone (for
+/// instance by handlers destroyed along with the io_service) are simply
+/// deleted. Not thread-safe: connections must be released on the pool's io
+/// thread.
+template <typename Conn>
+class connection_pool : public std::enable_shared_from_this<connection_pool<Conn>>
+{
+public:
+  /// Idle connections kept beyond this are freed instead of pooled.
+  explicit connection_pool(std::size_t max_idle = 1024)
+      : max_idle_(max_idle)
+  {
+  }
+
+  connection_pool(const connection_pool&) = delete;
+  connection_pool& operator=(const connection_pool&) = delete;
+
+  ~connection_pool() {
+    for (Conn *c : idle_)
+      delete c;
+  }
+
+  /// A connection bound to socket: a recycled one when available, otherwise
+  /// a new one from make(socket).
+  template <typename Socket, typename Make>
+  std::shared_ptr<Conn> acquire(Socket socket, Make make) {
+    if (idle_.empty()) {
+      active_.push_front(make(std::move(socket)));
+    }
+    else {
+      active_.splice(active_.begin(), idle_, idle_.begin());
+      active_.front()->reset(std::move(socket));
+    }
+    auto node = active_.begin();
+    std::weak_ptr<connection_pool> pool = this->shared_from_this();
+    return std::shared_ptr<Conn>(*node, [pool, node](Conn *released)
+    {
+      if (auto p = pool.lock())
+        p->release(node);
+      else
+        delete released;
+    });
+  }
+
+  /// Call f(conn) for every connection handed out and not released yet.
+  /// f may release the connection it is given.
+  template <typename F>
+  void for_each_active(F f) {
+    for (auto it = active_.begin(); it != active_.end(); ) {
+      Conn *c = *it++;
+      f(c);
+    }
+  }
+
+  /// Connections waiting to be reused.
+  std::size_t idle() const { return idle_.size(); }
+
+  /// Connections handed out and not released yet.
+  std::size_t active() const { return active_.size(); }
+
+  /// Call f each time a connection is released, for instance to resume
+  /// accepting once below a connection limit.
+  void on_release(std::function<void()> f) {
+    on_release_ = std::move(f);
+  }
+
+private:
+  void release(typename std::list<Conn*>::iterator node) {
+    Conn *c = *node;
+    if (idle_.size() >= max_idle_) {
+      active_.erase(node);
+      delete c;
+    }
+    else {
+      c->recycle();
+      idle_.splice(idle_.begin(), active_, node);
+    }
+    if (on_release_)
+      on_release_();
+  }
+
+  std::size_t max_idle_;
+  std::list<Conn*> active_;
+  std::list<Conn*> idle_;
+  std::function<void()> on_release_;
+};
+
+} // namespace zion
+
+#endif //ZION_CONNECTION_POOL_H
@@ -0,0 +1,151 @@
+//
+// Created by Shihao Jing on 9/5/17.
+//
+
+#ifndef ZION_CPU_POOL_H
+#define ZION_CPU_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace zion {
+
+/// Worker threads for CPU-heavy jobs, kept off the io threads. Each worker
+/// has a queue of its own; jobs posted from outside are dealt round-robin,
+/// jobs posted by a job go to its worker's queue, and a worker with nothing
+/// left takes the oldest job of another. Thread-safe.
+class cpu_pool
+{
+public:
+  explicit cpu_pool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()))
+  {
+    threads = std::max(1u, threads);
+    for (unsigned i = 0; i < threads; ++i)
+      queues_.emplace_back(new queue);
+    for (unsigned i = 0; i < threads; ++i)
+      threads_.emplace_back([this, i] { work(i); });
+  }
+
+  cpu_pool(const cpu_pool&) = delete;
+  cpu_pool& operator=(const cpu_pool&) = delete;
+
+  /// Runs the jobs already posted, then joins the workers.
+  ~cpu_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stopped_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : threads_)
+      t.join();
+  }
+
+  /// Run job on a worker. Exceptions it throws are dropped; a job that
+  /// answers a request should let its responder go unanswered, which
+  /// replies 500.
+  void post(std::function<void()> job) {
+    std::size_t index = current().pool == this
+        ? current().index
+        : next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    {
+      std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+      queues_[index]->jobs.push_back(std::move(job));
+    }
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    ++pending_;
+    if (idle_)
+      wake_.notify_one();
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+private:
+  struct queue
+  {
+    std::mutex mutex;
+    std::deque<std::function<void()>> jobs;
+  };
+
+  struct worker
+  {
+    cpu_pool *pool = nullptr;
+    std::size_t index = 0;
+  };
+
+  static worker& current() {
+    thread_local worker w;
+    return w;
+  }
+
+  // The front of its own queue first, then the front of the others',
+  // starting with the next worker's.
+  bool take(std::size_t index, std::function<void()> &job) {
+    for (std::size_t n = 0; n < queues_.size(); ++n) {
+      queue &q = *queues_[(index + n) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.jobs.empty()) {
+        job = std::move(q.jobs.front());
+        q.jobs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(std::size_t index) {
+    current().pool = this;
+    current().index = index;
+    std::function<void()> job;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        ++idle_;
+        wake_.wait(lock, [this] { return pending_ > 0 || stopped_; });
+        --idle_;
+        if (pending_ == 0)
+          return;
+        // Claimed here, so every pending job has one worker looking for it.
+        --pending_;
+      }
+      while (!take(index, job))
+        std::this_thread::yield();
+      try {
+        job();
+      }
+      catch (...) {
+      }
+      job = nullptr;
+    }
+  }
+
+  std::vector<std::unique_ptr<queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> next_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::size_t pending_ = 0;
+  std::size_t idle_ = 0;
+  bool stopped_ = false;
+};
+
+namespace detail {
+
+// The pool behind offloaded routes and zion::offload(): a worker per core.
+inline cpu_pool& offload_pool() {
+  static cpu_pool pool;
+  return pool;
+}
+
+} // namespace detail
+
+} // namespace zion
+
+#endif //ZION_CPU_POOL_H
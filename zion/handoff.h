@@ -0,0 +1,124 @@
+//
+// Created by Shihao Jing on 8/24/17.
+//
+
+#ifndef ZION_HANDOFF_H
+#define ZION_HANDOFF_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace zion {
+
+/// Passing listening sockets from a running server to its replacement over a
+/// Unix socket (SCM_RIGHTS). The new process accepts on the very same sockets
+/// while the old one drains, so a restart never refuses a connection.
+///
+/// The exchange is: the new process connects to the old one's handoff path,
+/// receives the listening fds with a one byte message, and answers with a one
+/// byte ack once it holds them. Only then does the old process stop accepting.
+namespace handoff {
+
+/// Largest number of fds exchanged in one handoff.
+const std::size_t max_fds = 64;
+
+/// Send fds with a one byte message over the connected Unix socket sock.
+inline bool send_fds(int sock, const std::vector<int> &fds) {
+  if (fds.empty() || fds.size() > max_fds)
+    return false;
+
+  char byte = 'L';
+  iovec iov{&byte, 1};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+  ssize_t n;
+  do {
+    n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n == 1;
+}
+
+/// Receive the fds sent by send_fds() on sock. Empty on error or EOF. The
+/// fds are owned by the caller and marked close-on-exec.
+inline std::vector<int> receive_fds(int sock) {
+  char byte;
+  iovec iov{&byte, 1};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  ssize_t n;
+  do {
+    n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+
+  std::vector<int> fds;
+  if (n != 1)
+    return fds;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    std::size_t first = fds.size();
+    fds.resize(first + count);
+    std::memcpy(fds.data() + first, CMSG_DATA(cmsg), sizeof(int) * count);
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    for (int fd : fds)
+      ::close(fd);
+    fds.clear();
+  }
+  return fds;
+}
+
+/// Take over the listening sockets of the server handing off at path, if
+/// there is one. Empty when no server answers there, which is the case on a
+/// first start.
+inline std::vector<int> take_listeners(const std::string &path) {
+  std::vector<int> fds;
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path))
+    return fds;
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return fds;
+  if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+    fds = receive_fds(sock);
+    // The old server keeps accepting until it sees the ack.
+    char ack = 'A';
+    if (!fds.empty() && ::send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+      for (int fd : fds)
+        ::close(fd);
+      fds.clear();
+    }
+  }
+  ::close(sock);
+  return fds;
+}
+
+} // namespace handoff
+} // namespace zion
+
+#endif //ZION_HANDOFF_H
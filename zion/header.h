@@ -6,13 +6,33 @@
 #define ZION_HEADER_H
 
 #include <string>
+#include "arena.h"
 
 namespace zion {
 
+// A response header. Its strings are in the request arena when the response
+// was made with one (see response::add_header), on the heap otherwise.
 struct header
 {
-  std::string key;
-  std::string value;
+  header() = default;
+
+  header(arena_string key, arena_string value)
+      : key(std::move(key)), value(std::move(value))
+  {
+  }
+
+  header(const char *key, const char *value)
+      : key(key), value(value)
+  {
+  }
+
+  header(const std::string &key, const std::string &value)
+      : key(key.data(), key.size()), value(value.data(), value.size())
+  {
+  }
+
+  arena_string key;
+  arena_string value;
 };
 
 } //namespace zion
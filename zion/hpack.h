@@ -0,0 +1,518 @@
+//
+// Created by Shihao Jing on 8/28/17.
+//
+
+#ifndef ZION_HPACK_H
+#define ZION_HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+
+namespace zion {
+
+/// HPACK header compression for HTTP/2 (RFC 7541).
+namespace hpack {
+
+struct static_entry
+{
+  const char *name;
+  const char *value;
+};
+
+/// The static table, shared by every connection. Index 1 is the first entry.
+const std::size_t static_table_size = 61;
+const static_entry static_table[static_table_size] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""},
+};
+
+struct huffman_code
+{
+  uint32_t code;
+  uint8_t bits;
+};
+
+/// Huffman code of each byte value, in RFC 7541 Appendix B. The code is
+/// canonical: codes of one length are consecutive in symbol order, which
+/// the decoder relies on.
+const huffman_code huffman_table[256] = {
+  {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+  {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+  {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+  {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+  {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+  {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+  {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+  {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+  {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+  {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+  {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+  {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+  {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+  {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+  {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+  {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+  {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+  {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+  {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+  {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+  {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+  {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+  {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+  {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+  {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+  {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+  {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+  {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+  {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+  {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+  {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+  {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+  {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+  {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+  {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+  {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+  {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+  {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+  {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+  {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+  {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+  {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+  {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+};
+
+/// End of string; only ever seen as padding, a prefix of its all-ones code.
+const huffman_code huffman_eos = {0x3fffffff, 30};
+
+/// Integer with an n-bit prefix (5.1). flags holds the bits above the prefix.
+inline void encode_integer(std::string &out, uint8_t flags, int prefix_bits, uint64_t value) {
+  const uint64_t max_prefix = (1u << prefix_bits) - 1;
+  if (value < max_prefix) {
+    out.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out.push_back(static_cast<char>(flags | max_prefix));
+  value -= max_prefix;
+  while (value >= 128) {
+    out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+/// Decode an integer with an n-bit prefix at p, advancing p. False when the
+/// input ends early or the value does not fit in 32 bits.
+inline bool decode_integer(const uint8_t *&p, const uint8_t *end, int prefix_bits, uint64_t &value) {
+  if (p == end)
+    return false;
+  const uint64_t max_prefix = (1u << prefix_bits) - 1;
+  value = *p++ & max_prefix;
+  if (value < max_prefix)
+    return true;
+  for (int shift = 0; ; shift += 7) {
+    if (p == end || shift > 28)
+      return false;
+    uint8_t b = *p++;
+    value += static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  return value <= 0xffffffffu;
+}
+
+inline std::size_t huffman_size(const char *s, std::size_t n) {
+  std::size_t bits = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    bits += huffman_table[static_cast<uint8_t>(s[i])].bits;
+  return (bits + 7) / 8;
+}
+
+inline void huffman_encode(std::string &out, const char *s, std::size_t n) {
+  uint64_t acc = 0;
+  int acc_bits = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const huffman_code &c = huffman_table[static_cast<uint8_t>(s[i])];
+    acc = (acc << c.bits) | c.code;
+    acc_bits += c.bits;
+    while (acc_bits >= 8) {
+      acc_bits -= 8;
+      out.push_back(static_cast<char>(acc >> acc_bits));
+    }
+  }
+  // Pad with the most significant bits of EOS, all ones.
+  if (acc_bits > 0)
+    out.push_back(static_cast<char>((acc << (8 - acc_bits)) | (0xff >> acc_bits)));
+}
+
+namespace detail {
+
+// Canonical decoding tables: for each code length, the first code of that
+// length and where its symbols start in the symbols ordered by code.
+struct huffman_decoding
+{
+  uint32_t first_code[31];
+  uint16_t count[31];
+  uint16_t offset[31];
+  uint16_t symbols[257];
+
+  huffman_decoding() {
+    uint16_t n = 0;
+    uint32_t code = 0;
+    for (int len = 1; len <= 30; ++len) {
+      first_code[len] = code;
+      offset[len] = n;
+      count[len] = 0;
+      for (int sym = 0; sym <= 256; ++sym) {
+        if ((sym < 256 ? huffman_table[sym].bits : huffman_eos.bits) == len) {
+          symbols[n++] = static_cast<uint16_t>(sym);
+          ++count[len];
+        }
+      }
+      code = (code + count[len]) << 1;
+    }
+  }
+};
+
+inline const huffman_decoding& decoding() {
+  static const huffman_decoding tables;
+  return tables;
+}
+
+} // namespace detail
+
+/// Append the Huffman-decoded [p, p + n) to out. False on a malformed
+/// string: EOS inside it, or padding longer than 7 bits or not all ones.
+inline bool huffman_decode(const uint8_t *p, std::size_t n, std::string &out) {
+  const detail::huffman_decoding &t = detail::decoding();
+  uint32_t code = 0;
+  int len = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    for (int bit = 7; bit >= 0; --bit) {
+      code = (code << 1) | ((p[i] >> bit) & 1);
+      ++len;
+      if (len >= 5 && code - t.first_code[len] < t.count[len]) {
+        uint16_t sym = t.symbols[t.offset[len] + code - t.first_code[len]];
+        if (sym == 256)
+          return false;
+        out.push_back(static_cast<char>(sym));
+        code = 0;
+        len = 0;
+      }
+      else if (len == 30) {
+        return false;
+      }
+    }
+  }
+  return len < 8 && code == (1u << len) - 1;
+}
+
+/// Entries added by one side of a connection, newest first. Each counts
+/// its name and value plus 32 bytes against the table size (4.1).
+class dynamic_table
+{
+public:
+  struct entry
+  {
+    std::string name;
+    std::string value;
+  };
+
+  explicit dynamic_table(std::size_t max_size = 4096)
+      : max_size_(max_size)
+  {
+  }
+
+  std::size_t size() const { return size_; }
+  std::size_t max_size() const { return max_size_; }
+  std::size_t length() const { return entries_.size(); }
+
+  /// Entry i, 0 being the newest.
+  const entry& operator[](std::size_t i) const { return entries_[i]; }
+
+  void add(std::string name, std::string value) {
+    std::size_t need = name.size() + value.size() + 32;
+    evict(need > max_size_ ? max_size_ : max_size_ - need);
+    // An entry larger than the table empties it and is not added.
+    if (need > max_size_)
+      return;
+    size_ += need;
+    entries_.push_front(entry{std::move(name), std::move(value)});
+  }
+
+  void resize(std::size_t max_size) {
+    max_size_ = max_size;
+    evict(max_size_);
+  }
+
+private:
+  void evict(std::size_t limit) {
+    while (size_ > limit) {
+      size_ -= entries_.back().name.size() + entries_.back().value.size() + 32;
+      entries_.pop_back();
+    }
+  }
+
+  std::deque<entry> entries_;
+  std::size_t size_ = 0;
+  std::size_t max_size_;
+};
+
+/// Decodes the header blocks of one connection.
+class decoder
+{
+public:
+  /// limit is the table size advertised in our SETTINGS_HEADER_TABLE_SIZE,
+  /// which the peer's table size updates may not exceed.
+  explicit decoder(std::size_t limit = 4096)
+      : table_(limit),
+        limit_(limit)
+  {
+  }
+
+  /// Decode a complete header block, calling on_header(name, value) for each
+  /// field in order. False on a compression error, after which the
+  /// connection cannot continue.
+  template <typename F>
+  bool decode(const uint8_t *p, std::size_t n, F on_header) {
+    const uint8_t *end = p + n;
+    bool fields_seen = false;
+    while (p < end) {
+      uint8_t b = *p;
+      uint64_t index;
+      if (b & 0x80) {
+        // Indexed field.
+        if (!decode_integer(p, end, 7, index) || !lookup(index, name_, value_))
+          return false;
+        on_header(name_, value_);
+      }
+      else if ((b & 0xe0) == 0x20) {
+        // Table size update, allowed only before the first field.
+        if (fields_seen || !decode_integer(p, end, 5, index) || index > limit_)
+          return false;
+        table_.resize(static_cast<std::size_t>(index));
+        continue;
+      }
+      else {
+        // Literal, with incremental indexing (01), without (0000) or never
+        // indexed (0001).
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!decode_integer(p, end, indexing ? 6 : 4, index))
+          return false;
+        if (index == 0) {
+          if (!read_string(p, end, name_))
+            return false;
+        }
+        else if (!lookup(index, name_, value_)) {
+          return false;
+        }
+        if (!read_string(p, end, value_))
+          return false;
+        on_header(name_, value_);
+        if (indexing)
+          table_.add(name_, value_);
+      }
+      fields_seen = true;
+    }
+    return true;
+  }
+
+  const dynamic_table& table() const { return table_; }
+
+private:
+  bool lookup(uint64_t index, std::string &name, std::string &value) {
+    if (index == 0)
+      return false;
+    if (index <= static_table_size) {
+      name = static_table[index - 1].name;
+      value = static_table[index - 1].value;
+      return true;
+    }
+    index -= static_table_size + 1;
+    if (index >= table_.length())
+      return false;
+    name = table_[static_cast<std::size_t>(index)].name;
+    value = table_[static_cast<std::size_t>(index)].value;
+    return true;
+  }
+
+  bool read_string(const uint8_t *&p, const uint8_t *end, std::string &out) {
+    if (p == end)
+      return false;
+    bool huffman = (*p & 0x80) != 0;
+    uint64_t length;
+    if (!decode_integer(p, end, 7, length) || length > static_cast<uint64_t>(end - p))
+      return false;
+    out.clear();
+    if (huffman) {
+      if (!huffman_decode(p, static_cast<std::size_t>(length), out))
+        return false;
+    }
+    else {
+      out.assign(reinterpret_cast<const char*>(p), static_cast<std::size_t>(length));
+    }
+    p += length;
+    return true;
+  }
+
+  dynamic_table table_;
+  std::size_t limit_;
+  std::string name_;
+  std::string value_;
+};
+
+/// Encodes the header blocks of one connection. Fields are taken from the
+/// static or dynamic table where they match, and new ones are added to the
+/// dynamic table unless asked not to, so headers repeated across responses
+/// shrink to a byte or two.
+class encoder
+{
+public:
+  /// The peer's SETTINGS_HEADER_TABLE_SIZE. Our table never grows past the
+  /// default 4096; the change is signalled at the start of the next block.
+  void set_max_table_size(std::size_t size) {
+    if (size > 4096)
+      size = 4096;
+    if (size == table_.max_size())
+      return;
+    table_.resize(size);
+    size_update_ = true;
+  }
+
+  /// Start a new header block in out.
+  void begin(std::string &out) {
+    if (size_update_) {
+      encode_integer(out, 0x20, 5, table_.max_size());
+      size_update_ = false;
+    }
+  }
+
+  /// Append one field. Values that change with every response, such as
+  /// content-length, are better not indexed.
+  void encode(std::string &out, const char *name, std::size_t name_len,
+              const char *value, std::size_t value_len, bool index = true) {
+    std::size_t name_index = 0;
+    for (std::size_t i = 0; i < static_table_size; ++i) {
+      const static_entry &e = static_table[i];
+      // The first character rules out most entries without a strlen.
+      if (name_len == 0 || e.name[0] != name[0] || std::strlen(e.name) != name_len ||
+          std::memcmp(e.name, name, name_len) != 0)
+        continue;
+      if (!name_index)
+        name_index = i + 1;
+      if (std::strlen(e.value) == value_len && std::memcmp(e.value, value, value_len) == 0) {
+        encode_integer(out, 0x80, 7, i + 1);
+        return;
+      }
+    }
+    for (std::size_t i = 0; i < table_.length(); ++i) {
+      const dynamic_table::entry &e = table_[i];
+      if (e.name.size() != name_len || std::memcmp(e.name.data(), name, name_len) != 0)
+        continue;
+      if (!name_index)
+        name_index = static_table_size + 1 + i;
+      if (e.value.size() == value_len && std::memcmp(e.value.data(), value, value_len) == 0) {
+        encode_integer(out, 0x80, 7, static_table_size + 1 + i);
+        return;
+      }
+    }
+
+    if (index)
+      encode_integer(out, 0x40, 6, name_index);
+    else
+      encode_integer(out, 0x00, 4, name_index);
+    if (!name_index)
+      encode_string(out, name, name_len);
+    encode_string(out, value, value_len);
+    if (index)
+      table_.add(std::string(name, name_len), std::string(value, value_len));
+  }
+
+  void encode(std::string &out, const std::string &name, const std::string &value, bool index = true) {
+    encode(out, name.data(), name.size(), value.data(), value.size(), index);
+  }
+
+  const dynamic_table& table() const { return table_; }
+
+private:
+  static void encode_string(std::string &out, const char *s, std::size_t n) {
+    std::size_t huffman_length = huffman_size(s, n);
+    if (huffman_length < n) {
+      encode_integer(out, 0x80, 7, huffman_length);
+      huffman_encode(out, s, n);
+    }
+    else {
+      encode_integer(out, 0x00, 7, n);
+      out.append(s, n);
+    }
+  }
+
+  dynamic_table table_;
+  bool size_update_ = false;
+};
+
+} // namespace hpack
+} // namespace zion
+
+#endif //ZION_HPACK_H
@@ -0,0 +1,1154 @@
+//
+// Created by Shihao Jing on 8/28/17.
+//
+
+#ifndef ZION_HTTP2_H
+#define ZION_HTTP2_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "access_log.h"
+#include "hpack.h"
+#include "http_parser.h"
+#include "request.h"
+#include "response.h"
+
+namespace zion {
+
+/// HTTP/2 (RFC 7540): many requests multiplexed as streams over one
+/// connection, reached through ALPN "h2" over TLS, or in cleartext with
+/// prior knowledge or an "Upgrade: h2c" request.
+namespace http2 {
+
+/// Sent by every client before its first frame.
+const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const std::size_t client_preface_size = sizeof(client_preface) - 1;
+
+const std::size_t frame_header_size = 9;
+const uint32_t default_window_size = 65535;
+const uint32_t max_window_size = 0x7fffffff;
+const uint32_t default_max_frame_size = 16384;
+
+enum frame_type : uint8_t
+{
+  data_frame = 0x0,
+  headers_frame = 0x1,
+  priority_frame = 0x2,
+  rst_stream_frame = 0x3,
+  settings_frame = 0x4,
+  push_promise_frame = 0x5,
+  ping_frame = 0x6,
+  goaway_frame = 0x7,
+  window_update_frame = 0x8,
+  continuation_frame = 0x9
+};
+
+enum frame_flag : uint8_t
+{
+  flag_end_stream = 0x1,
+  flag_ack = 0x1,
+  flag_end_headers = 0x4,
+  flag_padded = 0x8,
+  flag_priority = 0x20
+};
+
+enum error_code : uint32_t
+{
+  no_error = 0x0,
+  protocol_error = 0x1,
+  internal_error = 0x2,
+  flow_control_error = 0x3,
+  stream_closed = 0x5,
+  frame_size_error = 0x6,
+  refused_stream = 0x7,
+  cancel = 0x8,
+  compression_error = 0x9,
+  enhance_your_calm = 0xb
+};
+
+enum setting_id : uint16_t
+{
+  header_table_size = 0x1,
+  enable_push = 0x2,
+  max_concurrent_streams = 0x3,
+  initial_window_size = 0x4,
+  max_frame_size = 0x5,
+  max_header_list_size = 0x6
+};
+
+/// What a server advertises to its HTTP/2 clients.
+struct settings
+{
+  // Off: clients only ever get HTTP/1.1.
+  bool enabled = true;
+  // Streams a client may have open at once.
+  uint32_t max_concurrent_streams = 256;
+  // Request body bytes a client may send on a stream, and on the whole
+  // connection, before waiting for us to read them.
+  uint32_t initial_window_size = 1 << 20;
+  uint32_t connection_window_size = 16 << 20;
+  // Decoded size of one request's header fields.
+  uint32_t max_header_list_size = 64 * 1024;
+  // Body bytes one request may send in all. Bodies are held whole until
+  // the handler runs, and the window is credited as they arrive, so this
+  // is what bounds them; a stream past it is reset.
+  std::size_t max_request_body_size = 16 << 20;
+};
+
+struct frame_header
+{
+  uint32_t length;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t stream_id;
+};
+
+inline uint32_t read_uint32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+inline void append_uint32(std::string &out, uint32_t v) {
+  char b[4] = { static_cast<char>(v >> 24), static_cast<char>(v >> 16), static_cast<char>(v >> 8), static_cast<char>(v) };
+  out.append(b, 4);
+}
+
+inline frame_header parse_frame_header(const uint8_t *p) {
+  frame_header h;
+  h.length = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+  h.type = p[3];
+  h.flags = p[4];
+  h.stream_id = read_uint32(p + 5) & 0x7fffffff;
+  return h;
+}
+
+inline void append_frame_header(std::string &out, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream_id) {
+  char b[frame_header_size] = {
+    static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+    static_cast<char>(type), static_cast<char>(flags),
+    static_cast<char>(stream_id >> 24), static_cast<char>(stream_id >> 16),
+    static_cast<char>(stream_id >> 8), static_cast<char>(stream_id)
+  };
+  out.append(b, frame_header_size);
+}
+
+/// SETTINGS payload carried base64url-encoded in the HTTP2-Settings header
+/// of an h2c upgrade. False if it is not valid base64url.
+inline bool decode_settings_header(const std::string &value, std::string &payload) {
+  payload.clear();
+  uint32_t acc = 0;
+  int bits = 0;
+  for (char c : value) {
+    int v;
+    if (c >= 'A' && c <= 'Z') v = c - 'A';
+    else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+    else if (c >= '0' && c <= '9') v = c - '0' + 52;
+    else if (c == '-' || c == '+') v = 62;
+    else if (c == '_' || c == '/') v = 63;
+    else if (c == '=') break;
+    else return false;
+    acc = (acc << 6) | static_cast<uint32_t>(v);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      payload.push_back(static_cast<char>(acc >> bits));
+    }
+  }
+  return payload.size() % 6 == 0;
+}
+
+/// Method code as http_parser numbers it, the way routes are matched.
+inline bool method_code(const std::string &method, unsigned int &code) {
+#define ZION_HTTP2_METHOD(num, name, string) \
+  if (method == #string) { code = num; return true; }
+  HTTP_METHOD_MAP(ZION_HTTP2_METHOD)
+#undef ZION_HTTP2_METHOD
+  return false;
+}
+
+/// One HTTP/2 connection, after the protocol has been chosen. Frames are
+/// read in batches; each complete request is dispatched to the handler as
+/// soon as its last frame is read, and the frames of every response, headers
+/// and body data interleaved across streams as flow control allows, go out
+/// in one gathered write per batch. Runs on the connection's io thread.
+template <typename Handler, typename Stream>
+class session : public std::enable_shared_from_this<session<Handler, Stream>>
+{
+public:
+  session(Stream stream, Handler *handler, const settings &local,
+          std::chrono::milliseconds idle_timeout, std::chrono::milliseconds stream_timeout,
+          bool gathers_writes, access_log *log = nullptr)
+      : stream_(std::move(stream)),
+        handler_(handler),
+        local_(local),
+        idle_timeout_(idle_timeout),
+        stream_timeout_(stream_timeout),
+        copy_all_(!gathers_writes),
+        log_(log),
+        timer_(stream_.get_executor()),
+        buffer_(65536),
+        recv_window_(default_window_size)
+  {
+  }
+
+  session(const session&) = delete;
+  session& operator=(const session&) = delete;
+
+  ~session() {
+    // The owner is let go on the io thread, as for websocket sessions.
+    if (owner_)
+      boost::asio::post(timer_.get_executor(), [owner = std::move(owner_)] {});
+  }
+
+  /// Keep owner, the connection the session came from, alive as long as the
+  /// session so that it still counts as open.
+  void set_owner(std::shared_ptr<void> owner) {
+    owner_ = std::move(owner);
+  }
+
+  /// Send our settings and start on data already read from the client. For
+  /// an h2c upgrade, upgraded is the request that becomes stream 1 and
+  /// upgrade_settings the client's HTTP2-Settings payload.
+  void start(const char *data, std::size_t size,
+             const request *upgraded = nullptr, const std::string &upgrade_settings = std::string()) {
+    std::string &out = pending_.bytes;
+    append_frame_header(out, 4 * 6, settings_frame, 0, 0);
+    append_setting(out, max_concurrent_streams, local_.max_concurrent_streams);
+    append_setting(out, initial_window_size, local_.initial_window_size);
+    append_setting(out, max_header_list_size, local_.max_header_list_size);
+    append_setting(out, enable_push, 0);
+    if (local_.connection_window_size > default_window_size) {
+      append_frame_header(out, 4, window_update_frame, 0, 0);
+      append_uint32(out, local_.connection_window_size - default_window_size);
+      recv_window_ = local_.connection_window_size;
+    }
+
+    if (upgraded) {
+      if (!apply_settings(reinterpret_cast<const uint8_t*>(upgrade_settings.data()), upgrade_settings.size()))
+        return;
+      auto s = open_stream(1);
+      // Copied field by field: the upgrade request's headers live in the
+      // connection's arena, which is reset once it lets go of the socket.
+      s->req.http_version_major = 2;
+      s->req.http_version_minor = 0;
+      s->req.method = upgraded->method;
+      s->req.method_code = upgraded->method_code;
+      s->req.uri = upgraded->uri;
+      s->req.body = upgraded->body;
+      s->req.keep_alive = true;
+      for (auto &header : upgraded->headers)
+        s->req.headers.emplace(arena_string(header.first.data(), header.first.size()),
+                               arena_string(header.second.data(), header.second.size()));
+      s->remote_closed = true;
+      dispatch(s);
+    }
+
+    std::memcpy(buffer_.data(), data, size);
+    buffer_end_ = size;
+    last_activity_ = std::chrono::steady_clock::now();
+    arm_timer();
+    if (!process())
+      return;
+    flush();
+    do_read();
+  }
+
+  /// Stop taking new streams and close once those under way have been
+  /// answered. Safe from any thread.
+  void shutdown() {
+    auto self = this->shared_from_this();
+    boost::asio::dispatch(timer_.get_executor(), [this, self]
+    {
+      if (finished_ || goaway_sent_)
+        return;
+      send_goaway(no_error);
+      flush();
+      close_if_done();
+    });
+  }
+
+private:
+  // One request and its response.
+  struct stream_state
+  {
+    uint32_t id;
+    request req;
+    response res;
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t recv_consumed = 0;
+    bool remote_closed = false;   // END_STREAM received
+    bool closed = false;          // response complete, or reset
+    bool queued = false;          // in ready_, with body data to frame
+    bool head = false;
+    std::size_t body_sent = 0;
+    // Streaming bodies: the producer's current chunk and how much of it is out.
+    std::string chunk;
+    std::size_t chunk_sent = 0;
+    bool more = true;
+    std::chrono::steady_clock::time_point start;
+    uint64_t bytes_sent = 0;
+  };
+  using stream_ptr = std::shared_ptr<stream_state>;
+
+  // Frames waiting for the next write. Frame headers and copied payloads are
+  // appended to bytes; response bodies are referenced where they are, their
+  // streams held until the write is done.
+  struct batch
+  {
+    struct piece
+    {
+      const char *data;        // null: [offset, offset + size) of bytes
+      std::size_t offset;
+      std::size_t size;
+    };
+
+    std::string bytes;
+    std::vector<piece> pieces;
+    std::vector<stream_ptr> holds;
+    std::size_t open_begin = 0;   // start of bytes not yet in pieces
+    std::size_t referenced = 0;
+
+    std::size_t size() const { return bytes.size() + referenced; }
+    bool empty() const { return size() == 0; }
+
+    void close_piece() {
+      if (bytes.size() > open_begin)
+        pieces.push_back(piece{nullptr, open_begin, bytes.size() - open_begin});
+      open_begin = bytes.size();
+    }
+
+    void reference(const stream_ptr &s, const char *data, std::size_t size) {
+      close_piece();
+      pieces.push_back(piece{data, 0, size});
+      holds.push_back(s);
+      referenced += size;
+    }
+
+    void clear() {
+      bytes.clear();
+      pieces.clear();
+      holds.clear();
+      open_begin = 0;
+      referenced = 0;
+    }
+  };
+
+  // Bodies smaller than this are copied next to their frame header.
+  static const std::size_t reference_threshold = 1024;
+  // Bytes of DATA framed per write, so one busy connection cannot starve
+  // the others on its thread. Reading stops while this much is already
+  // waiting behind the write in flight.
+  static const std::size_t batch_limit = 256 * 1024;
+  // Acknowledgements and resets queued behind one write. A client that
+  // keeps more coming (PING or SETTINGS floods, frames on closed streams)
+  // without reading them is told to calm down and dropped.
+  static const std::size_t max_queued_control = 1000;
+
+  static void append_setting(std::string &out, uint16_t id, uint32_t value) {
+    out.push_back(static_cast<char>(id >> 8));
+    out.push_back(static_cast<char>(id));
+    append_uint32(out, value);
+  }
+
+  void do_read() {
+    if (finished_ || closing_)
+      return;
+    auto self = this->shared_from_this();
+    stream_.async_read_some(boost::asio::buffer(buffer_.data() + buffer_end_, buffer_.size() - buffer_end_),
+                            [this, self](boost::system::error_code ec, std::size_t n)
+                            {
+                              if (ec) {
+                                finish();
+                                return;
+                              }
+                              last_activity_ = std::chrono::steady_clock::now();
+                              buffer_end_ += n;
+                              if (!process())
+                                return;
+                              flush();
+                              if (pending_.size() >= batch_limit) {
+                                // Resumed once the write in flight is done.
+                                read_paused_ = true;
+                                return;
+                              }
+                              do_read();
+                            });
+  }
+
+  // Handle every complete frame in the buffer. False once the connection is
+  // going down.
+  bool process() {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(buffer_.data());
+    std::size_t pos = 0;
+    if (!preface_received_) {
+      std::size_t n = std::min(buffer_end_, client_preface_size);
+      if (std::memcmp(p, client_preface, n) != 0) {
+        connection_error(protocol_error);
+        return false;
+      }
+      if (n < client_preface_size)
+        return true;
+      preface_received_ = true;
+      pos = client_preface_size;
+    }
+
+    while (buffer_end_ - pos >= frame_header_size) {
+      frame_header h = parse_frame_header(p + pos);
+      if (h.length > default_max_frame_size) {
+        connection_error(frame_size_error);
+        return false;
+      }
+      if (buffer_end_ - pos - frame_header_size < h.length)
+        break;
+      if (!handle_frame(h, p + pos + frame_header_size))
+        return false;
+      if (queued_control_ > max_queued_control) {
+        connection_error(enhance_your_calm);
+        return false;
+      }
+      pos += frame_header_size + h.length;
+    }
+    std::memmove(buffer_.data(), buffer_.data() + pos, buffer_end_ - pos);
+    buffer_end_ -= pos;
+
+    credit_connection();
+    pump();
+    close_if_done();
+    return !finished_;
+  }
+
+  bool handle_frame(const frame_header &h, const uint8_t *payload) {
+    // A header block is contiguous: nothing but its CONTINUATION frames may
+    // come in between.
+    if (continuation_stream_ && (h.type != continuation_frame || h.stream_id != continuation_stream_))
+      return connection_error(protocol_error);
+
+    switch (h.type) {
+      case data_frame:
+        return on_data(h, payload);
+      case headers_frame:
+        return on_headers(h, payload);
+      case continuation_frame:
+        if (!continuation_stream_)
+          return connection_error(protocol_error);
+        // A block longer than the header list we accept could not decode to
+        // one we accept either, and one cut into more than twice the frames
+        // it needs is being dribbled in.
+        if (header_block_.size() + h.length > header_block_limit() ||
+            ++continuations_ > 2 * header_block_limit() / default_max_frame_size)
+          return connection_error(enhance_your_calm);
+        header_block_.append(reinterpret_cast<const char*>(payload), h.length);
+        if (h.flags & flag_end_headers)
+          return end_headers();
+        return true;
+      case priority_frame:
+        if (h.stream_id == 0)
+          return connection_error(protocol_error);
+        if (h.length != 5)
+          reset_stream(h.stream_id, frame_size_error);
+        return true;
+      case rst_stream_frame:
+        if (h.stream_id == 0 || h.stream_id > last_stream_id_)
+          return connection_error(protocol_error);
+        if (h.length != 4)
+          return connection_error(frame_size_error);
+        close_stream(h.stream_id);
+        return true;
+      case settings_frame:
+        if (h.stream_id != 0)
+          return connection_error(protocol_error);
+        if (h.flags & flag_ack)
+          return h.length == 0 || connection_error(frame_size_error);
+        if (h.length % 6 != 0)
+          return connection_error(frame_size_error);
+        if (!apply_settings(payload, h.length))
+          return false;
+        append_frame_header(pending_.bytes, 0, settings_frame, flag_ack, 0);
+        ++queued_control_;
+        return true;
+      case push_promise_frame:
+        return connection_error(protocol_error);
+      case ping_frame:
+        if (h.stream_id != 0)
+          return connection_error(protocol_error);
+        if (h.length != 8)
+          return connection_error(frame_size_error);
+        if (h.flags & flag_ack)
+          return true;
+        append_frame_header(pending_.bytes, 8, ping_frame, flag_ack, 0);
+        pending_.bytes.append(reinterpret_cast<const char*>(payload), 8);
+        ++queued_control_;
+        return true;
+      case goaway_frame:
+        if (h.stream_id != 0)
+          return connection_error(protocol_error);
+        peer_goaway_ = true;
+        return true;
+      case window_update_frame:
+        return on_window_update(h, payload);
+      default:
+        // Unknown frame types are ignored.
+        return true;
+    }
+  }
+
+  std::size_t header_block_limit() const {
+    return local_.max_header_list_size + default_max_frame_size;
+  }
+
+  // Strip the padding of a DATA or HEADERS payload. False if malformed.
+  static bool unpad(const frame_header &h, const uint8_t *&payload, uint32_t &length) {
+    length = h.length;
+    if (!(h.flags & flag_padded))
+      return true;
+    if (length < 1 || payload[0] >= length)
+      return false;
+    length -= 1 + payload[0];
+    ++payload;
+    return true;
+  }
+
+  bool on_data(const frame_header &h, const uint8_t *payload) {
+    if (h.stream_id == 0)
+      return connection_error(protocol_error);
+    // The whole frame counts against the connection window, padding and
+    // all, even when the stream is gone.
+    recv_window_ -= h.length;
+    if (recv_window_ < 0)
+      return connection_error(flow_control_error);
+    recv_consumed_ += h.length;
+
+    uint32_t length;
+    if (!unpad(h, payload, length))
+      return connection_error(protocol_error);
+
+    auto it = streams_.find(h.stream_id);
+    if (it == streams_.end() || it->second->remote_closed) {
+      if (h.stream_id > last_stream_id_)
+        return connection_error(protocol_error);
+      reset_stream(h.stream_id, stream_closed);
+      return true;
+    }
+    stream_ptr s = it->second;
+    s->recv_window -= h.length;
+    if (s->recv_window < 0) {
+      reset_stream(s->id, flow_control_error);
+      return true;
+    }
+    if (length > local_.max_request_body_size - s->req.body.size()) {
+      reset_stream(s->id, enhance_your_calm);
+      return true;
+    }
+    s->req.body.append(reinterpret_cast<const char*>(payload), length);
+
+    if (h.flags & flag_end_stream) {
+      s->remote_closed = true;
+      dispatch(s);
+      return true;
+    }
+    // Let the client go on once half the window has been read.
+    s->recv_consumed += h.length;
+    if (s->recv_consumed >= local_.initial_window_size / 2) {
+      append_frame_header(pending_.bytes, 4, window_update_frame, 0, s->id);
+      append_uint32(pending_.bytes, s->recv_consumed);
+      s->recv_window += s->recv_consumed;
+      s->recv_consumed = 0;
+    }
+    return true;
+  }
+
+  void credit_connection() {
+    uint32_t window = std::max(local_.connection_window_size, default_window_size);
+    if (recv_consumed_ < window / 2)
+      return;
+    append_frame_header(pending_.bytes, 4, window_update_frame, 0, 0);
+    append_uint32(pending_.bytes, recv_consumed_);
+    recv_window_ += recv_consumed_;
+    recv_consumed_ = 0;
+  }
+
+  bool on_headers(const frame_header &h, const uint8_t *payload) {
+    if (h.stream_id == 0)
+      return connection_error(protocol_error);
+    uint32_t length;
+    if (!unpad(h, payload, length))
+      return connection_error(protocol_error);
+    if (h.flags & flag_priority) {
+      if (length < 5)
+        return connection_error(frame_size_error);
+      payload += 5;
+      length -= 5;
+    }
+    header_block_.assign(reinterpret_cast<const char*>(payload), length);
+    continuations_ = 0;
+    continuation_stream_ = h.stream_id;
+    header_end_stream_ = (h.flags & flag_end_stream) != 0;
+    if (h.flags & flag_end_headers)
+      return end_headers();
+    return true;
+  }
+
+  // A complete header block: a new request, or a request's trailers.
+  bool end_headers() {
+    uint32_t id = continuation_stream_;
+    continuation_stream_ = 0;
+
+    // Blocks are decoded even for streams about to be refused, to keep the
+    // decoder's table in step with the client's. Fields past the list size
+    // we accept are decoded but not kept.
+    fields_.clear();
+    std::size_t list_size = 0;
+    bool ok = decoder_.decode(reinterpret_cast<const uint8_t*>(header_block_.data()), header_block_.size(),
+                              [this, &list_size](const std::string &name, const std::string &value)
+                              {
+                                list_size += name.size() + value.size() + 32;
+                                if (list_size <= local_.max_header_list_size)
+                                  fields_.emplace_back(name, value);
+                              });
+    if (!ok)
+      return connection_error(compression_error);
+    bool too_large = list_size > local_.max_header_list_size;
+
+    auto it = streams_.find(id);
+    if (it != streams_.end()) {
+      stream_ptr s = it->second;
+      if (s->remote_closed || !header_end_stream_ || too_large) {
+        reset_stream(id, s->remote_closed ? stream_closed : protocol_error);
+        return true;
+      }
+      s->remote_closed = true;
+      dispatch(s);
+      return true;
+    }
+
+    if (id % 2 == 0 || id <= last_stream_id_)
+      return connection_error(protocol_error);
+    last_stream_id_ = id;
+    if (goaway_sent_ || peer_goaway_)
+      return true;
+    if (streams_.size() >= local_.max_concurrent_streams) {
+      reset_stream(id, refused_stream);
+      return true;
+    }
+
+    stream_ptr s = open_stream(id);
+    if (too_large || !build_request(s->req)) {
+      reset_stream(id, protocol_error);
+      return true;
+    }
+    if (header_end_stream_) {
+      s->remote_closed = true;
+      dispatch(s);
+    }
+    return true;
+  }
+
+  // Fill req from the decoded fields, the way the HTTP/1 parser would.
+  bool build_request(request &req) {
+    req.http_version_major = 2;
+    req.http_version_minor = 0;
+    req.keep_alive = true;
+    for (auto &field : fields_) {
+      const std::string &name = field.first;
+      if (name.empty())
+        return false;
+      if (name[0] == ':') {
+        if (name == ":method")
+          req.method = field.second;
+        else if (name == ":path")
+          req.uri = field.second;
+        else if (name == ":authority")
+          req.headers.emplace(arena_string("host"), arena_string(field.second.data(), field.second.size()));
+        continue;
+      }
+      for (char c : name) {
+        if (c >= 'A' && c <= 'Z')
+          return false;
+      }
+      arena_string key(name.data(), name.size());
+      auto existing = req.headers.find(key);
+      if (existing == req.headers.end()) {
+        req.headers.emplace(std::move(key), arena_string(field.second.data(), field.second.size()));
+      }
+      else {
+        // Repeated fields fold into one, as in HTTP/1; cookies with "; ".
+        existing->second.append(name == "cookie" ? "; " : ", ");
+        existing->second.append(field.second.data(), field.second.size());
+      }
+    }
+    return !req.method.empty() && !req.uri.empty() && method_code(req.method, req.method_code);
+  }
+
+  bool on_window_update(const frame_header &h, const uint8_t *payload) {
+    if (h.length != 4)
+      return connection_error(frame_size_error);
+    uint32_t increment = read_uint32(payload) & 0x7fffffff;
+    if (h.stream_id == 0) {
+      if (increment == 0)
+        return connection_error(protocol_error);
+      send_window_ += increment;
+      if (send_window_ > max_window_size)
+        return connection_error(flow_control_error);
+      return true;
+    }
+    auto it = streams_.find(h.stream_id);
+    if (it == streams_.end())
+      return true;
+    stream_ptr s = it->second;
+    if (increment == 0) {
+      reset_stream(s->id, protocol_error);
+      return true;
+    }
+    s->send_window += increment;
+    if (s->send_window > max_window_size) {
+      reset_stream(s->id, flow_control_error);
+      return true;
+    }
+    enqueue(s);
+    return true;
+  }
+
+  bool apply_settings(const uint8_t *p, std::size_t length) {
+    for (std::size_t i = 0; i + 6 <= length; i += 6) {
+      uint16_t id = static_cast<uint16_t>((p[i] << 8) | p[i + 1]);
+      uint32_t value = read_uint32(p + i + 2);
+      switch (id) {
+        case header_table_size:
+          encoder_.set_max_table_size(value);
+          break;
+        case enable_push:
+          if (value > 1)
+            return connection_error(protocol_error);
+          break;
+        case initial_window_size: {
+          if (value > max_window_size)
+            return connection_error(flow_control_error);
+          // Applies to open streams too, as a difference.
+          int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+          peer_initial_window_ = value;
+          for (auto &entry : streams_) {
+            entry.second->send_window += delta;
+            enqueue(entry.second);
+          }
+          break;
+        }
+        case max_frame_size:
+          if (value < default_max_frame_size || value > 0xffffff)
+            return connection_error(protocol_error);
+          peer_max_frame_size_ = value;
+          break;
+        default:
+          break;
+      }
+    }
+    return true;
+  }
+
+  stream_ptr open_stream(uint32_t id) {
+    auto s = std::make_shared<stream_state>();
+    s->id = id;
+    s->send_window = peer_initial_window_;
+    s->recv_window = local_.initial_window_size;
+    if (log_)
+      s->start = std::chrono::steady_clock::now();
+    streams_[id] = s;
+    return s;
+  }
+
+  // The request is complete: run the handler and queue the response.
+  void dispatch(const stream_ptr &s) {
+    s->res = handler_->handle(s->req);
+    send_response(s);
+  }
+
+  void send_response(const stream_ptr &s) {
+    if (s->res.is_async()) {
+      await_response(s);
+      return;
+    }
+    // Neither upgrades nor event streams exist in HTTP/2.
+    if (s->res.is_websocket() || s->res.is_event_stream())
+      s->res = response::stock_reply(response::not_implemented);
+    s->head = s->req.method_code == HTTP_HEAD;
+
+    bool has_body = !s->head && (s->res.is_streaming() || s->res.is_file() || s->res.body().size() != 0);
+    queue_headers(*s, !has_body);
+    if (has_body)
+      enqueue(s);
+    else
+      end_stream(s);
+  }
+
+  // An asynchronous route answers the stream whenever it is ready; other
+  // streams go on meanwhile. The stream timeout covers the wait.
+  void await_response(const stream_ptr &s) {
+    auto self = this->shared_from_this();
+    auto executor = timer_.get_executor();
+    auto on_async = std::move(s->res.on_async);
+    s->res.clear();
+    on_async(detail::make_responder([executor](auto handler) { boost::asio::post(executor, std::move(handler)); },
+                                    [this, self, s](response res)
+                                    {
+                                      // Reset by the client, or the session is gone.
+                                      if (s->closed || finished_)
+                                        return;
+                                      last_activity_ = std::chrono::steady_clock::now();
+                                      s->res = std::move(res);
+                                      send_response(s);
+                                      pump();
+                                      flush();
+                                      close_if_done();
+                                    },
+                                    executor));
+  }
+
+  void queue_headers(stream_state &s, bool end_stream) {
+    block_.clear();
+    encoder_.begin(block_);
+    char status[4];
+    std::snprintf(status, sizeof(status), "%03d", static_cast<int>(s.res.status_));
+    encoder_.encode(block_, ":status", 7, status, 3);
+
+    bool has_content_length = false;
+    for (auto &header : s.res.headers) {
+      name_.assign(header.key.data(), header.key.size());
+      for (char &c : name_)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+      // Connection-specific fields are not allowed in HTTP/2.
+      if (name_ == "connection" || name_ == "keep-alive" || name_ == "transfer-encoding" ||
+          name_ == "upgrade" || name_ == "proxy-connection")
+        continue;
+      bool is_length = name_ == "content-length";
+      has_content_length = has_content_length || is_length;
+      encoder_.encode(block_, name_.data(), name_.size(), header.value.data(), header.value.size(), !is_length);
+    }
+    if (!has_content_length && !s.res.is_streaming()) {
+      std::string length = std::to_string(s.res.is_file() ? s.res.file->size : s.res.body().size());
+      encoder_.encode(block_, "content-length", 14, length.data(), length.size(), false);
+    }
+
+    // Split into HEADERS and CONTINUATION frames as the peer's frame size
+    // requires.
+    std::size_t pos = 0;
+    bool first = true;
+    do {
+      std::size_t n = std::min<std::size_t>(block_.size() - pos, peer_max_frame_size_);
+      bool last = pos + n == block_.size();
+      uint8_t flags = (last ? flag_end_headers : 0) | (first && end_stream ? flag_end_stream : 0);
+      append_frame_header(pending_.bytes, static_cast<uint32_t>(n), first ? headers_frame : continuation_frame,
+                          flags, s.id);
+      pending_.bytes.append(block_, pos, n);
+      s.bytes_sent += frame_header_size + n;
+      pos += n;
+      first = false;
+    } while (pos < block_.size());
+  }
+
+  void enqueue(const stream_ptr &s) {
+    if (s->queued || s->closed || !s->remote_closed || s->send_window <= 0)
+      return;
+    if (s->res.status_ == response::ok && !s->res.is_streaming() && !s->res.is_file() && s->res.body().size() == 0)
+      return;
+    s->queued = true;
+    ready_.push_back(s);
+  }
+
+  // Frame response bodies, one DATA frame per stream in turn, while the
+  // windows and the batch limit allow.
+  void pump() {
+    while (!ready_.empty() && send_window_ > 0 && pending_.size() < batch_limit && !closing_) {
+      stream_ptr s = ready_.front();
+      ready_.pop_front();
+      s->queued = false;
+      if (s->closed)
+        continue;
+      if (s->send_window <= 0)
+        continue;   // back in ready_ with the stream's next WINDOW_UPDATE
+
+      std::size_t allowed = static_cast<std::size_t>(std::min<int64_t>({
+        static_cast<int64_t>(peer_max_frame_size_), send_window_, s->send_window}));
+      std::size_t n = 0;
+      bool last = false;
+      if (!frame_data(s, allowed, n, last)) {
+        reset_stream(s->id, internal_error);
+        continue;
+      }
+      send_window_ -= n;
+      s->send_window -= n;
+      s->bytes_sent += frame_header_size + n;
+      if (last) {
+        end_stream(s);
+      }
+      else {
+        s->queued = true;
+        ready_.push_back(s);
+      }
+    }
+  }
+
+  // Append one DATA frame of at most allowed bytes of the body of s.
+  bool frame_data(const stream_ptr &s, std::size_t allowed, std::size_t &n, bool &last) {
+    response &res = s->res;
+    std::string &out = pending_.bytes;
+
+    if (res.is_streaming()) {
+      if (s->chunk_sent == s->chunk.size() && s->more) {
+        s->chunk.clear();
+        s->chunk_sent = 0;
+        s->more = res.producer(s->chunk);
+      }
+      n = std::min(allowed, s->chunk.size() - s->chunk_sent);
+      last = !s->more && s->chunk_sent + n == s->chunk.size();
+      append_frame_header(out, static_cast<uint32_t>(n), data_frame, last ? flag_end_stream : 0, s->id);
+      // The chunk is replaced by the next one, so it is always copied.
+      out.append(s->chunk, s->chunk_sent, n);
+      s->chunk_sent += n;
+      return true;
+    }
+
+    boost::asio::const_buffer body = res.body();
+    std::size_t total = res.is_file() ? res.file->size : body.size();
+    n = std::min(allowed, total - s->body_sent);
+    last = s->body_sent + n == total;
+    append_frame_header(out, static_cast<uint32_t>(n), data_frame, last ? flag_end_stream : 0, s->id);
+    if (res.is_file()) {
+      std::size_t at = out.size();
+      out.resize(at + n);
+      ssize_t got;
+      do {
+        got = ::pread(res.file->fd, &out[at], n, res.file->offset + static_cast<off_t>(s->body_sent));
+      } while (got < 0 && errno == EINTR);
+      if (got != static_cast<ssize_t>(n))
+        return false;
+    }
+    else if (copy_all_ || n < reference_threshold) {
+      out.append(static_cast<const char*>(body.data()) + s->body_sent, n);
+    }
+    else {
+      pending_.reference(s, static_cast<const char*>(body.data()) + s->body_sent, n);
+    }
+    s->body_sent += n;
+    return true;
+  }
+
+  void end_stream(const stream_ptr &s) {
+    if (s->closed)
+      return;
+    log_stream(*s);
+    s->closed = true;
+    streams_.erase(s->id);
+  }
+
+  void close_stream(uint32_t id) {
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+      return;
+    it->second->closed = true;
+    streams_.erase(it);
+  }
+
+  void reset_stream(uint32_t id, error_code code) {
+    append_frame_header(pending_.bytes, 4, rst_stream_frame, 0, id);
+    append_uint32(pending_.bytes, code);
+    close_stream(id);
+    ++queued_control_;
+  }
+
+  void send_goaway(error_code code) {
+    goaway_sent_ = true;
+    append_frame_header(pending_.bytes, 8, goaway_frame, 0, 0);
+    append_uint32(pending_.bytes, last_stream_id_);
+    append_uint32(pending_.bytes, code);
+  }
+
+  // Tell the client why and close once that is written. Always false, for
+  // the callers to return.
+  bool connection_error(error_code code) {
+    if (!goaway_sent_)
+      send_goaway(code);
+    closing_ = true;
+    for (auto &entry : streams_)
+      entry.second->closed = true;
+    streams_.clear();
+    ready_.clear();
+    flush();
+    return false;
+  }
+
+  void flush() {
+    if (writing_ || finished_ || pending_.empty())
+      return;
+    pending_.close_piece();
+    std::swap(pending_, writing_batch_);
+    queued_control_ = 0;
+    write_buffers_.clear();
+    for (auto &piece : writing_batch_.pieces) {
+      const char *data = piece.data ? piece.data : writing_batch_.bytes.data() + piece.offset;
+      write_buffers_.push_back(boost::asio::const_buffer(data, piece.size));
+    }
+
+    writing_ = true;
+    auto self = this->shared_from_this();
+    boost::asio::async_write(stream_, write_buffers_,
+                             [this, self](boost::system::error_code ec, std::size_t)
+                             {
+                               writing_ = false;
+                               writing_batch_.clear();
+                               if (ec) {
+                                 finish();
+                                 return;
+                               }
+                               last_activity_ = std::chrono::steady_clock::now();
+                               if (closing_) {
+                                 finish();
+                                 return;
+                               }
+                               pump();
+                               flush();
+                               close_if_done();
+                               if (read_paused_ && pending_.size() < batch_limit) {
+                                 read_paused_ = false;
+                                 do_read();
+                               }
+                             });
+  }
+
+  // After a GOAWAY either way, the connection ends with its last stream.
+  void close_if_done() {
+    if ((goaway_sent_ || peer_goaway_) && streams_.empty() && !writing_ && pending_.empty())
+      finish();
+  }
+
+  void finish() {
+    if (finished_)
+      return;
+    finished_ = true;
+    boost::system::error_code ignored;
+    stream_.lowest_layer().close(ignored);
+    timer_.cancel(ignored);
+    for (auto &entry : streams_)
+      entry.second->closed = true;
+    streams_.clear();
+    ready_.clear();
+  }
+
+  // One timer for the session: connections without streams are closed
+  // after the keep-alive timeout, ones whose streams make no progress after
+  // the stream timeout. Activity only moves last_activity_; the timer checks
+  // it when it fires instead of being re-armed on every read.
+  void arm_timer() {
+    if (finished_)
+      return;
+    std::chrono::milliseconds timeout = streams_.empty() ? idle_timeout_ : stream_timeout_;
+    timer_.expires_at(last_activity_ + timeout);
+    auto self = this->shared_from_this();
+    timer_.async_wait([this, self](boost::system::error_code ec)
+                      {
+                        if (ec || finished_)
+                          return;
+                        std::chrono::milliseconds timeout = streams_.empty() ? idle_timeout_ : stream_timeout_;
+                        if (std::chrono::steady_clock::now() - last_activity_ < timeout) {
+                          arm_timer();
+                          return;
+                        }
+                        if (!streams_.empty()) {
+                          finish();
+                          return;
+                        }
+                        // Idle: say goodbye properly.
+                        send_goaway(no_error);
+                        closing_ = true;
+                        flush();
+                        if (!writing_)
+                          finish();
+                      });
+  }
+
+  void log_stream(const stream_state &s) {
+    if (!log_ || !log_->sample())
+      return;
+    access_record *rec = log_->reserve();
+    if (!rec)
+      return;
+
+    using namespace std::chrono;
+    int64_t duration = duration_cast<microseconds>(steady_clock::now() - s.start).count();
+    rec->timestamp_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() - duration;
+    rec->duration_us = static_cast<uint32_t>(duration);
+    rec->status = static_cast<uint16_t>(s.res.status_);
+    rec->method = static_cast<uint8_t>(s.req.method_code);
+    rec->bytes_sent = s.bytes_sent;
+    rec->uri_length = static_cast<uint16_t>(std::min(s.req.uri.size(), sizeof(rec->uri)));
+    std::memcpy(rec->uri, s.req.uri.data(), rec->uri_length);
+
+    record_peer(*rec, stream_.lowest_layer());
+    log_->commit();
+  }
+
+  Stream stream_;
+  Handler *handler_;
+  const settings &local_;
+  std::chrono::milliseconds idle_timeout_;
+  std::chrono::milliseconds stream_timeout_;
+  bool copy_all_;
+  access_log *log_;
+  std::shared_ptr<void> owner_;
+  boost::asio::steady_timer timer_;
+  std::chrono::steady_clock::time_point last_activity_;
+
+  std::vector<char> buffer_;
+  std::size_t buffer_end_ = 0;
+  bool preface_received_ = false;
+
+  hpack::decoder decoder_;
+  hpack::encoder encoder_;
+  std::string header_block_;
+  uint32_t continuation_stream_ = 0;
+  std::size_t continuations_ = 0;
+  bool header_end_stream_ = false;
+  std::vector<std::pair<std::string, std::string>> fields_;
+  std::string block_;
+  std::string name_;
+
+  std::unordered_map<uint32_t, stream_ptr> streams_;
+  std::deque<stream_ptr> ready_;
+  uint32_t last_stream_id_ = 0;
+
+  // Flow control: what we may still send, on the connection and by default
+  // per new stream, and what the client may still send us.
+  int64_t send_window_ = default_window_size;
+  int64_t peer_initial_window_ = default_window_size;
+  uint32_t peer_max_frame_size_ = default_max_frame_size;
+  int64_t recv_window_;
+  uint32_t recv_consumed_ = 0;
+
+  batch pending_;
+  batch writing_batch_;
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  bool writing_ = false;
+  bool read_paused_ = false;
+  std::size_t queued_control_ = 0;
+
+  bool goaway_sent_ = false;
+  bool peer_goaway_ = false;
+  bool closing_ = false;
+  bool finished_ = false;
+};
+
+} // namespace http2
+} // namespace zion
+
+#endif //ZION_HTTP2_H
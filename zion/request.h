@@ -8,6 +8,9 @@
 #include <vector>
 #include <unordered_map>
 #include <string>
+#include <cctype>
+#include <strings.h>
+#include "arena.h"
 
 namespace zion {
 
@@ -20,18 +23,93 @@ enum class HTTPMethod
   PUT
 };
 
+// Header names compare case-insensitively.
+struct header_hash
+{
+  std::size_t operator()(const arena_string &s) const
+  {
+    // FNV-1a over the lower-cased name
+    std::size_t h = 14695981039346656037ULL;
+    for (char c : s)
+    {
+      h ^= static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(c)));
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+};
+
+struct header_equal
+{
+  bool operator()(const arena_string &a, const arena_string &b) const
+  {
+    return a.size() == b.size() && ::strncasecmp(a.data(), b.data(), a.size()) == 0;
+  }
+};
+
+// method_code of a request whose request line has not been parsed, such as
+// one answered 400 for garbage input.
+const unsigned int no_method = 0xff;
+
+using header_map = std::unordered_map<arena_string, arena_string, header_hash, header_equal,
+                                      arena_allocator<std::pair<const arena_string, arena_string>>>;
+
 struct request
 {
+  request() = default;
+
+  // A request whose headers, and the handler's scratch space, live in a.
+  explicit request(zion::arena *a)
+      : headers(header_map::allocator_type(a)),
+        arena(a)
+  {
+  }
+
   int http_version_major;
   int http_version_minor;
   std::string method;
-  unsigned int method_code;
+  unsigned int method_code = no_method;
   std::string uri;
   std::string header_field;
   std::string header_value;
   std::string body;
-  std::unordered_map<std::string, std::string> headers;
+  header_map headers;
   int header_building_state = 0;
+  // set when the client asked to switch protocols (Upgrade or CONNECT)
+  bool upgrade = false;
+  // whether the client allows the connection to be reused after this request
+  bool keep_alive = false;
+  // Per-request scratch memory, reset once the response has been written.
+  // Null when the request was not read by a connection.
+  zion::arena *arena = nullptr;
+
+  // Reset for the next request while keeping the strings' capacity.
+  void clear()
+  {
+    http_version_major = 0;
+    http_version_minor = 0;
+    method.clear();
+    method_code = no_method;
+    uri.clear();
+    header_field.clear();
+    header_value.clear();
+    body.clear();
+    // Swapped with an empty map rather than cleared: clear() would keep the
+    // bucket array, which lives in the arena about to be reset.
+    header_map(headers.get_allocator()).swap(headers);
+    header_building_state = 0;
+    upgrade = false;
+    keep_alive = false;
+  }
+
+  // Value of a header matched case-insensitively, empty if absent.
+  std::string get_header(const std::string &name) const
+  {
+    auto it = headers.find(arena_string(name.data(), name.size(), headers.get_allocator()));
+    if (it == headers.end())
+      return std::string();
+    return std::string(it->second.data(), it->second.size());
+  }
 };
 
 } // namespace zion
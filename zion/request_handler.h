@@ -9,13 +9,24 @@
 #ifndef SLASH_REQUEST_HANDLER_H
 #define SLASH_REQUEST_HANDLER_H
 
+#include <atomic>
+#include <cstring>
 #include <string>
+#include <memory>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 #include "request.h"
 #include "response.h"
 #include "mime.h"
+#include "utility.h"
 
-namespace HTTP {
-namespace Server {
+namespace zion {
 
 // The common handler for all incoming requests
 class request_handler
@@ -25,25 +36,118 @@ public:
     request_handler& operator=(const request_handler& ) = delete;
 
     // construct with a directory containing files to be served
-    explicit request_handler(const std::string& doc_root);
+    explicit request_handler(const std::string& doc_root)
+    : doc_root_(doc_root),
+      doc_root_fd_(::open(doc_root.c_str(), O_DIRECTORY | O_CLOEXEC))
+    {
+    }
+
+    ~request_handler()
+    {
+        if (doc_root_fd_ >= 0)
+        {
+            ::close(doc_root_fd_);
+        }
+    }
 
     // handle a request and produce a response
+    void handle_request(const request& req, response& rep)
+    {
+        std::string path(req.uri, 0, req.uri.find('?'));
+        if (!util::url_decode(path, true) || !util::normalize_path(path))
+        {
+            rep = response::stock_reply(response::bad_request);
+            return;
+        }
+        if (path[path.size()-1] == '/')
+        {
+            path += "index.html";
+        }
+
+        // find file extension. find the last dot, if last dot is behind last slash, it is valid and
+        // file extension(type) is the string behind last dot
+        std::size_t last_slash_pos = path.find_last_of("/");
+        std::size_t last_dot_pos = path.find_last_of(".");
+        std::string fileExtension;
+        if (last_dot_pos != std::string::npos && last_dot_pos > last_slash_pos)
+        {
+            fileExtension = path.substr(last_dot_pos+1);
+        }
 
-    // Reply class to be developed
-    //void handle_request(const request& req, response& rep);
+        // open the target file relative to the document root and send it back in response content
+        int fd = doc_root_fd_ < 0 ? -1 : open_beneath(path.c_str() + 1);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            rep = response::stock_reply(response::not_found);
+            return;
+        }
 
-    void handle_request(const request& req, response& rep);
+        // the file itself is the body, sent with sendfile by the connection
+        rep = response(std::make_shared<file_body>(fd, 0, static_cast<std::size_t>(st.st_size)));
+        rep.add_header("Content-Length", std::to_string(rep.file->size));
+        rep.add_header("Content-Type", MIME::extension_to_mime(fileExtension));
+    }
 
 private:
+    // open a normalized relative path beneath doc_root_fd_, returns -1 on failure
+    int open_beneath(const char* relative_path)
+    {
+#ifdef SYS_openat2
+        if (has_openat2_.load(std::memory_order_relaxed))
+        {
+            struct open_how how = {};
+            how.flags = O_RDONLY | O_CLOEXEC;
+            how.resolve = RESOLVE_BENEATH;
+            int fd = static_cast<int>(::syscall(SYS_openat2, doc_root_fd_, relative_path, &how, sizeof(how)));
+            if (fd >= 0 || errno != ENOSYS)
+            {
+                return fd;
+            }
+            has_openat2_.store(false, std::memory_order_relaxed);
+        }
+#endif
+        // the path is already free of "..", so only symlinks could escape: walk it one
+        // directory at a time, following none of them
+        int dir = doc_root_fd_;
+        const char* name = relative_path;
+        for (const char* slash; (slash = std::strchr(name, '/')) != nullptr; name = slash + 1)
+        {
+            std::string component(name, slash);
+            int next = ::openat(dir, component.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (dir != doc_root_fd_)
+            {
+                ::close(dir);
+            }
+            if (next < 0)
+            {
+                return -1;
+            }
+            dir = next;
+        }
+        int fd = ::openat(dir, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (dir != doc_root_fd_)
+        {
+            ::close(dir);
+        }
+        return fd;
+    }
+
     // the directory containing the files to be served.
     std::string doc_root_;
 
-    //perform URL-decoding on a string. returns false if the encoding was invalid
-    static bool url_decode(const std::string& in, std::string& out);
+    // directory fd all lookups are resolved against, so traversal is checked by the kernel
+    int doc_root_fd_;
+
+    // cleared once openat2 reports ENOSYS, so old kernels pay for the probe only once
+    // (shared by the io threads)
+    std::atomic<bool> has_openat2_{true};
 };
 
-}//namespace server
-}//namespace http
+}//namespace zion
 
 #endif //SLASH_REQUEST_HANDLER_H
-
@@ -13,31 +13,109 @@ namespace zion {
 class request_parser
 {
 public:
-  request_parser() = default;
+  request_parser() {
+    reset(nullptr);
+  }
 
   enum result_type { good, bad, indeterminate };
 
+  // Start parsing a new request into req.
+  void reset(request *req) {
+    http_parser_init(&parser_, HTTP_REQUEST);
+    parser_.data = this;
+    req_ = req;
+    started_ = false;
+    headers_complete_ = false;
+    message_complete_ = false;
+  }
+
+  // Whether any byte of the current request has been parsed.
+  bool started() const {
+    return started_;
+  }
+
+  // Whether the header section of the current request has been parsed.
+  bool headers_complete() const {
+    return headers_complete_;
+  }
+
+  // Feed the next bytes of the request. Returns good once a whole request has
+  // been parsed, indeterminate if more bytes are needed. consumed is set to
+  // the bytes used, so whatever follows (a pipelined request) can be kept.
+  result_type parse(const char* buffer, size_t length, size_t &consumed) {
+    consumed = http_parser_execute(&parser_, &settings(), buffer, length);
+    if (message_complete_) {
+      http_parser_pause(&parser_, 0);
+      return good;
+    }
+    if (HTTP_PARSER_ERRNO(&parser_) != HPE_OK || consumed != length)
+      return bad;
+    return indeterminate;
+  }
+
+  // Parse a request that arrives in one piece.
+  bool parse(request &req, const char* buffer, size_t length) {
+    reset(&req);
+    size_t consumed;
+    return parse(buffer, length, consumed) != bad;
+  }
+
+private:
+  static request* get_request(http_parser* parser)
+  {
+    return static_cast<request_parser*>(parser->data)->req_;
+  }
+
+  static const http_parser_settings& settings()
+  {
+    static const http_parser_settings settings = [] {
+      http_parser_settings s;
+      http_parser_settings_init(&s);
+      s.on_message_begin = on_message_begin;
+      s.on_message_complete = on_message_complete;
+      s.on_url = on_url;
+      s.on_header_field = on_header_field;
+      s.on_header_value = on_header_value;
+      s.on_headers_complete = on_headers_complete;
+      s.on_body = on_body;
+      return s;
+    }();
+    return settings;
+  }
+
   static int on_message_begin(http_parser* parser)
   {
+    static_cast<request_parser*>(parser->data)->started_ = true;
     return 0;
   }
 
+  // Copy the header being built into the map, which allocates from the
+  // request's arena, leaving the scratch strings' capacity for the next one.
+  static void add_header(request *req)
+  {
+    auto alloc = req->headers.get_allocator();
+    req->headers.emplace(arena_string(req->header_field.data(), req->header_field.size(), alloc),
+                         arena_string(req->header_value.data(), req->header_value.size(), alloc));
+    req->header_field.clear();
+    req->header_value.clear();
+  }
+
   static int on_url(http_parser* parser, const char* at, size_t length)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
     req->uri.append(at, length);
     return 0;
   }
 
   static int on_header_field(http_parser* parser, const char* at, size_t length)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
     switch (req->header_building_state)
     {
       case 0:
         if (!req->header_value.empty())
         {
-          req->headers.emplace(std::move(req->header_field), std::move(req->header_value));
+          add_header(req);
         }
         req->header_field.assign(at, length);
         req->header_building_state = 1;
@@ -53,7 +131,7 @@ public:
 
   static int on_header_value(http_parser* parser, const char* at, size_t length)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
     switch (req->header_building_state)
     {
       case 0:
@@ -69,48 +147,42 @@ public:
 
   static int on_headers_complete(http_parser* parser)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
     if (!req->header_field.empty())
     {
-      req->headers.emplace(std::move(req->header_field), std::move(req->header_value));
-      req->method_code = parser->method;
-      req->method = http_method_str(http_method(parser->method));
-      req->http_version_major = parser->http_major;
-      req->http_version_minor = parser->http_minor;
+      add_header(req);
     }
+    req->method_code = parser->method;
+    req->method = http_method_str(http_method(parser->method));
+    req->http_version_major = parser->http_major;
+    req->http_version_minor = parser->http_minor;
+    req->upgrade = parser->upgrade != 0;
+    static_cast<request_parser*>(parser->data)->headers_complete_ = true;
     return 0;
   }
 
   static int on_body(http_parser* parser, const char* at, size_t length)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
     req->body.append(at, length);
     return 0;
   }
 
   static int on_message_complete(http_parser* parser)
   {
-    request *req = static_cast<request*>(parser->data);
+    request *req = get_request(parser);
+    req->keep_alive = http_should_keep_alive(parser) != 0;
+    // Stop right after this request so pipelined bytes are left for the next one.
+    static_cast<request_parser*>(parser->data)->message_complete_ = true;
+    http_parser_pause(parser, 1);
     return 0;
   }
 
-  bool parse(request &req, const char* buffer, size_t length) {
-    http_parser_settings settings;
-    settings.on_message_begin = on_message_begin;
-    settings.on_message_complete = on_message_complete;
-    settings.on_url = on_url;
-    settings.on_header_field = on_header_field;
-    settings.on_header_value = on_header_value;
-    settings.on_headers_complete = on_headers_complete;
-    settings.on_body = on_body;
-
-    http_parser *parser = new http_parser();
-    http_parser_init(parser, HTTP_REQUEST); /* initialise parser */
-    parser->data = &req;
-
-    size_t nparsed = http_parser_execute(parser, &settings, buffer, length);
-    return nparsed == length;
-  }
+  http_parser parser_;
+  request *req_;
+  bool started_;
+  bool headers_complete_;
+  bool message_complete_;
 };
 
 } //namespace zion
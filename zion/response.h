@@ -5,15 +5,98 @@
 #ifndef ZION_RESPONSE_H
 #define ZION_RESPONSE_H
 
+#include <atomic>
 #include <string>
 #include <vector>
+#include <functional>
 #include <unordered_map>
+#include <memory>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/asio.hpp>
 #include "header.h"
+#include "mime.h"
 
 namespace zion {
 
+/// Produces the body of a streaming reply one chunk at a time. The producer
+/// fills chunk with the next piece of the body and returns false once the
+/// body is complete; it is only called again after the previous chunk has
+/// been written to the socket.
+using body_producer = std::function<bool(std::string &chunk)>;
 
+class event_stream;
+
+namespace websocket {
+class session;
+}
+
+/// Called once the headers of a text/event-stream reply have been sent. The
+/// handler may keep the stream and push events to it from any thread.
+using event_stream_handler = std::function<void(std::shared_ptr<event_stream>)>;
+
+/// Called with the new session once a WebSocket upgrade has been accepted.
+using websocket_handler = std::function<void(std::shared_ptr<websocket::session>)>;
+
+struct response;
+
+/// Sends the reply of an asynchronous route: anything a handler may return,
+/// a response, a string or a status. Call it once, from any thread, while
+/// the server runs; later calls are ignored. Copies share the one reply,
+/// and dropping the last unanswered answers 500.
+class responder
+{
+public:
+  responder() = default;
+
+  responder(std::function<void(response)> send, boost::asio::any_io_executor executor)
+      : send_(std::move(send)), executor_(std::move(executor))
+  {
+  }
+
+  template <typename T>
+  void operator()(T &&reply) const {
+    send_(response(std::forward<T>(reply)));
+  }
+
+  /// The io thread serving the request, for timers and sockets of the
+  /// handler's own; their handlers then run alongside the connection's.
+  const boost::asio::any_io_executor& get_executor() const { return executor_; }
+
+private:
+  std::function<void(response)> send_;
+  boost::asio::any_io_executor executor_;
+};
+
+/// Starts an asynchronous reply: called with its responder once the request
+/// has been read, it may return at once and respond later, for instance
+/// from a database client's completion handler.
+using async_handler = std::function<void(responder)>;
+
+/// A file sent as the body of a reply, straight from the page cache with
+/// sendfile where the connection's stream allows it. The descriptor is
+/// closed with the last reply referring to it.
+struct file_body
+{
+  file_body(int fd, off_t offset, std::size_t size)
+      : fd(fd), offset(offset), size(size)
+  {
+  }
+
+  file_body(const file_body&) = delete;
+  file_body& operator=(const file_body&) = delete;
+
+  ~file_body()
+  {
+    ::close(fd);
+  }
+
+  int fd;
+  off_t offset;
+  std::size_t size;
+};
 
 /// A reply to be sent to a client.
 struct response
@@ -22,6 +105,7 @@ struct response
   /// The status of the reply.
   enum status_type
   {
+    switching_protocols = 101,
     ok = 200,
     created = 201,
     accepted = 202,
@@ -46,64 +130,200 @@ struct response
   {
   }
 
-  response(std::string body) : content(body)
+  response(std::string body) : content(std::move(body))
+  {
+  }
+
+  response(const char *body) : content(body)
+  {
+  }
+
+  /// A reply kept in a, the request's arena (request::arena): its headers,
+  /// added with add_header(), and arena_content take no global allocator
+  /// calls. It must be sent while the request is in flight.
+  explicit response(zion::arena *a)
+      : headers(arena_allocator<header>(a)),
+        arena_content(arena_allocator<char>(a))
+  {
+  }
+
+  /// A body built in the request's arena, sent from there.
+  response(arena_string body) : arena_content(std::move(body))
+  {
+  }
+
+  response(body_producer body) : producer(std::move(body))
+  {
+  }
+
+  response(event_stream_handler handler) : on_event_stream(std::move(handler))
+  {
+  }
+
+  response(websocket_handler handler) : on_websocket(std::move(handler))
+  {
+  }
+
+  response(async_handler handler) : on_async(std::move(handler))
+  {
+  }
+
+  response(std::shared_ptr<file_body> body) : file(std::move(body))
   {
   }
 
   /// The headers to be included in the reply.
-  std::vector<header> headers;
+  std::vector<header, arena_allocator<header>> headers;
 
   /// The content to be sent in the reply.
   std::string content;
 
+  /// Content in the request's arena, sent instead of content when it is not
+  /// empty.
+  arena_string arena_content;
+
+  /// Body source for a streaming reply, sent with chunked transfer-encoding
+  /// instead of content.
+  body_producer producer;
+
+  /// Receives the stream of a Server-Sent Events reply, which keeps the
+  /// connection open instead of sending content.
+  event_stream_handler on_event_stream;
+
+  /// Receives the session when the request is upgraded to a WebSocket.
+  websocket_handler on_websocket;
+
+  /// Produces the actual reply later, through a responder.
+  async_handler on_async;
+
+  /// File sent as the body instead of content.
+  std::shared_ptr<file_body> file;
+
+  /// Whether the connection stays open for another request after this reply.
+  /// Set by the connection before the reply is written.
+  bool keep_alive = false;
+
+  /// Whether the body comes from a producer rather than content.
+  bool is_streaming() const { return static_cast<bool>(producer); }
+
+  /// Whether this reply opens a Server-Sent Events stream.
+  bool is_event_stream() const { return static_cast<bool>(on_event_stream); }
+
+  /// Whether this reply accepts a WebSocket upgrade.
+  bool is_websocket() const { return static_cast<bool>(on_websocket); }
+
+  /// Whether the body is a file.
+  bool is_file() const { return static_cast<bool>(file); }
+
+  /// The content sent: arena_content, or content when that is empty.
+  boost::asio::const_buffer body() const
+  {
+    if (!arena_content.empty())
+      return boost::asio::buffer(arena_content.data(), arena_content.size());
+    return boost::asio::buffer(content);
+  }
+
+  /// Add a header, copied into the arena the reply was made with, if any.
+  void add_header(const char *key, const char *value)
+  {
+    arena_allocator<char> a(headers.get_allocator());
+    headers.emplace_back(arena_string(key, a), arena_string(value, a));
+  }
+
+  void add_header(const std::string &key, const std::string &value)
+  {
+    arena_allocator<char> a(headers.get_allocator());
+    headers.emplace_back(arena_string(key.data(), key.size(), a), arena_string(value.data(), value.size(), a));
+  }
+
+  /// Whether the reply is still to come, from on_async.
+  bool is_async() const { return static_cast<bool>(on_async); }
+
   /// Convert the reply into a vector of buffers. The buffers do not own the
   /// underlying memory blocks, therefore the reply object must remain valid and
-  /// not be changed until the write operation has completed.
+  /// not be changed until the write operation has completed. For streaming
+  /// and event stream replies only the status line and headers are returned.
   std::vector<boost::asio::const_buffer> to_buffers();
 
+  /// As above, but into buffers, whose capacity is reused from one reply to
+  /// the next.
+  void to_buffers(std::vector<boost::asio::const_buffer> &buffers);
+
+  /// Reset to an empty 200 reply, keeping the capacity of content and
+  /// headers unless it is in an arena, which is dropped here: call before
+  /// resetting that arena.
+  void clear()
+  {
+    status_ = ok;
+    if (headers.get_allocator().get_arena())
+      headers = std::vector<header, arena_allocator<header>>();
+    else
+      headers.clear();
+    arena_content = arena_string();
+    content.clear();
+    producer = nullptr;
+    on_event_stream = nullptr;
+    on_websocket = nullptr;
+    on_async = nullptr;
+    file.reset();
+    keep_alive = false;
+  }
+
   /// Get a stock reply.
   static response stock_reply(status_type status);
+
+  /// The regular file at path as the body, typed by its extension; a stock
+  /// 404 reply when it cannot be opened.
+  static response send_file(const std::string &path);
+
+private:
+  /// Storage for the Content-Length value generated by to_buffers().
+  std::string content_length_;
 };
 
 namespace status_strings {
 
+const std::string switching_protocols =
+    "HTTP/1.1 101 Switching Protocols\r\n";
 const std::string ok =
-    "HTTP/1.0 200 OK\r\n";
+    "HTTP/1.1 200 OK\r\n";
 const std::string created =
-    "HTTP/1.0 201 Created\r\n";
+    "HTTP/1.1 201 Created\r\n";
 const std::string accepted =
-    "HTTP/1.0 202 Accepted\r\n";
+    "HTTP/1.1 202 Accepted\r\n";
 const std::string no_content =
-    "HTTP/1.0 204 No Content\r\n";
+    "HTTP/1.1 204 No Content\r\n";
 const std::string multiple_choices =
-    "HTTP/1.0 300 Multiple Choices\r\n";
+    "HTTP/1.1 300 Multiple Choices\r\n";
 const std::string moved_permanently =
-    "HTTP/1.0 301 Moved Permanently\r\n";
+    "HTTP/1.1 301 Moved Permanently\r\n";
 const std::string moved_temporarily =
-    "HTTP/1.0 302 Moved Temporarily\r\n";
+    "HTTP/1.1 302 Moved Temporarily\r\n";
 const std::string not_modified =
-    "HTTP/1.0 304 Not Modified\r\n";
+    "HTTP/1.1 304 Not Modified\r\n";
 const std::string bad_request =
-    "HTTP/1.0 400 Bad Request\r\n";
+    "HTTP/1.1 400 Bad Request\r\n";
 const std::string unauthorized =
-    "HTTP/1.0 401 Unauthorized\r\n";
+    "HTTP/1.1 401 Unauthorized\r\n";
 const std::string forbidden =
-    "HTTP/1.0 403 Forbidden\r\n";
+    "HTTP/1.1 403 Forbidden\r\n";
 const std::string not_found =
-    "HTTP/1.0 404 Not Found\r\n";
+    "HTTP/1.1 404 Not Found\r\n";
 const std::string internal_server_error =
-    "HTTP/1.0 500 Internal Server Error\r\n";
+    "HTTP/1.1 500 Internal Server Error\r\n";
 const std::string not_implemented =
-    "HTTP/1.0 501 Not Implemented\r\n";
+    "HTTP/1.1 501 Not Implemented\r\n";
 const std::string bad_gateway =
-    "HTTP/1.0 502 Bad Gateway\r\n";
+    "HTTP/1.1 502 Bad Gateway\r\n";
 const std::string service_unavailable =
-    "HTTP/1.0 503 Service Unavailable\r\n";
+    "HTTP/1.1 503 Service Unavailable\r\n";
 
 boost::asio::const_buffer to_buffer(response::status_type status)
 {
   switch (status)
   {
+    case response::switching_protocols:
+      return boost::asio::buffer(switching_protocols);
     case response::ok:
       return boost::asio::buffer(ok);
     case response::created:
@@ -147,25 +367,114 @@ namespace misc_strings {
 
 const char name_value_separator[] = { ':', ' ' };
 const char crlf[] = { '\r', '\n' };
+const char connection_close[] = "Connection: close\r\n";
+const char connection_keep_alive[] = "Connection: keep-alive\r\n";
+const char content_length[] = "Content-Length: ";
+const char transfer_encoding_chunked[] = "Transfer-Encoding: chunked\r\n";
+const char last_chunk[] = "0\r\n\r\n";
+const char event_stream_headers[] = "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n";
 
 } // namespace misc_strings
 
 std::vector<boost::asio::const_buffer> response::to_buffers()
 {
   std::vector<boost::asio::const_buffer> buffers;
+  to_buffers(buffers);
+  return buffers;
+}
+
+void response::to_buffers(std::vector<boost::asio::const_buffer> &buffers)
+{
+  buffers.clear();
   buffers.push_back(status_strings::to_buffer(status_));
+  bool has_content_length = false;
   for (int i = 0; i < headers.size(); i++)
   {
     buffers.push_back(boost::asio::buffer(headers[i].key));
-    buffers.push_back(boost::asio::buffer(misc_strings::name_value_separator, std::strlen(misc_strings::name_value_separator)));
+    buffers.push_back(boost::asio::buffer(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator)));
     buffers.push_back(boost::asio::buffer(headers[i].value));
-    buffers.push_back(boost::asio::buffer(misc_strings::crlf, std::strlen(misc_strings::crlf)));
+    buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+    has_content_length = has_content_length || ::strcasecmp(headers[i].key.c_str(), "Content-Length") == 0;
   }
-  buffers.push_back(boost::asio::buffer(misc_strings::crlf, std::strlen(misc_strings::crlf)));
-  buffers.push_back(boost::asio::buffer(content));
-  return buffers;
+  if (status_ != switching_protocols)
+  {
+    if (keep_alive)
+      buffers.push_back(boost::asio::buffer(misc_strings::connection_keep_alive, sizeof(misc_strings::connection_keep_alive) - 1));
+    else
+      buffers.push_back(boost::asio::buffer(misc_strings::connection_close, sizeof(misc_strings::connection_close) - 1));
+  }
+  if (is_streaming())
+  {
+    buffers.push_back(boost::asio::buffer(misc_strings::transfer_encoding_chunked,
+                                          sizeof(misc_strings::transfer_encoding_chunked) - 1));
+    buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+    return;
+  }
+  if (is_event_stream())
+  {
+    buffers.push_back(boost::asio::buffer(misc_strings::event_stream_headers,
+                                          sizeof(misc_strings::event_stream_headers) - 1));
+    buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+    return;
+  }
+  if (!has_content_length && status_ != switching_protocols)
+  {
+    // The body has to be delimited for the connection to be reused.
+    content_length_ = std::to_string(is_file() ? file->size : body().size());
+    buffers.push_back(boost::asio::buffer(misc_strings::content_length, sizeof(misc_strings::content_length) - 1));
+    buffers.push_back(boost::asio::buffer(content_length_));
+    buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+  }
+  buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+  if (!is_file())
+    buffers.push_back(body());
+}
+
+namespace detail {
+
+// The state behind a responder. The first answer, or a 500 if it is dropped
+// unanswered, goes to deliver on the io thread through post(handler).
+// deliver, which keeps its connection open, is given up with it, so a
+// responder kept around after answering holds nothing.
+template <typename Post, typename Deliver>
+class pending_reply
+{
+public:
+  pending_reply(Post post, Deliver deliver)
+      : post_(std::move(post)), deliver_(std::move(deliver))
+  {
+  }
+
+  pending_reply(const pending_reply&) = delete;
+  pending_reply& operator=(const pending_reply&) = delete;
+
+  ~pending_reply() {
+    answer(response::stock_reply(response::internal_server_error));
+  }
+
+  void answer(response res) {
+    if (answered_.exchange(true))
+      return;
+    post_([deliver = std::move(deliver_), res = std::move(res)]() mutable
+          {
+            deliver(std::move(res));
+          });
+  }
+
+private:
+  Post post_;
+  Deliver deliver_;
+  std::atomic<bool> answered_{false};
+};
+
+template <typename Post, typename Deliver>
+responder make_responder(Post post, Deliver deliver, boost::asio::any_io_executor executor) {
+  auto reply = std::make_shared<pending_reply<Post, Deliver>>(std::move(post), std::move(deliver));
+  return responder([reply](response res) { reply->answer(std::move(res)); }, std::move(executor));
 }
 
+} // namespace detail
+
 namespace stock_replies {
 
 const char ok[] = "";
@@ -293,11 +602,29 @@ response response::stock_reply(response::status_type status)
   response rep;
   rep.status_ = status;
   rep.content = stock_replies::to_string(status);
-  rep.headers.resize(2);
-  rep.headers[0].key = "Content-Length";
-  rep.headers[0].value = std::to_string(rep.content.size());
-  rep.headers[1].key = "Content-Type";
-  rep.headers[1].value = "text/html";
+  rep.add_header("Content-Length", std::to_string(rep.content.size()));
+  rep.add_header("Content-Type", "text/html");
+  return rep;
+}
+
+response response::send_file(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    if (fd >= 0)
+      ::close(fd);
+    return stock_reply(not_found);
+  }
+
+  response rep(std::make_shared<file_body>(fd, 0, static_cast<std::size_t>(st.st_size)));
+  std::size_t last_slash = path.find_last_of('/');
+  std::size_t last_dot = path.find_last_of('.');
+  std::string extension;
+  if (last_dot != std::string::npos && (last_slash == std::string::npos || last_dot > last_slash))
+    extension = path.substr(last_dot + 1);
+  rep.add_header("Content-Type", MIME::extension_to_mime(extension));
   return rep;
 }
 
@@ -8,15 +8,58 @@
 #include <unordered_map>
 #include <string>
 #include <memory>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include "cpu_pool.h"
 #include "request.h"
 #include "response.h"
+#include "sse.h"
+#include "task.h"
 #include "utility.h"
+#include "websocket.h"
 
 #define ALPHABET_SIZE 128
 #define PARAMTYPE_NUM  6
 
 namespace zion {
 
+namespace detail {
+
+// An offloaded route's reply: the handler runs on the offload pool and the
+// responder posts its response back to the connection's io thread. f is
+// kept by the route and outlives the request. Coroutine handlers stay on
+// the io thread; they offload with co_await zion::offload().
+template <typename F, typename... Args>
+response offload_handler(std::false_type, const F &f, const Args &... args) {
+  return response(async_handler([&f, args...](responder respond) {
+    offload_pool().post([&f, args..., respond] {
+      respond(f(args...));
+    });
+  }));
+}
+
+template <typename F, typename... Args>
+response offload_handler(std::true_type, const F &f, const Args &... args) {
+  return call_handler(f, args...);
+}
+
+template <typename F, typename... Args>
+response offload_handler_with_request(std::false_type, const F &f, const request &req, const Args &... args) {
+  return response(async_handler([&f, &req, args...](responder respond) {
+    offload_pool().post([&f, &req, args..., respond] {
+      respond(f(req, args...));
+    });
+  }));
+}
+
+template <typename F, typename... Args>
+response offload_handler_with_request(std::true_type, const F &f, const request &req, const Args &... args) {
+  return call_handler_with_request(f, req, args...);
+}
+
+} // namespace detail
+
 class BaseRule
 {
 public:
@@ -38,6 +81,8 @@ public:
   std::string rule_;
   std::string name_;
   unsigned int method_{(int)HTTPMethod::GET};
+  // The handler is a coroutine returning task<response>.
+  bool coroutine_ = false;
 };
 
 class Rule : public BaseRule
@@ -165,6 +210,15 @@ public:
     return *this;
   }
 
+  // Run the handler given next on the offload pool instead of the io
+  // thread, for CPU-heavy handlers that would hold up every other
+  // connection of the thread. The response is written by the io thread as
+  // for async handlers.
+  self_t& offload() {
+    offload_ = true;
+    return *this;
+  }
+
   template <typename Func>
   typename std::enable_if<util::CallChecker<Func, util::S<Args...>>::value, void>::type
   operator() (Func f) {
@@ -172,8 +226,15 @@ public:
                   "Handler types mismatch with URL args");
     static_assert(!std::is_same<void, decltype(f(std::declval<Args>()...))>::value,
                   "Handler function cannot have void return type");
+    coroutine_ = detail::is_task<decltype(f(std::declval<Args>()...))>::value;
+    if (offload_) {
+      handler_ = [f](Args ... args) {
+        return detail::offload_handler(detail::is_task<decltype(f(args...))>(), f, args...);
+      };
+      return;
+    }
     handler_ = [f](Args ... args) {
-      return response(f(args...));
+      return detail::call_handler(f, args...);
     };
   }
 
@@ -184,8 +245,67 @@ public:
                   "Handler types mismatch with URL args");
     static_assert(!std::is_same<void, decltype(f(std::declval<request>(), std::declval<Args>()...))>::value,
                   "Handler function cannot have void return type");
+    coroutine_ = detail::is_task<decltype(f(std::declval<request>(), std::declval<Args>()...))>::value;
+    if (offload_) {
+      handler_with_req_ = [f = std::move(f)](const request &req, Args ... args) {
+        return detail::offload_handler_with_request(detail::is_task<decltype(f(req, args...))>(), f, req, args...);
+      };
+      return;
+    }
     handler_with_req_ = [f = std::move(f)](const request &req, Args ... args) {
-      return response(f(req, args...));
+      return detail::call_handler_with_request(f, req, args...);
+    };
+  }
+
+  // Serve this route as a Server-Sent Events stream. f receives the stream
+  // followed by the URL args, and may keep the stream to push events later.
+  template <typename Func>
+  void sse(Func f) {
+    static_assert(util::CallChecker<Func, util::S<std::shared_ptr<event_stream>, Args...>>::value,
+                  "Handler types mismatch with URL args");
+    handler_ = [f](Args ... args) {
+      return response(event_stream_handler([f, args...](std::shared_ptr<event_stream> stream) {
+        f(std::move(stream), args...);
+      }));
+    };
+  }
+
+  // Accept WebSocket upgrades on this route. f receives the session followed
+  // by the URL args and registers its message and close callbacks on it.
+  template <typename Func>
+  void websocket(Func f) {
+    static_assert(util::CallChecker<Func, util::S<std::shared_ptr<websocket::session>, Args...>>::value,
+                  "Handler types mismatch with URL args");
+    handler_ = [f](Args ... args) {
+      return response(websocket_handler([f, args...](std::shared_ptr<websocket::session> session) {
+        f(std::move(session), args...);
+      }));
+    };
+  }
+
+  // Serve this route asynchronously. f receives a responder followed by the
+  // URL args, or the request, a responder and the URL args, and may return
+  // before it responds: the io thread serves other connections meanwhile.
+  // The request stays valid until the responder is called.
+  template <typename Func>
+  typename std::enable_if<util::CallChecker<Func, util::S<responder, Args...>>::value, void>::type
+  async(Func f) {
+    handler_ = [f](Args ... args) {
+      return response(async_handler([f, args...](responder respond) {
+        f(std::move(respond), args...);
+      }));
+    };
+  }
+
+  template <typename Func>
+  typename std::enable_if<!util::CallChecker<Func, util::S<responder, Args...>>::value, void>::type
+  async(Func f) {
+    static_assert(util::CallChecker<Func, util::S<request, responder, Args...>>::value,
+                  "Handler types mismatch with URL args");
+    handler_with_req_ = [f](const request &req, Args ... args) {
+      return response(async_handler([f, &req, args...](responder respond) {
+        f(req, std::move(respond), args...);
+      }));
     };
   }
 
@@ -202,7 +322,8 @@ public:
 
 private:
   std::function<response(Args...)> handler_;
-  std::function<response(request, Args...)> handler_with_req_;
+  std::function<response(const request&, Args...)> handler_with_req_;
+  bool offload_ = false;
 };
 
 class Trie
@@ -275,7 +396,7 @@ public:
     cur->rule_index = rule_index;
   }
 
-  int search(std::string key, util::routing_param &routing_params) {
+  int search(const std::string &key, util::routing_param &routing_params) {
     TrieNode *cur = root_;
     for (size_t i = 0; i < key.length(); /* */) {
       char c = key[i];
@@ -294,39 +415,29 @@ public:
         else --j;
         bool matched = false;
 
-        std::string arg_substr = key.substr(i, j - i + 1);
+        arena_string arg_substr(key.data() + i, j - i + 1, routing_params.string_params.get_allocator());
 
         // <float> pattern
-        if (cur->param_children[1]) {
-          try {
-            float_t value = std::stof(arg_substr);
-            routing_params.float_params.push_back(value);
-            i = j + 1;
-            cur = cur->param_children[1];
-            matched = true;
-          }
-          catch(std::exception const & e) {
-            // do nothing
-          }
+        float_t float_value;
+        if (cur->param_children[1] && parse_float(arg_substr.c_str(), float_value)) {
+          routing_params.float_params.push_back(float_value);
+          i = j + 1;
+          cur = cur->param_children[1];
+          matched = true;
         }
 
         // <int> pattern
-        if (cur->param_children[0]) {
-          try {
-            int64_t value = std::stoi(arg_substr);
-            routing_params.int_params.push_back(value);
-            i = j + 1;
-            cur = cur->param_children[0];
-            matched = true;
-          }
-          catch(std::exception const & e) {
-            // do nothing
-          }
+        int64_t int_value;
+        if (cur->param_children[0] && parse_int(arg_substr.c_str(), int_value)) {
+          routing_params.int_params.push_back(int_value);
+          i = j + 1;
+          cur = cur->param_children[0];
+          matched = true;
         }
 
         // <string> pattern
-        if (cur->param_children[2]) {
-          routing_params.string_params.push_back(arg_substr);
+        if (cur->param_children[2] && util::url_decode(arg_substr)) {
+          routing_params.string_params.push_back(std::move(arg_substr));
           cur = cur->param_children[2];
           i = j + 1;
           matched = true;
@@ -353,6 +464,25 @@ public:
   }
 
 private:
+  // Same acceptance as std::stof and std::stoi, without the exceptions (and
+  // the allocations that come with them) on every mismatch.
+  static bool parse_float(const char *s, float_t &value) {
+    char *end;
+    errno = 0;
+    value = std::strtof(s, &end);
+    return end != s && errno != ERANGE;
+  }
+
+  static bool parse_int(const char *s, int64_t &value) {
+    char *end;
+    errno = 0;
+    long v = std::strtol(s, &end, 10);
+    if (end == s || errno == ERANGE || v < INT_MIN || v > INT_MAX)
+      return false;
+    value = v;
+    return true;
+  }
+
   TrieNode *root_;
 };
 
@@ -381,21 +511,31 @@ public:
 
   response handle(const request &req)
   {
-    util::routing_param routing_params;
+    util::routing_param routing_params(req.arena);
     int rule_index = trie_.search(req.uri, routing_params);
 
-    if (rule_index == -1)
-      return response(response::not_found);
-
-    if (rules_[rule_index]->method_ != req.method_code)
-      return response(response::not_found);
+    if (rule_index == -1 || rules_[rule_index]->method_ != req.method_code)
+      return fallback_ ? fallback_(req) : response(response::not_found);
 
     return rules_[rule_index]->handle(req, routing_params);
   }
 
+  // Answers the requests no route matches, instead of 404.
+  void fallback(std::function<response(const request&)> f) {
+    fallback_ = std::move(f);
+  }
+
+  bool uses_coroutines() const {
+    for (auto &rule : rules_)
+      if (rule->coroutine_)
+        return true;
+    return false;
+  }
+
 private:
   std::vector<std::unique_ptr<BaseRule>> rules_;
   Trie trie_;
+  std::function<response(const request&)> fallback_;
 };
 
 }
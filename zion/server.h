@@ -6,64 +6,567 @@
 #define ZION_SERVER_H
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #include "connection.h"
+#include "connection_pool.h"
+#include "buffer_pool.h"
+#include "handoff.h"
 
 namespace zion {
 
-template <typename Handler>
-class Server {
+/// What drives the connections of a server: asio's reactor (epoll), or
+/// io_uring on Linux 6.0 and later. io_uring serves plain HTTP/1.1 only,
+/// without coroutine routes, whose timers and sockets need asio's reactor;
+/// servers fall back to asio where it is not available.
+enum class io_engine
+{
+  asio,
+  io_uring
+};
+
+/// Latency over CPU: for deployments with a core to spare per io thread.
+struct busy_poll_options
+{
+  // How long the io thread keeps polling for ready handlers after the last
+  // one ran, before blocking in epoll again. A thread that never sleeps is
+  // never woken, which saves the tens of microseconds a wakeup costs; the
+  // price is a core running at 100% for as long as requests keep coming,
+  // and for this long after. Zero blocks at once, as usual.
+  std::chrono::microseconds spin{0};
+  // Core the io thread is pinned to, or -1 to leave it to the scheduler.
+  // A spinning thread should have a core to itself.
+  int cpu = -1;
+  // SO_BUSY_POLL on accepted sockets: a read with nothing queued polls the
+  // device queue for up to this long instead of waiting for an interrupt.
+  // Raising it above net.core.busy_read needs CAP_NET_ADMIN; it is skipped
+  // when refused. Zero leaves sockets alone.
+  std::chrono::microseconds socket_poll{0};
+};
+
+struct server_config
+{
+  connection_timeouts timeouts;
+  // Connections served at once. At the limit the server stops accepting and
+  // further clients wait in the listen backlog until a connection closes.
+  std::size_t max_connections = 10000;
+  // Length of the kernel queue of connections not accepted yet.
+  int backlog = boost::asio::socket_base::max_listen_connections;
+  // On shutdown, how long requests in flight get to finish before the
+  // remaining connections are dropped.
+  std::chrono::milliseconds drain_timeout{std::chrono::seconds(30)};
+  // Unix socket path for hot restarts, off when empty. A server started
+  // with it takes the listening socket over from the one already serving
+  // there, which then drains; otherwise it binds as usual. Either way it
+  // then waits at the path to hand off to its own successor.
+  std::string handoff_path;
+  // What HTTP/2 clients are offered, or whether HTTP/2 is served at all.
+  http2::settings http2;
+  io_engine engine = io_engine::asio;
+  // Spinning and pinning of the io thread; spinning applies to the asio
+  // engine only.
+  busy_poll_options busy_poll;
+  tcp_options tcp;
+  // Io threads, each a shard with its own listening socket (SO_REUSEPORT),
+  // timer wheel and pools, sharing nothing with the others; the kernel
+  // spreads new connections across their sockets.
+  unsigned workers = 1;
+  // Cores for the workers, worker i pinned to cpus[i % cpus.size()]. A
+  // pinned worker allocates from its core's NUMA node, and its listener
+  // asks for the connections whose packets that core receives
+  // (SO_INCOMING_CPU). Empty leaves them to the scheduler.
+  std::vector<int> cpus;
+};
+
+namespace detail {
+
+// Pin the calling thread to cpu, if it is not -1. Returns false when the
+// kernel refuses, e.g. for a cpu outside the process's allowed set.
+inline bool pin_thread(int cpu) {
+  if (cpu < 0)
+    return true;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Place the calling thread's new memory on the NUMA node of the core it
+// runs on (MPOL_LOCAL), whatever the process policy. Without numaif.h, which
+// comes with libnuma.
+inline void prefer_local_memory() {
+  const int mpol_local = 4;
+  ::syscall(SYS_set_mempolicy, mpol_local, nullptr, 0);
+}
+
+// Options failing to apply (e.g. TCP_FASTOPEN turned off by sysctl) are not
+// fatal: the server works the same, only without them.
+inline void set_listener_options(int fd, const tcp_options &tcp) {
+  int one = 1;
+  if (tcp.no_delay)
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (tcp.defer_accept.count()) {
+    int seconds = static_cast<int>(tcp.defer_accept.count());
+    ::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+  }
+  if (tcp.fast_open_queue)
+    ::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &tcp.fast_open_queue, sizeof(tcp.fast_open_queue));
+  if (tcp.send_buffer)
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tcp.send_buffer, sizeof(tcp.send_buffer));
+  if (tcp.receive_buffer)
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tcp.receive_buffer, sizeof(tcp.receive_buffer));
+}
+
+// Options that accepted sockets do not inherit from the listener.
+inline void set_accepted_options(int fd, const server_config &config) {
+  if (config.tcp.quick_ack) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+  }
+  if (config.busy_poll.socket_poll.count()) {
+    int usec = static_cast<int>(config.busy_poll.socket_poll.count());
+    ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+  }
+}
+
+// Bind and listen at a TCP endpoint.
+inline void open_listener(boost::asio::ip::tcp::acceptor &acceptor, const boost::asio::ip::tcp::endpoint &endpoint,
+                          const server_config &config) {
+  // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  // IPv6 only, so that "::" and "0.0.0.0" can both be listened on.
+  if (endpoint.address().is_v6())
+    acceptor.set_option(boost::asio::ip::v6_only(true));
+  if (config.workers > 1) {
+    // One socket per worker on the same port; the kernel balances between
+    // them, preferring the socket of the core the packet arrived on.
+    int one = 1;
+    if (::setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+      throw boost::system::system_error(errno, boost::system::system_category(), "SO_REUSEPORT");
+    if (config.busy_poll.cpu >= 0)
+      ::setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_INCOMING_CPU, &config.busy_poll.cpu,
+                   sizeof(config.busy_poll.cpu));
+  }
+  set_listener_options(acceptor.native_handle(), config.tcp);
+  acceptor.bind(endpoint);
+  acceptor.listen(config.backlog);
+}
+
+// Bind and listen at a Unix socket path. A socket file left behind by a
+// server that is gone is removed first; one that a server still accepts on
+// fails the bind, as a port in use does.
+inline void open_listener(boost::asio::local::stream_protocol::acceptor &acceptor,
+                          const boost::asio::local::stream_protocol::endpoint &endpoint, const server_config &config) {
+  boost::asio::local::stream_protocol::socket probe(acceptor.get_executor());
+  boost::system::error_code ec;
+  probe.connect(endpoint, ec);
+  if (ec == boost::asio::error::connection_refused)
+    ::unlink(endpoint.path().c_str());
+  acceptor.open(endpoint.protocol());
+  acceptor.bind(endpoint);
+  acceptor.listen(config.backlog);
+}
+
+inline boost::asio::ip::tcp::endpoint resolve(const std::string &address, const std::string &port) {
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::resolver resolver(io_service);
+  return *resolver.resolve({address, port});
+}
+
+// Waits at a Unix socket path for a new server to take the listening
+// sockets, then calls on_handed_off. The path is removed on destruction
+// unless it was handed off with the sockets.
+class handoff_point
+{
 public:
-  Server(const std::string &address, const std::string &port, const std::string &doc_root, Handler *handler)
-      : io_service_(),
-        acceptor_(io_service_),
-        socket_(io_service_),
-        handler_(handler)
+  explicit handoff_point(boost::asio::io_service &io_service)
+      : io_service_(io_service),
+        acceptor_(io_service)
   {
+  }
+
+  handoff_point(const handoff_point&) = delete;
+  handoff_point& operator=(const handoff_point&) = delete;
+
+  ~handoff_point() {
+    if (!path_.empty() && !handed_off_)
+      ::unlink(path_.c_str());
+  }
 
-    // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
-    boost::asio::ip::tcp::resolver resolver(io_service_);
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({address, port});
+  void listen(const std::string &path, std::vector<int> listeners, std::function<void()> on_handed_off) {
+    path_ = path;
+    listeners_ = std::move(listeners);
+    on_handed_off_ = std::move(on_handed_off);
+    ::unlink(path_.c_str());
+    boost::asio::local::stream_protocol::endpoint endpoint(path_);
     acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
     acceptor_.bind(endpoint);
     acceptor_.listen();
-
     do_accept();
   }
 
-  void run() {
-    io_service_.run();
+  void close() {
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
   }
 
+  bool handed_off() const { return handed_off_; }
+
 private:
   void do_accept() {
-    acceptor_.async_accept(socket_,
-                           [this](boost::system::error_code ec)
-                           {
-                             // Check whether the server was stopped by a signal before this
-                             // completion handler had a chance to run.
-                             if (!acceptor_.is_open())
-                             {
-                               return;
-                             }
-
-                             if (!ec)
-                             {
-                               // start read from socket
-                               auto conn = std::make_shared<connection<Handler>>(std::move(socket_), handler_);
-                               conn->start();
-                             }
-
-                             do_accept();
-                           });
+    auto peer = std::make_shared<boost::asio::local::stream_protocol::socket>(io_service_);
+    acceptor_.async_accept(*peer, [this, peer](boost::system::error_code ec)
+    {
+      if (ec)
+        return;
+      if (!handoff::send_fds(peer->native_handle(), listeners_)) {
+        do_accept();
+        return;
+      }
+      // Keep accepting until the new server confirms it holds the socket.
+      auto ack = std::make_shared<char>();
+      boost::asio::async_read(*peer, boost::asio::buffer(ack.get(), 1),
+                              [this, peer, ack](boost::system::error_code ec, std::size_t)
+                              {
+                                if (ec) {
+                                  do_accept();
+                                  return;
+                                }
+                                // The path now belongs to the new server.
+                                handed_off_ = true;
+                                on_handed_off_();
+                              });
+    });
+  }
+
+  boost::asio::io_service &io_service_;
+  boost::asio::local::stream_protocol::acceptor acceptor_;
+  std::string path_;
+  std::vector<int> listeners_;
+  std::function<void()> on_handed_off_;
+  bool handed_off_ = false;
+};
+
+} // namespace detail
+
+/// One io thread: an io_service with its timer wheel and receive buffers,
+/// serving the connections of every socket it listens on. Listeners are
+/// added with listen() before run(); each has its own adaptor (plain TCP,
+/// Unix domain or TLS) and pool of recycled connections.
+template <typename Handler>
+class Server {
+public:
+  Server(Handler *handler, const server_config &config = server_config(), access_log *log = nullptr)
+      : io_service_(),
+        handoff_(io_service_),
+        signals_(io_service_, SIGINT, SIGTERM),
+        drain_timer_(io_service_),
+        wheel_(io_service_),
+        config_(config),
+        handler_(handler),
+        log_(log)
+  {
+    signals_.async_wait([this](boost::system::error_code ec, int)
+                        {
+                          if (!ec)
+                            shutdown();
+                        });
+
+    // Sockets handed over by the server being replaced, in the order it
+    // listened on them, which is the order listen() is called in here.
+    if (!config_.handoff_path.empty())
+      inherited_ = handoff::take_listeners(config_.handoff_path);
+  }
+
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+
+  ~Server() {
+    for (int fd : inherited_)
+      ::close(fd);
+    if (!handoff_.handed_off()) {
+      for (auto &l : listeners_) {
+        if (!l->path.empty())
+          ::unlink(l->path.c_str());
+      }
+    }
+  }
+
+  /// Accept connections at endpoint, over Adaptor: tcp_adaptor or
+  /// unix_adaptor, or with TLS ssl_adaptor or ktls_adaptor and their
+  /// context. max_connections, if not 0, caps the connections of this
+  /// listener within the server's own limit. With fd, accept on that
+  /// socket, already listening at endpoint (another worker's Unix socket),
+  /// of which the server takes ownership. Returns the listening socket.
+  template <typename Adaptor>
+  int listen(const typename Adaptor::socket_type::endpoint_type &endpoint,
+             typename Adaptor::context *adaptor_ctx = nullptr, std::size_t max_connections = 0, int fd = -1) {
+    std::unique_ptr<listener<Adaptor>> l;
+    try {
+      l.reset(new listener<Adaptor>(*this, adaptor_ctx, max_connections));
+      // The path goes with the socket; whoever owns it removes it at exit.
+      if (fd < 0)
+        l->path = unix_path(endpoint);
+      if (!inherited_.empty()) {
+        // Already bound and listening, with the old server's backlog in it.
+        if (fd >= 0)
+          ::close(fd);
+        fd = inherited_.front();
+        inherited_.erase(inherited_.begin());
+      }
+      if (fd >= 0)
+        l->acceptor.assign(endpoint.protocol(), fd);
+    }
+    catch (...) {
+      // Until the acceptor holds it, the socket is still ours to close.
+      if (fd >= 0)
+        ::close(fd);
+      throw;
+    }
+    if (fd < 0)
+      detail::open_listener(l->acceptor, endpoint, config_);
+    l->do_accept();
+    listeners_.push_back(std::move(l));
+    return listeners_.back()->native_handle();
+  }
+
+  // Serve until shutdown() has drained every connection, or its deadline
+  // has passed.
+  void run() {
+    if (!config_.handoff_path.empty()) {
+      std::vector<int> fds;
+      for (auto &l : listeners_)
+        fds.push_back(l->native_handle());
+      handoff_.listen(config_.handoff_path, fds, [this] { shutdown(); });
+    }
+    detail::pin_thread(config_.busy_poll.cpu);
+    if (config_.busy_poll.spin.count() == 0) {
+      io_service_.run();
+      return;
+    }
+    // Poll without blocking while handlers keep turning up, and block once
+    // nothing has been ready for the whole spin budget.
+    typedef std::chrono::steady_clock clock;
+    while (!io_service_.stopped()) {
+      auto idle_since = clock::now();
+      while (clock::now() - idle_since < config_.busy_poll.spin) {
+        if (io_service_.poll())
+          idle_since = clock::now();
+        if (io_service_.stopped())
+          return;
+      }
+      io_service_.run_one();
+    }
+  }
+
+  // Stop accepting and let the open connections finish: requests in flight
+  // get their response, idle keep-alive connections are closed. run()
+  // returns once none are left, or after the drain timeout. Also triggered
+  // by SIGINT and SIGTERM. Safe to call from any thread.
+  void shutdown() {
+    boost::asio::dispatch(io_service_, [this]
+    {
+      if (draining_)
+        return;
+      draining_ = true;
+      boost::system::error_code ignored;
+      signals_.cancel(ignored);
+      for (auto &l : listeners_)
+        l->close();
+      handoff_.close();
+
+      if (active() == 0) {
+        io_service_.stop();
+        return;
+      }
+      for (auto &l : listeners_)
+        l->drain();
+      drain_timer_.expires_from_now(config_.drain_timeout);
+      drain_timer_.async_wait([this](boost::system::error_code ec)
+                              {
+                                if (!ec)
+                                  io_service_.stop();
+                              });
+    });
+  }
+
+private:
+  struct listener_base
+  {
+    virtual ~listener_base() = default;
+    virtual int native_handle() = 0;
+    virtual std::size_t active() const = 0;
+    virtual void resume() = 0;
+    virtual void close() = 0;
+    virtual void drain() = 0;
+    // Unix socket path bound here, removed when the server goes away.
+    std::string path;
+  };
+
+  template <typename Adaptor>
+  struct listener : listener_base
+  {
+    typedef connection<Handler, Adaptor> connection_t;
+    typedef typename Adaptor::socket_type socket_type;
+    typedef typename socket_type::protocol_type protocol_type;
+
+    listener(Server &server, typename Adaptor::context *adaptor_ctx, std::size_t max_connections)
+        : server(server),
+          acceptor(server.io_service_),
+          socket(server.io_service_),
+          accept_retry(server.io_service_),
+          max_connections(max_connections),
+          adaptor_ctx(adaptor_ctx)
+    {
+      pool->on_release([&server] { server.on_release(); });
+    }
+
+    int native_handle() override { return acceptor.native_handle(); }
+
+    std::size_t active() const override { return pool->active(); }
+
+    void resume() override {
+      if (paused) {
+        paused = false;
+        do_accept();
+      }
+    }
+
+    void close() override {
+      boost::system::error_code ignored;
+      acceptor.close(ignored);
+      accept_retry.cancel(ignored);
+    }
+
+    void drain() override {
+      pool->for_each_active([](connection_t *conn) { conn->drain(); });
+    }
+
+    void do_accept() {
+      if (server.active() >= server.config_.max_connections ||
+          (max_connections && pool->active() >= max_connections)) {
+        // Leave further clients in the listen backlog until a connection
+        // closes, rather than taking on more than can be served.
+        paused = true;
+        return;
+      }
+      acceptor.async_accept(socket,
+                            [this](boost::system::error_code ec)
+                            {
+                              // Check whether the server was stopped by a signal before this
+                              // completion handler had a chance to run.
+                              if (!acceptor.is_open())
+                              {
+                                return;
+                              }
+
+                              if (!ec)
+                              {
+                                set_accepted_options();
+                                // start read from socket, on a recycled connection when one is idle
+                                auto conn = pool->acquire(std::move(socket), [this](socket_type socket)
+                                {
+                                  return new connection_t(std::move(socket), server.handler_, server.wheel_,
+                                                          server.config_.timeouts, server.config_.http2,
+                                                          server.config_.tcp, server.buffers_, adaptor_ctx,
+                                                          server.log_);
+                                });
+                                conn->start();
+                              }
+                              else if (ec == boost::asio::error::no_descriptors ||
+                                       ec == boost::system::errc::too_many_files_open_in_system ||
+                                       ec == boost::asio::error::no_buffer_space ||
+                                       ec == boost::asio::error::no_memory)
+                              {
+                                // Out of descriptors or memory: retrying at once would fail
+                                // the same way in a busy loop, so give connections time to close.
+                                accept_retry.expires_from_now(std::chrono::milliseconds(100));
+                                accept_retry.async_wait([this](boost::system::error_code ec)
+                                                        {
+                                                          if (!ec)
+                                                            do_accept();
+                                                        });
+                                return;
+                              }
+
+                              do_accept();
+                            });
+    }
+
+    void set_accepted_options() {
+      if (std::is_same<protocol_type, boost::asio::ip::tcp>::value)
+        detail::set_accepted_options(socket.native_handle(), server.config_);
+    }
+
+    Server &server;
+    typename protocol_type::acceptor acceptor;
+    socket_type socket;
+    boost::asio::steady_timer accept_retry;
+    // This listener's own limit, 0 for none.
+    std::size_t max_connections;
+    // Set while accepting is held back by either limit.
+    bool paused = false;
+    // Shared TLS state, or nothing for plain sockets.
+    typename Adaptor::context *adaptor_ctx;
+    // Recycled connections of this listener. Destroyed before io_service_,
+    // so idle sockets are freed while their service is still alive.
+    std::shared_ptr<connection_pool<connection_t>> pool = std::make_shared<connection_pool<connection_t>>();
+  };
+
+  static std::string unix_path(const boost::asio::ip::tcp::endpoint &) { return std::string(); }
+  static std::string unix_path(const boost::asio::local::stream_protocol::endpoint &endpoint) {
+    return endpoint.path();
+  }
+
+  std::size_t active() const {
+    std::size_t n = 0;
+    for (auto &l : listeners_)
+      n += l->active();
+    return n;
+  }
+
+  void on_release() {
+    if (draining_) {
+      if (active() == 0)
+        io_service_.stop();
+      return;
+    }
+    // A listener still at its own limit pauses again at once.
+    if (active() < config_.max_connections) {
+      for (auto &l : listeners_)
+        l->resume();
+    }
   }
 
   boost::asio::io_service io_service_;
-  boost::asio::ip::tcp::acceptor acceptor_;
-  boost::asio::ip::tcp::socket socket_;
+
+  detail::handoff_point handoff_;
+  std::vector<int> inherited_;
+
+  boost::asio::signal_set signals_;
+  boost::asio::steady_timer drain_timer_;
+  bool draining_ = false;
+
+  // Deadlines of every connection served by io_service_.
+  timer_wheel wheel_;
+  server_config config_;
 
   Handler *handler_;
+  access_log *log_;
+
+  // Receive buffers lent to connections of this io thread while they read.
+  std::shared_ptr<buffer_pool> buffers_ = std::make_shared<buffer_pool>();
+
+  std::vector<std::unique_ptr<listener_base>> listeners_;
 };
 
 } // namespace zion
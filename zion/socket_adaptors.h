@@ -0,0 +1,563 @@
+//
+// Created by Shihao Jing on 8/26/17.
+//
+
+#ifndef ZION_SOCKET_ADAPTORS_H
+#define ZION_SOCKET_ADAPTORS_H
+
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#ifdef ZION_ENABLE_SSL
+#include <boost/asio/ssl.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+namespace zion {
+
+/// Adaptors give connection one interface over plain sockets and TLS. Reading is
+/// split in two so a connection can wait for input without holding a receive
+/// buffer: async_wait_readable() completes once read_some() has something to
+/// return, read_some() then fills the buffer.
+///
+/// An adaptor provides:
+///   context                     shared configuration, one per listener
+///   socket_type                 the socket accepted: TCP or Unix domain
+///   stream_type& stream()       what responses are written to
+///   socket_type& raw_socket()   the underlying socket
+///   reset(socket)               rebind a pooled adaptor to a new client
+///   start(h)                    h(ec) once the stream is usable
+///   async_wait_readable(h)      h(ec) once there is something to read
+///   read_some(buffer, h)        h(ec, n) with n bytes read, 0 if none yet
+///   async_send_file(fd, offset, count, h)
+///                               h(ec, n) once n > 0 of count bytes of the
+///                               file at offset are written
+///   close()
+///   alpn_protocol()             protocol chosen by ALPN, empty if none was
+///   gathers_writes              whether a gathered write goes out as one
+///   encrypted                   whether the stream is TLS
+
+namespace detail {
+
+// sendfile(2) on a non-blocking socket, waiting for room in the send buffer
+// as often as needed until something is sent.
+template <typename Socket, typename Handler>
+struct sendfile_op
+{
+  Socket &socket;
+  int fd;
+  off_t offset;
+  std::size_t count;
+  Handler handler;
+
+  void operator()(boost::system::error_code ec = boost::system::error_code()) {
+    ssize_t n = -1;
+    while (!ec) {
+      off_t off = offset;
+      n = ::sendfile(socket.native_handle(), fd, &off, count);
+      if (n > 0)
+        break;
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno == EAGAIN) {
+        socket.async_wait(Socket::wait_write, std::move(*this));
+        return;
+      }
+      // Nothing sent and no error: the file is shorter than promised.
+      ec = n == 0 ? boost::asio::error::eof : boost::system::error_code(errno, boost::system::system_category());
+    }
+    handler(ec, ec ? 0 : static_cast<std::size_t>(n));
+  }
+};
+
+// What sendfile becomes on a stream that encrypts in user space: read a
+// piece of the file and write it to the stream.
+template <typename Stream, typename Handler>
+struct file_copy_op
+{
+  static const std::size_t piece = 64 * 1024;
+
+  Stream &stream;
+  std::unique_ptr<char[]> buffer;
+  Handler handler;
+
+  void start(int fd, off_t offset, std::size_t count) {
+    ssize_t n;
+    do {
+      n = ::pread(fd, buffer.get(), count < piece ? count : piece, offset);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      handler(n == 0 ? boost::asio::error::eof : boost::system::error_code(errno, boost::system::system_category()), 0);
+      return;
+    }
+    auto data = boost::asio::buffer(buffer.get(), static_cast<std::size_t>(n));
+    boost::asio::async_write(stream, data, std::move(*this));
+  }
+
+  void operator()(boost::system::error_code ec, std::size_t n) {
+    handler(ec, n);
+  }
+};
+
+template <typename Stream, typename Handler>
+void async_copy_file(Stream &stream, int fd, off_t offset, std::size_t count, Handler h) {
+  std::unique_ptr<char[]> buffer(new char[file_copy_op<Stream, Handler>::piece]);
+  file_copy_op<Stream, Handler>{stream, std::move(buffer), std::move(h)}.start(fd, offset, count);
+}
+
+} // namespace detail
+
+/// Plain, unencrypted sockets of Protocol: TCP, or Unix domain stream
+/// sockets for clients on the same host.
+template <typename Protocol>
+class plain_adaptor
+{
+public:
+  using socket_type = typename Protocol::socket;
+  using stream_type = socket_type;
+  struct context {};
+  static const bool gathers_writes = true;
+  static const bool encrypted = false;
+
+  plain_adaptor(socket_type socket, context *)
+      : socket_(std::move(socket))
+  {
+  }
+
+  stream_type& stream() { return socket_; }
+  socket_type& raw_socket() { return socket_; }
+
+  void reset(socket_type socket) {
+    socket_ = std::move(socket);
+  }
+
+  template <typename Handler>
+  void start(Handler h) {
+    h(boost::system::error_code());
+  }
+
+  template <typename Handler>
+  void async_wait_readable(Handler h) {
+    socket_.async_wait(socket_type::wait_read, std::move(h));
+  }
+
+  // The socket is non-blocking, so this returns at once; a spurious wakeup
+  // reads nothing.
+  template <typename Handler>
+  void read_some(boost::asio::mutable_buffer buffer, Handler h) {
+    boost::system::error_code ec;
+    std::size_t n = socket_.read_some(buffer, ec);
+    if (ec == boost::asio::error::would_block)
+      ec = boost::system::error_code();
+    h(ec, n);
+  }
+
+  template <typename Handler>
+  void async_send_file(int fd, off_t offset, std::size_t count, Handler h) {
+    detail::sendfile_op<socket_type, Handler>{socket_, fd, offset, count, std::move(h)}();
+  }
+
+  void close() {
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+  }
+
+  std::string alpn_protocol() { return std::string(); }
+
+private:
+  socket_type socket_;
+};
+
+using tcp_adaptor = plain_adaptor<boost::asio::ip::tcp>;
+using unix_adaptor = plain_adaptor<boost::asio::local::stream_protocol>;
+
+#ifdef ZION_ENABLE_SSL
+
+/// TLS settings of a server.
+struct ssl_options
+{
+  std::string certificate_chain_file;   // PEM, leaf first
+  std::string private_key_file;         // PEM
+  // Resumption: stateless tickets, and a server-side session cache for
+  // clients that do not use them.
+  bool session_tickets = true;
+  long session_cache_size = 20480;
+  long session_timeout_seconds = 300;
+  // ALPN protocols offered, most preferred first.
+  // "h2" is dropped when HTTP/2 is turned off.
+  std::vector<std::string> alpn{"h2", "http/1.1"};
+  // Hand the session keys to the kernel after the handshake (kTLS), so
+  // records are encrypted in the kernel and file bodies go out with
+  // sendfile. Without kernel support connections silently stay in user
+  // space.
+  bool kernel_tls = false;
+};
+
+namespace detail {
+
+// Pick the first of our protocols that the client offered. Both lists are in
+// ALPN wire format: length-prefixed names.
+inline bool select_alpn(const std::string &ours, const unsigned char *theirs, unsigned int theirs_len,
+                        const unsigned char **out, unsigned char *out_len) {
+  for (std::size_t i = 0; i < ours.size(); i += 1 + static_cast<unsigned char>(ours[i])) {
+    unsigned char len = static_cast<unsigned char>(ours[i]);
+    for (unsigned int j = 0; j < theirs_len; j += 1 + theirs[j]) {
+      if (theirs[j] == len && j + 1 + len <= theirs_len &&
+          std::memcmp(theirs + j + 1, ours.data() + i + 1, len) == 0) {
+        *out = theirs + j + 1;
+        *out_len = len;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+} // namespace detail
+
+/// Server context holding the certificate and the resumption state shared
+/// by all TLS connections.
+class ssl_context : public boost::asio::ssl::context
+{
+public:
+  explicit ssl_context(const ssl_options &options)
+      : boost::asio::ssl::context(boost::asio::ssl::context::tls_server)
+  {
+    set_options(boost::asio::ssl::context::default_workarounds |
+                boost::asio::ssl::context::no_sslv2 |
+                boost::asio::ssl::context::no_sslv3 |
+                boost::asio::ssl::context::no_tlsv1 |
+                boost::asio::ssl::context::no_tlsv1_1 |
+                boost::asio::ssl::context::single_dh_use);
+    use_certificate_chain_file(options.certificate_chain_file);
+    use_private_key_file(options.private_key_file, boost::asio::ssl::context::pem);
+
+    SSL_CTX *ctx = native_handle();
+    static const unsigned char session_id_context[] = "zion";
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, options.session_cache_size);
+    SSL_CTX_set_timeout(ctx, options.session_timeout_seconds);
+    if (!options.session_tickets)
+      SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    // Read ahead fills the record buffer a socket read at a time rather
+    // than a record header and body at a time; the kernel path receives
+    // through OpenSSL as before.
+    if (options.kernel_tls)
+      SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    else
+      SSL_CTX_set_read_ahead(ctx, 1);
+
+    for (const auto &protocol : options.alpn) {
+      alpn_.push_back(static_cast<char>(protocol.size()));
+      alpn_ += protocol;
+    }
+    if (!alpn_.empty())
+      SSL_CTX_set_alpn_select_cb(ctx, &ssl_context::on_alpn, this);
+  }
+
+private:
+  static int on_alpn(SSL *, const unsigned char **out, unsigned char *out_len,
+                     const unsigned char *in, unsigned int in_len, void *arg) {
+    auto *self = static_cast<ssl_context*>(arg);
+    return detail::select_alpn(self->alpn_, in, in_len, out, out_len) ? SSL_TLSEXT_ERR_OK
+                                                                      : SSL_TLSEXT_ERR_NOACK;
+  }
+
+  std::string alpn_;   // wire format
+};
+
+namespace detail {
+
+// One OpenSSL call on a non-blocking socket, repeated each time the socket
+// becomes ready in the direction OpenSSL asked for. operation(ssl, n)
+// returns what the SSL_* call returned and sets n to the bytes moved.
+template <typename Operation, typename Handler>
+struct ssl_io_op
+{
+  boost::asio::ip::tcp::socket &socket;
+  SSL *ssl;
+  Operation operation;
+  Handler handler;
+  bool waited = false;
+
+  void operator()(boost::system::error_code ec = boost::system::error_code()) {
+    std::size_t n = 0;
+    if (!ec) {
+      ERR_clear_error();
+      int ret = operation(ssl, n);
+      if (ret <= 0) {
+        switch (SSL_get_error(ssl, ret)) {
+          case SSL_ERROR_WANT_READ:
+            waited = true;
+            socket.async_wait(boost::asio::ip::tcp::socket::wait_read, std::move(*this));
+            return;
+          case SSL_ERROR_WANT_WRITE:
+            waited = true;
+            socket.async_wait(boost::asio::ip::tcp::socket::wait_write, std::move(*this));
+            return;
+          case SSL_ERROR_ZERO_RETURN:
+            ec = boost::asio::error::eof;
+            break;
+          case SSL_ERROR_SYSCALL:
+            ec = errno ? boost::system::error_code(errno, boost::system::system_category())
+                       : boost::system::error_code(boost::asio::error::eof);
+            break;
+          default:
+            ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+            break;
+        }
+      }
+    }
+    // Never complete inside the initiating call: a caller that starts the
+    // next write from its handler would otherwise recurse.
+    if (waited) {
+      handler(ec, n);
+      return;
+    }
+    boost::asio::post(socket.get_executor(), [h = std::move(handler), ec, n]() mutable
+    {
+      h(ec, n);
+    });
+  }
+};
+
+template <typename Operation, typename Handler>
+void async_ssl_io(boost::asio::ip::tcp::socket &socket, SSL *ssl, Operation operation, Handler h) {
+  ssl_io_op<Operation, Handler>{socket, ssl, std::move(operation), std::move(h)}();
+}
+
+template <typename BufferSequence>
+auto first_buffer(const BufferSequence &buffers) -> decltype(*boost::asio::buffer_sequence_begin(buffers)) {
+  auto it = boost::asio::buffer_sequence_begin(buffers);
+  auto end = boost::asio::buffer_sequence_end(buffers);
+  auto first = it;
+  for (; it != end; ++it) {
+    if (it->size() > 0)
+      return *it;
+  }
+  return *first;
+}
+
+} // namespace detail
+
+
+/// A TLS stream in which OpenSSL reads and writes the socket itself, instead
+/// of going through memory BIOs as boost::asio::ssl::stream does. That lets
+/// OpenSSL install the session keys in the kernel (kTLS) once the handshake
+/// is done, after which SSL_write and SSL_sendfile hand plaintext to the
+/// kernel to encrypt, and lets one SSL object, with its record buffers, serve
+/// connection after connection. Meets asio's stream requirements, so
+/// responses and websocket sessions use it like any other stream.
+class openssl_stream
+{
+public:
+  using executor_type = boost::asio::ip::tcp::socket::executor_type;
+  using lowest_layer_type = boost::asio::ip::tcp::socket;
+
+  openssl_stream(boost::asio::ip::tcp::socket socket, SSL_CTX *ctx)
+      : socket_(std::move(socket)),
+        ssl_(nullptr)
+  {
+    attach(ctx);
+  }
+
+  openssl_stream(openssl_stream &&other)
+      : socket_(std::move(other.socket_)),
+        ssl_(other.ssl_)
+  {
+    other.ssl_ = nullptr;
+  }
+
+  openssl_stream(const openssl_stream&) = delete;
+  openssl_stream& operator=(const openssl_stream&) = delete;
+
+  ~openssl_stream() {
+    if (ssl_)
+      SSL_free(ssl_);
+  }
+
+  /// Rebind to a new connection. SSL_clear forgets the last peer's session
+  /// and keys but keeps the SSL object and its read buffer; a stream that
+  /// was moved from gets a new SSL object.
+  void reset(boost::asio::ip::tcp::socket socket, SSL_CTX *ctx) {
+    socket_ = std::move(socket);
+    if (ssl_) {
+      SSL_set_session(ssl_, nullptr);
+      if (!SSL_clear(ssl_)) {
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+      }
+    }
+    attach(ctx);
+  }
+
+  executor_type get_executor() { return socket_.get_executor(); }
+  lowest_layer_type& lowest_layer() { return socket_; }
+  lowest_layer_type& next_layer() { return socket_; }
+  SSL* native_handle() { return ssl_; }
+
+  /// Whether the kernel encrypts what is sent, which is when sendfile works.
+  bool kernel_send() { return BIO_get_ktls_send(SSL_get_wbio(ssl_)) != 0; }
+
+  // Handlers are taken by reference, as asio's own streams do: a composed
+  // operation passes itself, moved, alongside buffers that refer into it.
+  template <typename Handler>
+  void async_handshake(Handler &&h) {
+    detail::async_ssl_io(socket_, ssl_, [](SSL *ssl, std::size_t&) { return SSL_do_handshake(ssl); },
+                         [h = std::forward<Handler>(h)](boost::system::error_code ec, std::size_t) mutable
+                         {
+                           h(ec);
+                         });
+  }
+
+  template <typename MutableBufferSequence, typename Handler>
+  void async_read_some(const MutableBufferSequence &buffers, Handler &&h) {
+    boost::asio::mutable_buffer b = detail::first_buffer(buffers);
+    detail::async_ssl_io(socket_, ssl_, [b](SSL *ssl, std::size_t &n)
+    {
+      return SSL_read_ex(ssl, b.data(), b.size(), &n);
+    }, std::forward<Handler>(h));
+  }
+
+  template <typename ConstBufferSequence, typename Handler>
+  void async_write_some(const ConstBufferSequence &buffers, Handler &&h) {
+    boost::asio::const_buffer b = detail::first_buffer(buffers);
+    detail::async_ssl_io(socket_, ssl_, [b](SSL *ssl, std::size_t &n)
+    {
+      return SSL_write_ex(ssl, b.data(), b.size(), &n);
+    }, std::forward<Handler>(h));
+  }
+
+  template <typename Handler>
+  void async_sendfile(int fd, off_t offset, std::size_t count, Handler &&h) {
+    detail::async_ssl_io(socket_, ssl_, [fd, offset, count](SSL *ssl, std::size_t &n)
+    {
+      ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, count, 0);
+      if (sent > 0)
+        n = static_cast<std::size_t>(sent);
+      return sent > 0 ? 1 : static_cast<int>(sent);
+    }, std::forward<Handler>(h));
+  }
+
+private:
+  void attach(SSL_CTX *ctx) {
+    if (!ssl_ && !(ssl_ = SSL_new(ctx)))
+      throw std::bad_alloc();
+    SSL_set_fd(ssl_, static_cast<int>(socket_.native_handle()));
+    SSL_set_accept_state(ssl_);
+  }
+
+  boost::asio::ip::tcp::socket socket_;
+  SSL *ssl_;
+};
+
+/// TLS over TCP, encrypted in user space.
+class ssl_adaptor
+{
+public:
+  using socket_type = boost::asio::ip::tcp::socket;
+  using stream_type = openssl_stream;
+  using context = ssl_context;
+  // Each buffer becomes its own record and socket write.
+  static const bool gathers_writes = false;
+  static const bool encrypted = true;
+
+  ssl_adaptor(boost::asio::ip::tcp::socket socket, context *ctx)
+      : ctx_(ctx),
+        stream_(std::move(socket), ctx->native_handle())
+  {
+  }
+
+  stream_type& stream() { return stream_; }
+  boost::asio::ip::tcp::socket& raw_socket() { return stream_.next_layer(); }
+
+  // A pooled connection keeps its SSL object for the next client.
+  void reset(boost::asio::ip::tcp::socket socket) {
+    stream_.reset(std::move(socket), ctx_->native_handle());
+  }
+
+  // The handshake, session tickets and records are separate small writes
+  // that Nagle would hold back for the peer's delayed ack.
+  template <typename Handler>
+  void start(Handler h) {
+    boost::system::error_code ignored;
+    raw_socket().set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+    stream_.async_handshake(std::move(h));
+  }
+
+  // Data OpenSSL already holds, decrypted or read ahead, does not make the
+  // socket readable: a pipelined request may be waiting there.
+  template <typename Handler>
+  void async_wait_readable(Handler h) {
+    if (SSL_has_pending(stream_.native_handle())) {
+      boost::asio::post(raw_socket().get_executor(), [h]() mutable
+      {
+        h(boost::system::error_code());
+      });
+      return;
+    }
+    raw_socket().async_wait(boost::asio::ip::tcp::socket::wait_read, std::move(h));
+  }
+
+  // May wait for the rest of a record that arrived in pieces.
+  template <typename Handler>
+  void read_some(boost::asio::mutable_buffer buffer, Handler h) {
+    stream_.async_read_some(buffer, std::move(h));
+  }
+
+  // The stream encrypts in user space, so the file is copied through it.
+  template <typename Handler>
+  void async_send_file(int fd, off_t offset, std::size_t count, Handler h) {
+    detail::async_copy_file(stream_, fd, offset, count, std::move(h));
+  }
+
+  void close() {
+    boost::system::error_code ignored;
+    raw_socket().close(ignored);
+  }
+
+  /// Protocol chosen by ALPN, empty if none was.
+  std::string alpn_protocol() {
+    const unsigned char *data;
+    unsigned int len;
+    SSL_get0_alpn_selected(stream_.native_handle(), &data, &len);
+    if (!data)
+      return std::string();
+    return std::string(reinterpret_cast<const char*>(data), len);
+  }
+
+protected:
+  context *ctx_;
+  stream_type stream_;
+};
+
+/// TLS with kernel offload, for ssl_options::kernel_tls.
+class ktls_adaptor : public ssl_adaptor
+{
+public:
+  using ssl_adaptor::ssl_adaptor;
+
+  // Zero-copy once the kernel holds the keys; copied through OpenSSL when
+  // the kernel or the negotiated cipher does not support kTLS.
+  template <typename Handler>
+  void async_send_file(int fd, off_t offset, std::size_t count, Handler h) {
+    if (stream_.kernel_send())
+      stream_.async_sendfile(fd, offset, count, std::move(h));
+    else
+      detail::async_copy_file(stream_, fd, offset, count, std::move(h));
+  }
+};
+
+#endif // ZION_ENABLE_SSL
+
+} // namespace zion
+
+#endif //ZION_SOCKET_ADAPTORS_H
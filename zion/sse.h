@@ -0,0 +1,105 @@
+//
+// Created by Shihao Jing on 8/2/17.
+//
+
+#ifndef ZION_SSE_H
+#define ZION_SSE_H
+
+#include <mutex>
+#include <string>
+
+namespace zion {
+
+/// Handle for pushing Server-Sent Events to one client. push() may be called
+/// from any thread. Events pushed before the connection gets around to
+/// flushing are coalesced and go out in a single write from its io thread.
+class event_stream
+{
+public:
+  event_stream() = default;
+  event_stream(const event_stream&) = delete;
+  event_stream& operator=(const event_stream&) = delete;
+
+  virtual ~event_stream() = default;
+
+  /// Queue an event for the client. Multi-line data is split into several
+  /// "data:" fields. Returns false once the stream has been closed.
+  bool push(const std::string &data, const std::string &event = std::string(),
+            const std::string &id = std::string()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_)
+      return false;
+
+    if (!event.empty())
+      pending_.append("event: ").append(event).append("\n");
+    if (!id.empty())
+      pending_.append("id: ").append(id).append("\n");
+    std::string::size_type begin = 0;
+    for (;;) {
+      std::string::size_type end = data.find('\n', begin);
+      pending_.append("data: ").append(data, begin, end - begin).append("\n");
+      if (end == std::string::npos)
+        break;
+      begin = end + 1;
+    }
+    pending_.append("\n");
+
+    request_flush();
+    return true;
+  }
+
+  /// Whether the client is still connected and the stream accepts events.
+  bool is_open() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !closed_;
+  }
+
+  /// Close the stream from the application side. The connection is closed
+  /// once the events already queued have been written.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_)
+      return;
+    closed_ = true;
+    request_flush();
+  }
+
+protected:
+  /// Move the queued events into out and clear the pending flush. Returns
+  /// false when the stream is closed and nothing is left to write.
+  bool take_pending(std::string &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_scheduled_ = false;
+    out.clear();
+    out.swap(pending_);
+    return !closed_ || !out.empty();
+  }
+
+  /// Mark the stream closed after the client went away.
+  void mark_closed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    pending_.clear();
+  }
+
+  /// Arrange for take_pending() to be called on the connection's io thread.
+  /// Called with the stream lock held, at most once per pending flush.
+  virtual void schedule_flush() = 0;
+
+private:
+  void request_flush() {
+    if (!flush_scheduled_) {
+      flush_scheduled_ = true;
+      schedule_flush();
+    }
+  }
+
+  mutable std::mutex mutex_;
+  std::string pending_;
+  bool flush_scheduled_ = false;
+  bool closed_ = false;
+};
+
+} // namespace zion
+
+#endif //ZION_SSE_H
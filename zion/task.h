@@ -0,0 +1,526 @@
+//
+// Created by Shihao Jing on 9/4/17.
+//
+
+#ifndef ZION_TASK_H
+#define ZION_TASK_H
+
+#include <type_traits>
+#include "cpu_pool.h"
+#include "request.h"
+#include "response.h"
+
+// Coroutine handlers need C++20 (-std=c++20); without it routes take
+// plain and asynchronous handlers only.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define ZION_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef ZION_HAS_COROUTINES
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#endif
+
+namespace zion {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+template <typename T>
+struct is_task : std::false_type {};
+
+template <typename T>
+struct is_task<task<T>> : std::true_type {};
+
+} // namespace detail
+
+#ifdef ZION_HAS_COROUTINES
+
+namespace detail {
+
+// Free lists of coroutine frames for the calling thread, by size in steps of
+// 64 bytes; bigger frames come from operator new. A request's frames are
+// taken from and given back to the lists of the io thread running it, so
+// once they are warm a coroutine handler allocates nothing for its frames.
+class frame_pool
+{
+public:
+  static const std::size_t step = 64;
+  static const std::size_t classes = 64;
+  // Frames kept per size, beyond which they are freed.
+  static const std::size_t max_free = 256;
+
+  frame_pool() = default;
+  frame_pool(const frame_pool&) = delete;
+  frame_pool& operator=(const frame_pool&) = delete;
+
+  ~frame_pool() {
+    for (block *&list : free_) {
+      while (list) {
+        block *b = list;
+        list = b->next;
+        ::operator delete(b);
+      }
+    }
+  }
+
+  static frame_pool& local() {
+    thread_local frame_pool pool;
+    return pool;
+  }
+
+  void* allocate(std::size_t size) {
+    std::size_t c = size_class(size);
+    if (c >= classes)
+      return ::operator new(size);
+    if (block *b = free_[c]) {
+      free_[c] = b->next;
+      --free_count_[c];
+      return b;
+    }
+    return ::operator new((c + 1) * step);
+  }
+
+  void deallocate(void *p, std::size_t size) {
+    std::size_t c = size_class(size);
+    if (c >= classes || free_count_[c] == max_free) {
+      ::operator delete(p);
+      return;
+    }
+    block *b = static_cast<block*>(p);
+    b->next = free_[c];
+    free_[c] = b;
+    ++free_count_[c];
+  }
+
+private:
+  struct block
+  {
+    block *next;
+  };
+
+  static std::size_t size_class(std::size_t size) {
+    return size ? (size - 1) / step : 0;
+  }
+
+  block *free_[classes] = {};
+  std::size_t free_count_[classes] = {};
+};
+
+// What every zion coroutine's promise has: pooled frames, the executor it
+// runs on, inherited by the tasks it awaits, and the coroutine to resume
+// once it is done.
+struct promise_base
+{
+  void* operator new(std::size_t size) {
+    return frame_pool::local().allocate(size);
+  }
+
+  void operator delete(void *p, std::size_t size) {
+    frame_pool::local().deallocate(p, size);
+  }
+
+  struct final_awaiter
+  {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      std::coroutine_handle<> next = h.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+
+  void rethrow() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  boost::asio::any_io_executor executor;
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+};
+
+template <typename T>
+struct task_promise : promise_base
+{
+  template <typename U>
+  void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+
+  T result() {
+    rethrow();
+    return std::move(*value);
+  }
+
+  std::optional<T> value;
+};
+
+template <>
+struct task_promise<void> : promise_base
+{
+  void return_void() {}
+
+  void result() {
+    rethrow();
+  }
+};
+
+} // namespace detail
+
+/// A coroutine producing a T, for handlers and what they call. It starts
+/// when awaited, resuming its caller when done, and runs on the io thread
+/// of the request it serves: a route returning task<response> is started
+/// by its connection, and tasks it awaits inherit the executor.
+///
+/// Parameters are copied into the frame; take them by value, not by
+/// reference, as the caller's objects may be gone once the task suspends.
+template <typename T>
+class task
+{
+public:
+  struct promise_type : detail::task_promise<T>
+  {
+    task get_return_object() {
+      return task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  task(task &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr))
+  {
+  }
+
+  task& operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  ~task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> caller) noexcept {
+    handle_.promise().executor = caller.promise().executor;
+    handle_.promise().continuation = caller;
+    return handle_;
+  }
+
+  T await_resume() {
+    return handle_.promise().result();
+  }
+
+private:
+  explicit task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle)
+  {
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+// Drives a route's task to completion and answers with its result, or 500
+// if it throws. Starts at once, on the io thread that calls it, and frees
+// itself when done.
+struct detached_task
+{
+  struct promise_type : promise_base
+  {
+    promise_type(task<response>&, responder &respond) {
+      executor = respond.get_executor();
+    }
+
+    detached_task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+inline detached_task run_task(task<response> t, responder respond) {
+  response res;
+  try {
+    res = co_await t;
+  }
+  catch (...) {
+    res = response::stock_reply(response::internal_server_error);
+  }
+  respond(std::move(res));
+}
+
+class sleep_awaiter
+{
+public:
+  explicit sleep_awaiter(std::chrono::steady_clock::duration duration)
+      : duration_(duration)
+  {
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> h) {
+    timer_.emplace(h.promise().executor, duration_);
+    timer_->async_wait([h](boost::system::error_code) { h.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  std::chrono::steady_clock::duration duration_;
+  // In the coroutine frame, like the awaiter itself.
+  std::optional<boost::asio::steady_timer> timer_;
+};
+
+struct executor_awaiter
+{
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    executor = h.promise().executor;
+    return false;
+  }
+
+  boost::asio::any_io_executor await_resume() { return std::move(executor); }
+
+  boost::asio::any_io_executor executor;
+};
+
+template <typename F>
+class offload_awaiter
+{
+public:
+  using result_type = std::invoke_result_t<F&>;
+
+  explicit offload_awaiter(F f)
+      : f_(std::move(f))
+  {
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> h) {
+    offload_pool().post([this, h, executor = h.promise().executor]
+    {
+      try {
+        if constexpr (std::is_void<result_type>::value)
+          f_();
+        else
+          result_.emplace(f_());
+      }
+      catch (...) {
+        error_ = std::current_exception();
+      }
+      boost::asio::post(executor, [h] { h.resume(); });
+    });
+  }
+
+  result_type await_resume() {
+    if (error_)
+      std::rethrow_exception(error_);
+    if constexpr (!std::is_void<result_type>::value)
+      return std::move(*result_);
+  }
+
+private:
+  struct nothing {};
+  F f_;
+  std::optional<std::conditional_t<std::is_void<result_type>::value, nothing, result_type>> result_;
+  std::exception_ptr error_;
+};
+
+// What co_await on an asio operation with use_task returns: nothing, the
+// one value, or a tuple; an error_code in front is thrown instead.
+template <typename... T>
+auto task_results(std::tuple<T...> &&results) {
+  if constexpr (sizeof...(T) == 0)
+    return;
+  else if constexpr (sizeof...(T) == 1)
+    return std::move(std::get<0>(results));
+  else
+    return std::move(results);
+}
+
+template <typename... T>
+auto task_results(std::tuple<boost::system::error_code, T...> &&results) {
+  if (std::get<0>(results))
+    throw boost::system::system_error(std::get<0>(results));
+  return task_results(std::apply([](boost::system::error_code, T &... rest)
+                                 {
+                                   return std::tuple<T...>(std::move(rest)...);
+                                 }, results));
+}
+
+// An asio operation, started when awaited, whose completion handler
+// resumes the coroutine on its executor.
+template <typename Initiation, typename InitArgs, typename... Results>
+class async_awaiter
+{
+public:
+  async_awaiter(Initiation initiation, InitArgs args)
+      : initiation_(std::move(initiation)), args_(std::move(args))
+  {
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> h) {
+    std::apply([this, h](auto &&... args)
+               {
+                 std::move(initiation_)(handler{this, h, h.promise().executor}, std::move(args)...);
+               }, args_);
+  }
+
+  auto await_resume() {
+    return task_results(std::move(*results_));
+  }
+
+private:
+  struct handler
+  {
+    using executor_type = boost::asio::any_io_executor;
+    executor_type get_executor() const noexcept { return executor; }
+
+    void operator()(Results... results) {
+      self->results_.emplace(std::move(results)...);
+      h.resume();
+    }
+
+    async_awaiter *self;
+    std::coroutine_handle<> h;
+    executor_type executor;
+  };
+
+  Initiation initiation_;
+  InitArgs args_;
+  std::optional<std::tuple<std::decay_t<Results>...>> results_;
+};
+
+} // namespace detail
+
+/// Resume after duration, on the same io thread; other connections are
+/// served meanwhile. sleep_for(0) yields to them.
+inline detail::sleep_awaiter sleep_for(std::chrono::steady_clock::duration duration) {
+  return detail::sleep_awaiter(duration);
+}
+
+/// The executor the coroutine runs on, for sockets and timers of its own:
+///   boost::asio::ip::tcp::socket upstream(co_await zion::this_executor());
+inline detail::executor_awaiter this_executor() {
+  return {};
+}
+
+/// Run f() on the pool of offloaded routes, a worker per core, and resume
+/// with its result (or exception) back on the io thread. For CPU-heavy or blocking
+/// work that would otherwise hold up every connection of the io thread.
+template <typename F>
+detail::offload_awaiter<std::decay_t<F>> offload(F &&f) {
+  return detail::offload_awaiter<std::decay_t<F>>(std::forward<F>(f));
+}
+
+/// Completion token for asio operations awaited in a task:
+///   std::size_t n = co_await socket.async_read_some(buffer, zion::use_task);
+/// Errors are thrown as boost::system::system_error.
+struct use_task_t {};
+constexpr use_task_t use_task{};
+
+#endif // ZION_HAS_COROUTINES
+
+namespace detail {
+
+// What a route's handler returned, as the response the connection writes.
+// A task is started by the connection, with the responder that answers
+// once it completes. f is the handler kept by the route, and outlives the
+// request; args are copied into the task.
+template <typename F, typename... Args>
+response call_handler(const F &f, const Args &... args) {
+#ifdef ZION_HAS_COROUTINES
+  if constexpr (is_task<std::decay_t<decltype(f(args...))>>::value) {
+    return response(async_handler([&f, args...](responder respond)
+                                  {
+                                    run_task(f(args...), std::move(respond));
+                                  }));
+  }
+  else
+#endif
+  {
+    return response(f(args...));
+  }
+}
+
+// As above for handlers taking the request, which stays valid until the
+// task completes.
+template <typename F, typename... Args>
+response call_handler_with_request(const F &f, const request &req, const Args &... args) {
+#ifdef ZION_HAS_COROUTINES
+  if constexpr (is_task<std::decay_t<decltype(f(req, args...))>>::value) {
+    return response(async_handler([&f, &req, args...](responder respond)
+                                  {
+                                    run_task(f(req, args...), std::move(respond));
+                                  }));
+  }
+  else
+#endif
+  {
+    return response(f(req, args...));
+  }
+}
+
+} // namespace detail
+
+} // namespace zion
+
+#ifdef ZION_HAS_COROUTINES
+
+namespace boost {
+namespace asio {
+
+template <typename... Results>
+class async_result<zion::use_task_t, void(Results...)>
+{
+public:
+  template <typename Initiation, typename... InitArgs>
+  static auto initiate(Initiation &&initiation, zion::use_task_t, InitArgs &&... args) {
+    using args_type = std::tuple<std::decay_t<InitArgs>...>;
+    return zion::detail::async_awaiter<std::decay_t<Initiation>, args_type, Results...>(
+        std::forward<Initiation>(initiation), args_type(std::forward<InitArgs>(args)...));
+  }
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif // ZION_HAS_COROUTINES
+
+#endif //ZION_TASK_H
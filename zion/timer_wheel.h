@@ -0,0 +1,194 @@
+//
+// Created by Shihao Jing on 8/14/17.
+//
+
+#ifndef ZION_TIMER_WHEEL_H
+#define ZION_TIMER_WHEEL_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace zion {
+
+/// Hashed timing wheel driving every connection deadline of one io thread
+/// from a single steady_timer. Entries are intrusive list nodes embedded in
+/// their owner, so scheduling, rescheduling and cancelling are O(1) and never
+/// allocate. Deadlines are rounded up to the tick, which is fine for timeouts
+/// measured in seconds. Not thread-safe: use it from its io thread only.
+///
+/// Without an io_service the wheel is driven by the caller, who calls
+/// advance() at least once a tick; the io_uring engine does so from its own
+/// loop.
+class timer_wheel
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  class entry
+  {
+  public:
+    entry() = default;
+    entry(const entry&) = delete;
+    entry& operator=(const entry&) = delete;
+
+    virtual ~entry() {
+      cancel();
+    }
+
+    bool active() const { return wheel_ != nullptr; }
+
+    void cancel() {
+      if (!wheel_)
+        return;
+      prev_->next_ = next_;
+      next_->prev_ = prev_;
+      prev_ = next_ = nullptr;
+      --wheel_->size_;
+      wheel_ = nullptr;
+    }
+
+  protected:
+    /// Called on the io thread once the deadline has passed. The entry is
+    /// already unlinked and may be scheduled again from here.
+    virtual void on_expire() = 0;
+
+  private:
+    friend class timer_wheel;
+
+    entry *prev_ = nullptr;
+    entry *next_ = nullptr;
+    timer_wheel *wheel_ = nullptr;
+    uint64_t expires_tick_ = 0;
+  };
+
+  explicit timer_wheel(boost::asio::io_service &io_service,
+                       std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+                       std::size_t slots = 1024)
+      : timer_(new boost::asio::steady_timer(io_service)),
+        tick_(tick),
+        slots_(slots),
+        start_(clock::now())
+  {
+    // Each slot is a circular list headed by a sentinel, which keeps unlink
+    // branch-free.
+    for (auto &head : slots_)
+      head.prev_ = head.next_ = &head;
+  }
+
+  explicit timer_wheel(std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+                       std::size_t slots = 1024)
+      : tick_(tick),
+        slots_(slots),
+        start_(clock::now())
+  {
+    for (auto &head : slots_)
+      head.prev_ = head.next_ = &head;
+  }
+
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  ~timer_wheel() {
+    for (auto &head : slots_) {
+      while (head.next_ != &head)
+        head.next_->cancel();
+    }
+  }
+
+  /// (Re)arm e to expire after timeout.
+  void schedule(entry &e, clock::duration timeout) {
+    e.cancel();
+
+    uint64_t ticks = static_cast<uint64_t>((timeout + tick_ - clock::duration(1)) / tick_);
+    e.expires_tick_ = current_tick() + (ticks ? ticks : 1);
+    sentinel &head = slots_[e.expires_tick_ % slots_.size()];
+    e.prev_ = head.prev_;
+    e.next_ = &head;
+    head.prev_->next_ = &e;
+    head.prev_ = &e;
+    e.wheel_ = this;
+
+    if (size_++ == 0)
+      arm();
+  }
+
+  /// Number of scheduled entries.
+  std::size_t size() const { return size_; }
+
+  /// Expire every entry whose deadline has passed.
+  void advance() {
+    uint64_t now = current_tick();
+    // Walk every slot passed since the last tick; after a full turn every
+    // slot has been visited, so further ticks add nothing.
+    uint64_t first = processed_tick_ + 1;
+    if (now >= first + slots_.size())
+      first = now - slots_.size() + 1;
+
+    for (uint64_t tick = first; tick <= now; ++tick) {
+      sentinel &head = slots_[tick % slots_.size()];
+      // Expired entries are moved to a local list first: on_expire may
+      // reschedule into this very slot.
+      sentinel expired;
+      expired.prev_ = expired.next_ = &expired;
+      for (entry *e = head.next_; e != &head; ) {
+        entry *next = e->next_;
+        if (e->expires_tick_ <= now) {
+          e->prev_->next_ = e->next_;
+          e->next_->prev_ = e->prev_;
+          e->prev_ = expired.prev_;
+          e->next_ = &expired;
+          expired.prev_->next_ = e;
+          expired.prev_ = e;
+        }
+        e = next;
+      }
+      while (expired.next_ != &expired) {
+        entry *e = expired.next_;
+        e->cancel();
+        e->on_expire();
+      }
+    }
+    processed_tick_ = now;
+
+    if (size_ > 0)
+      arm();
+  }
+
+private:
+  struct sentinel : entry
+  {
+    void on_expire() override {}
+  };
+
+  uint64_t current_tick() const {
+    return static_cast<uint64_t>((clock::now() - start_) / tick_);
+  }
+
+  // The timer only runs while something is scheduled, so an idle thread is
+  // not woken up every tick.
+  void arm() {
+    if (!timer_)
+      return;
+    timer_->expires_at(start_ + tick_ * (processed_tick_ + 1));
+    timer_->async_wait([this](const boost::system::error_code &ec)
+                       {
+                         if (!ec)
+                           advance();
+                       });
+  }
+
+  std::unique_ptr<boost::asio::steady_timer> timer_;   // null when driven by advance()
+  clock::duration tick_;
+  std::vector<sentinel> slots_;
+  clock::time_point start_;
+  uint64_t processed_tick_ = 0;
+  std::size_t size_ = 0;
+};
+
+} // namespace zion
+
+#endif //ZION_TIMER_WHEEL_H
@@ -0,0 +1,281 @@
+//
+// Created by Shihao Jing on 8/30/17.
+//
+
+#ifndef ZION_URING_H
+#define ZION_URING_H
+
+// The io_uring engine needs Linux 6.1 headers; without them it is left out
+// and servers always run on asio.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_SETUP_DEFER_TASKRUN
+#define ZION_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef ZION_HAS_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+namespace zion {
+
+/// A minimal io_uring (Linux 6.0 and later) over the raw system calls: the
+/// submission and completion rings, registered files and provided buffer
+/// rings, which is all the io_uring engine uses.
+namespace uring {
+
+inline int setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+inline int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+inline int register_op(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/// Whether the running kernel has everything the engine relies on:
+/// multishot accept and receive and provided buffer rings arrived in 6.0.
+/// Also false when io_uring is turned off (kernel.io_uring_disabled).
+inline bool supported() {
+  utsname name;
+  if (::uname(&name) != 0 || std::atoi(name.release) < 6)
+    return false;
+  io_uring_params params{};
+  int fd = setup(4, &params);
+  if (fd < 0)
+    return false;
+  ::close(fd);
+  return true;
+}
+
+/// One ring, used from a single thread.
+class ring
+{
+public:
+  /// Throws std::system_error if the kernel refuses the ring.
+  explicit ring(unsigned entries) {
+    io_uring_params params{};
+    // Completions are only processed when we ask for them, on the thread
+    // that owns the ring, instead of interrupting it.
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    fd_ = setup(entries, &params);
+    if (fd_ < 0 && errno == EINVAL) {
+      params = io_uring_params{};
+      params.flags = IORING_SETUP_CQSIZE;
+      params.cq_entries = entries * 4;
+      fd_ = setup(entries, &params);
+    }
+    if (fd_ < 0)
+      throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    single_mmap_ = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap_)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap_ ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+    char *sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    // Entries are always used in ring order, so the index array is the
+    // identity, set up once.
+    unsigned *array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i)
+      array[i] = i;
+    sqe_tail_ = *sq_tail_;
+
+    char *cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  ring(const ring&) = delete;
+  ring& operator=(const ring&) = delete;
+
+  ~ring() {
+    ::munmap(sqes_, sqes_size_);
+    if (!single_mmap_)
+      ::munmap(cq_ring_, cq_ring_size_);
+    ::munmap(sq_ring_, sq_ring_size_);
+    ::close(fd_);
+  }
+
+  int fd() const { return fd_; }
+
+  /// A zeroed submission entry, queued with the next submit(). Submits
+  /// what is queued first if the ring is full.
+  io_uring_sqe* get_sqe() {
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      submit(0);
+      if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+        return nullptr;
+    }
+    io_uring_sqe *sqe = &sqes_[sqe_tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail_;
+    return sqe;
+  }
+
+  /// Submit the queued entries and wait for wait_nr completions, in one
+  /// system call. Returns the number submitted, or -errno.
+  int submit(unsigned wait_nr) {
+    unsigned to_submit = sqe_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    int n = enter(fd_, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    return n < 0 ? -errno : n;
+  }
+
+  /// Call f(cqe) for every completion available, then release them.
+  template <typename F>
+  unsigned for_each_cqe(F f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; ++head, ++n) {
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      f(cqe);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  /// Register a table of count fixed files, all empty, to be filled with
+  /// IORING_OP_FILES_UPDATE.
+  void register_files(unsigned count) {
+    std::vector<int> fds(count, -1);
+    if (register_op(fd_, IORING_REGISTER_FILES, fds.data(), count) < 0)
+      throw std::system_error(errno, std::system_category(), "IORING_REGISTER_FILES");
+  }
+
+private:
+  void* map(std::size_t size, off_t offset) {
+    void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (p == MAP_FAILED)
+      throw std::system_error(errno, std::system_category(), "io_uring mmap");
+    return p;
+  }
+
+  int fd_;
+  bool single_mmap_;
+  void *sq_ring_;
+  void *cq_ring_;
+  std::size_t sq_ring_size_;
+  std::size_t cq_ring_size_;
+  io_uring_sqe *sqes_;
+  std::size_t sqes_size_;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned sqe_tail_;   // queued locally, published by submit()
+
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe *cqes_;
+};
+
+/// Receive buffers handed to the kernel up front (a provided buffer ring):
+/// a receive picks one only once data has arrived, so idle connections hold
+/// no buffer, as with buffer_pool.
+class buffer_ring
+{
+public:
+  /// count must be a power of two.
+  buffer_ring(ring &r, uint16_t group, unsigned count, std::size_t size)
+      : ring_(r),
+        group_(group),
+        count_(count),
+        size_(size),
+        storage_(count * size)
+  {
+    ring_size_ = count * sizeof(io_uring_buf);
+    void *p = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::system_error(errno, std::system_category(), "buffer ring mmap");
+    // Addressed as a plain array: in C++ the kernel header's flexible array
+    // member is laid out 8 bytes off. The ring tail overlays the resv field
+    // of the first entry.
+    bufs_ = static_cast<io_uring_buf*>(p);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufs_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (register_op(ring_.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      int error = errno;
+      ::munmap(bufs_, ring_size_);
+      throw std::system_error(error, std::system_category(), "IORING_REGISTER_PBUF_RING");
+    }
+    for (unsigned i = 0; i < count; ++i)
+      recycle(static_cast<uint16_t>(i));
+  }
+
+  buffer_ring(const buffer_ring&) = delete;
+  buffer_ring& operator=(const buffer_ring&) = delete;
+
+  ~buffer_ring() {
+    io_uring_buf_reg reg{};
+    reg.bgid = group_;
+    register_op(ring_.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    ::munmap(bufs_, ring_size_);
+  }
+
+  uint16_t group() const { return group_; }
+
+  /// The buffer a completion with IORING_CQE_F_BUFFER filled.
+  char* data(uint16_t id) { return storage_.data() + id * size_; }
+
+  /// Give a buffer back to the kernel once its data has been consumed.
+  void recycle(uint16_t id) {
+    io_uring_buf &buf = bufs_[tail_ & (count_ - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(data(id));
+    buf.len = static_cast<uint32_t>(size_);
+    buf.bid = id;
+    ++tail_;
+    __atomic_store_n(&bufs_[0].resv, tail_, __ATOMIC_RELEASE);
+  }
+
+private:
+  ring &ring_;
+  uint16_t group_;
+  unsigned count_;
+  std::size_t size_;
+  std::vector<char> storage_;
+  io_uring_buf *bufs_;
+  std::size_t ring_size_;
+  uint16_t tail_ = 0;
+};
+
+} // namespace uring
+} // namespace zion
+
+#endif // ZION_HAS_IO_URING
+
+#endif //ZION_URING_H
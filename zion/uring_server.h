@@ -0,0 +1,948 @@
+//
+// Created by Shihao Jing on 8/30/17.
+//
+
+#ifndef ZION_URING_SERVER_H
+#define ZION_URING_SERVER_H
+
+#include "uring.h"
+
+#ifdef ZION_HAS_IO_URING
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "access_log.h"
+#include "arena.h"
+#include "buffer_pool.h"
+#include "request.h"
+#include "request_parser.h"
+#include "response.h"
+#include "server.h"
+#include "timer_wheel.h"
+
+namespace zion {
+
+/// Plain HTTP/1.1 served from one io_uring instead of the asio reactor,
+/// chosen with server_config::engine. One submission carries everything a
+/// request needs, and one io_uring_enter per loop both submits it and
+/// collects the completions of every connection:
+///
+///   - one multishot accept for every new connection;
+///   - per connection one multishot receive, picking buffers from a
+///     provided buffer ring only once data has arrived;
+///   - each response as one sendmsg, followed for file bodies by linked
+///     splices from the file through a pipe to the socket;
+///   - sockets addressed through a registered file table, set up by an
+///     IORING_OP_FILES_UPDATE linked before the first receive.
+///
+/// Timeouts, access logging, max_connections, draining, asynchronous routes
+/// and hot restarts behave as with Server. HTTP/2, WebSocket and event stream routes are not
+/// available on this engine; the latter two answer 501.
+///
+/// Construct it on the thread that calls run(): the ring takes submissions
+/// only from the thread that set it up.
+template <typename Handler>
+class uring_server
+{
+public:
+  uring_server(const boost::asio::ip::tcp::endpoint &endpoint, Handler *handler,
+               const server_config &config = server_config(), access_log *log = nullptr)
+      : acceptor_(io_service_),
+        signals_(io_service_, SIGINT, SIGTERM),
+        drain_timer_(io_service_),
+        handoff_(io_service_),
+        config_(config),
+        handler_(handler),
+        log_(log),
+        ring_(queue_depth),
+        buffers_(ring_, 0, receive_buffers, buffer_pool::buffer_size)
+  {
+    // The registered file table is capped by RLIMIT_NOFILE, and so is the
+    // number of connections.
+    rlimit limit;
+    std::size_t slots = config_.max_connections;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+      slots = std::min<std::size_t>(slots, limit.rlim_cur);
+    slots = std::max<std::size_t>(slots, 1);
+    ring_.register_files(static_cast<unsigned>(slots));
+    conns_.resize(slots);
+    for (std::size_t i = slots; i > 0; --i)
+      free_.push_back(static_cast<unsigned>(i - 1));
+
+    signals_.async_wait([this](boost::system::error_code ec, int)
+                        {
+                          if (!ec)
+                            shutdown();
+                        });
+
+    std::vector<int> inherited;
+    if (!config_.handoff_path.empty())
+      inherited = handoff::take_listeners(config_.handoff_path);
+    if (!inherited.empty()) {
+      acceptor_.assign(endpoint.protocol(), inherited[0]);
+      for (std::size_t i = 1; i < inherited.size(); ++i)
+        ::close(inherited[i]);
+    }
+    else {
+      detail::open_listener(acceptor_, endpoint, config_);
+    }
+    if (!config_.handoff_path.empty())
+      handoff_.listen(config_.handoff_path, {acceptor_.native_handle()}, [this] { shutdown(); });
+
+    arm_accept();
+    arm_tick();
+    arm_wake();
+  }
+
+  uring_server(const uring_server&) = delete;
+  uring_server& operator=(const uring_server&) = delete;
+
+  ~uring_server() {
+    for (auto &c : conns_) {
+      if (c && c->fd >= 0)
+        ::close(c->fd);
+      if (c)
+        c->close_pipe();
+    }
+    ::close(wake_fd_);
+  }
+
+  /// Serve until shutdown() has drained every connection, or its deadline
+  /// has passed.
+  void run() {
+    detail::pin_thread(config_.busy_poll.cpu);
+    while (!stopped_) {
+      int n = ring_.submit(1);
+      if (n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY)
+        throw std::system_error(-n, std::system_category(), "io_uring_enter");
+      ring_.for_each_cqe([this](const io_uring_cqe &cqe) { complete(cqe); });
+    }
+    cancel_all();
+  }
+
+  /// As Server::shutdown(): stop accepting, let requests in flight finish,
+  /// close idle connections. Safe to call from any thread; picked up
+  /// within a tick.
+  void shutdown() {
+    boost::asio::post(io_service_, [this]
+    {
+      if (draining_)
+        return;
+      draining_ = true;
+      boost::system::error_code ignored;
+      signals_.cancel(ignored);
+      if (accepting_)
+        cancel(tag(op_accept, 0));
+      acceptor_.close(ignored);
+      handoff_.close();
+
+      for (auto &c : conns_) {
+        if (c && c->fd >= 0 && (c->st == state::idle || (c->st == state::reading_header && !c->parser.started())))
+          close(*c);
+      }
+      if (active_ == 0) {
+        stopped_ = true;
+        return;
+      }
+      drain_timer_.expires_from_now(config_.drain_timeout);
+      drain_timer_.async_wait([this](boost::system::error_code ec)
+                              {
+                                if (!ec)
+                                  stopped_ = true;
+                              });
+    });
+  }
+
+  /// Where the listener is bound: the port picked when the endpoint's was 0.
+  boost::asio::ip::tcp::endpoint local_endpoint() const {
+    return acceptor_.local_endpoint();
+  }
+
+private:
+  // Submission entries, and in flight per connection at most a receive and
+  // a three-entry write chain.
+  static const unsigned queue_depth = 4096;
+  static const unsigned receive_buffers = 1024;
+  // Largest piece of a file moved through the pipe per splice.
+  static const std::size_t splice_size = 1024 * 1024;
+  // Bytes a connection may have waiting in c.in while it answers; past
+  // this its receive is cancelled until the pipelined requests are served.
+  static const std::size_t max_buffered_input = 64 * 1024;
+
+  enum op : uint8_t
+  {
+    op_accept,
+    op_tick,
+    op_wake,         // responders posted to io_service_
+    op_cancel,
+    op_register,     // socket into the file table
+    op_recv,
+    op_send,
+    op_splice_in,    // file to pipe
+    op_splice_out,   // pipe to socket
+    op_unregister    // socket out of the file table; the slot is free after
+  };
+
+  enum class state
+  {
+    idle,
+    reading_header,
+    reading_body,
+    awaiting,        // for an asynchronous route's response
+    writing,
+    closing
+  };
+
+  struct conn : timer_wheel::entry
+  {
+    conn(uring_server &s, unsigned i)
+        : server(s),
+          slot(i),
+          req(&memory)
+    {
+      parser.reset(&req);
+    }
+
+    void on_expire() override { server.close(*this); }
+
+    void close_pipe() {
+      if (pipe[0] >= 0) {
+        ::close(pipe[0]);
+        ::close(pipe[1]);
+        pipe[0] = pipe[1] = -1;
+      }
+    }
+
+    uring_server &server;
+    unsigned slot;
+    int fd = -1;
+    state st = state::idle;
+    // Submissions whose last completion has not arrived yet.
+    unsigned inflight = 0;
+    bool receiving = false;
+    // The receive was cancelled because c.in is full.
+    bool receive_paused = false;
+    // A responder is out; the slot is kept until it answers.
+    bool awaiting = false;
+
+    arena memory;
+    request req;
+    request_parser parser;
+    response res;
+    // Bytes received past the request being answered.
+    std::string in;
+
+    // The write in progress: buffers [first, buffers.size()), the first one
+    // offset bytes in, then the file body through the pipe.
+    std::vector<boost::asio::const_buffer> buffers;
+    std::size_t first = 0;
+    std::size_t offset = 0;
+    std::vector<iovec> iov;
+    msghdr msg{};
+    std::string chunk;
+    std::string chunk_size;
+    bool last_chunk = false;
+    int pipe[2] = { -1, -1 };
+    std::size_t pipe_size = 0;
+    std::size_t file_read = 0;
+    std::size_t in_pipe = 0;
+    unsigned write_ops = 0;
+    bool write_failed = false;
+
+    std::chrono::steady_clock::time_point start;
+    std::size_t bytes_sent = 0;
+  };
+
+  static uint64_t tag(op o, unsigned slot) {
+    return (static_cast<uint64_t>(slot) << 8) | o;
+  }
+
+  io_uring_sqe* sqe(op o, unsigned slot) {
+    io_uring_sqe *e = ring_.get_sqe();
+    while (!e) {
+      // Every entry is taken and the kernel has not consumed any: let it
+      // catch up.
+      ring_.submit(1);
+      e = ring_.get_sqe();
+    }
+    e->user_data = tag(o, slot);
+    return e;
+  }
+
+  void arm_accept() {
+    io_uring_sqe *e = sqe(op_accept, 0);
+    e->opcode = IORING_OP_ACCEPT;
+    e->fd = acceptor_.native_handle();
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->accept_flags = SOCK_CLOEXEC;
+    accepting_ = true;
+  }
+
+  // The loop wakes every tick to advance the timer wheel and run the asio
+  // handlers of signals, the drain deadline and hot restarts.
+  void arm_tick() {
+    io_uring_sqe *e = sqe(op_tick, 0);
+    e->opcode = IORING_OP_TIMEOUT;
+    e->addr = reinterpret_cast<uint64_t>(&tick_);
+    e->len = 1;
+  }
+
+  // Responders answer from any thread: they post to io_service_, then bump
+  // the eventfd this read waits on, so the loop runs them at once instead
+  // of at the next tick.
+  void arm_wake() {
+    io_uring_sqe *e = sqe(op_wake, 0);
+    e->opcode = IORING_OP_READ;
+    e->fd = wake_fd_;
+    e->addr = reinterpret_cast<uint64_t>(&wake_count_);
+    e->len = sizeof(wake_count_);
+    waking_ = true;
+  }
+
+  void wake() {
+    ::eventfd_write(wake_fd_, 1);
+  }
+
+  void cancel(uint64_t user_data) {
+    io_uring_sqe *e = sqe(op_cancel, 0);
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->addr = user_data;
+  }
+
+  void complete(const io_uring_cqe &cqe) {
+    op o = static_cast<op>(cqe.user_data & 0xff);
+    unsigned slot = static_cast<unsigned>(cqe.user_data >> 8);
+    switch (o) {
+      case op_accept:
+        on_accept(cqe);
+        return;
+      case op_tick:
+        on_tick();
+        return;
+      case op_wake:
+        waking_ = false;
+        if (io_service_.stopped())
+          io_service_.restart();
+        io_service_.poll();
+        if (!stopped_)
+          arm_wake();
+        return;
+      case op_cancel:
+        return;
+      default:
+        break;
+    }
+
+    conn &c = *conns_[slot];
+    switch (o) {
+      case op_register:
+        --c.inflight;
+        if (cqe.res < 0)
+          close(c);
+        break;
+      case op_recv:
+        on_recv(c, cqe);
+        break;
+      case op_send:
+      case op_splice_in:
+      case op_splice_out:
+        on_write(c, o, cqe.res);
+        break;
+      case op_unregister:
+        recycle(c);
+        return;
+      default:
+        break;
+    }
+    if (c.st == state::closing && c.inflight == 0 && !c.awaiting)
+      release(c);
+  }
+
+  void on_tick() {
+    wheel_.advance();
+    // poll() leaves the service stopped whenever it runs out of work.
+    if (io_service_.stopped())
+      io_service_.restart();
+    io_service_.poll();
+    if (accept_failed_ && !accepting_ && !draining_ && !accept_paused_) {
+      accept_failed_ = false;
+      arm_accept();
+    }
+    if (!stopped_)
+      arm_tick();
+  }
+
+  void on_accept(const io_uring_cqe &cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+      accepting_ = false;
+    if (cqe.res < 0) {
+      // Out of descriptors or memory: retry on the next tick rather than
+      // in a busy loop.
+      if (cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM)
+        accept_failed_ = true;
+      else if (!accepting_ && !draining_ && !accept_paused_)
+        arm_accept();
+      return;
+    }
+
+    int fd = cqe.res;
+    if (draining_ || free_.empty()) {
+      ::close(fd);
+      return;
+    }
+    detail::set_accepted_options(fd, config_);
+    unsigned slot = free_.back();
+    free_.pop_back();
+    ++active_;
+    if (!conns_[slot])
+      conns_[slot].reset(new conn(*this, slot));
+    start(*conns_[slot], fd);
+
+    if (active_ >= conns_.size() && accepting_) {
+      // Leave further clients in the listen backlog until a connection
+      // closes.
+      accept_paused_ = true;
+      cancel(tag(op_accept, 0));
+    }
+    else if (!accepting_ && !draining_) {
+      arm_accept();
+    }
+  }
+
+  void start(conn &c, int fd) {
+    c.fd = fd;
+    begin_request(c);
+
+    io_uring_sqe *e = sqe(op_register, c.slot);
+    e->opcode = IORING_OP_FILES_UPDATE;
+    e->fd = -1;
+    e->addr = reinterpret_cast<uint64_t>(&c.fd);
+    e->len = 1;
+    e->off = c.slot;
+    e->flags = IOSQE_IO_LINK;
+    ++c.inflight;
+    arm_recv(c);
+  }
+
+  void arm_recv(conn &c) {
+    io_uring_sqe *e = sqe(op_recv, c.slot);
+    e->opcode = IORING_OP_RECV;
+    e->fd = static_cast<int>(c.slot);
+    e->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    e->buf_group = buffers_.group();
+    e->ioprio = IORING_RECV_MULTISHOT;
+    c.receiving = true;
+    ++c.inflight;
+  }
+
+  void on_recv(conn &c, const io_uring_cqe &cqe) {
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+      uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      if (c.st != state::closing)
+        feed(c, buffers_.data(id), static_cast<std::size_t>(cqe.res));
+      buffers_.recycle(id);
+    }
+    if (more)
+      return;
+    c.receiving = false;
+    --c.inflight;
+    if (c.st == state::closing)
+      return;
+    // The multishot receive ends at EOF and on errors, but also when the
+    // buffer ring ran dry or the completion queue overflowed, and when
+    // feed cancelled it.
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && !(c.receive_paused && cqe.res == -ECANCELED)))
+      close(c);
+    else if (c.receive_paused)
+      resume_recv(c);
+    else
+      arm_recv(c);
+  }
+
+  // Receive again once a paused connection has worked through c.in.
+  void resume_recv(conn &c) {
+    if (!c.receive_paused || c.receiving || c.st == state::closing || c.in.size() >= max_buffered_input)
+      return;
+    c.receive_paused = false;
+    arm_recv(c);
+  }
+
+  void begin_request(conn &c) {
+    c.st = state::reading_header;
+    wheel_.schedule(c, config_.timeouts.header);
+    if (log_)
+      c.start = std::chrono::steady_clock::now();
+  }
+
+  // New bytes from the socket: parsed at once where they are, unless a
+  // response is being written or earlier bytes wait in c.in.
+  // A client that keeps sending without reading its answers stops being
+  // received from while c.in is full.
+  void feed(conn &c, const char *data, std::size_t size) {
+    if (c.st == state::writing || c.st == state::awaiting || !c.in.empty()) {
+      c.in.append(data, size);
+      if (c.st != state::writing && c.st != state::awaiting)
+        parse_pending(c);
+    }
+    else {
+      std::size_t used = parse(c, data, size);
+      if (used < size && c.st != state::closing)
+        c.in.append(data + used, size - used);
+    }
+    if (c.in.size() >= max_buffered_input && c.receiving && !c.receive_paused) {
+      c.receive_paused = true;
+      cancel(tag(op_recv, c.slot));
+    }
+  }
+
+  void parse_pending(conn &c) {
+    std::size_t used = parse(c, c.in.data(), c.in.size());
+    c.in.erase(0, used);
+  }
+
+  std::size_t parse(conn &c, const char *data, std::size_t size) {
+    if (c.st == state::idle)
+      begin_request(c);
+    else if (c.st == state::reading_body)
+      wheel_.schedule(c, config_.timeouts.body);
+
+    std::size_t consumed = 0;
+    auto result = c.parser.parse(data, size, consumed);
+    if (result == request_parser::good) {
+      handle(c);
+    }
+    else if (result == request_parser::bad) {
+      c.res = response::stock_reply(response::bad_request);
+      c.res.to_buffers(c.buffers);
+      begin_write(c);
+    }
+    else if (c.st == state::reading_header && c.parser.headers_complete()) {
+      c.st = state::reading_body;
+      wheel_.schedule(c, config_.timeouts.body);
+    }
+    return consumed;
+  }
+
+  void handle(conn &c) {
+    c.res = handler_->handle(c.req);
+    send_response(c);
+  }
+
+  void send_response(conn &c) {
+    if (c.res.is_async()) {
+      await_response(c);
+      return;
+    }
+    // Upgrades and event streams need the asio engine.
+    if (c.res.is_websocket() || c.res.is_event_stream())
+      c.res = response::stock_reply(response::not_implemented);
+    c.res.keep_alive = c.req.keep_alive && !draining_;
+    c.res.to_buffers(c.buffers);
+    begin_write(c);
+  }
+
+  // As connection does: the responder keeps the slot, and the request in it,
+  // until it answers, and bytes received meanwhile wait in c.in.
+  void await_response(conn &c) {
+    c.st = state::awaiting;
+    c.awaiting = true;
+    wheel_.schedule(c, config_.timeouts.write);
+    auto on_async = std::move(c.res.on_async);
+    c.res.clear();
+    on_async(detail::make_responder([this](auto handler)
+                                    {
+                                      boost::asio::post(io_service_, std::move(handler));
+                                      wake();
+                                    },
+                                    [this, &c](response res)
+                                    {
+                                      c.awaiting = false;
+                                      if (c.st == state::closing) {
+                                        if (c.inflight == 0)
+                                          release(c);
+                                        return;
+                                      }
+                                      c.cancel();
+                                      c.res = std::move(res);
+                                      send_response(c);
+                                    },
+                                    io_service_.get_executor()));
+  }
+
+  void begin_write(conn &c) {
+    c.st = state::writing;
+    c.first = c.offset = 0;
+    c.file_read = c.in_pipe = 0;
+    c.last_chunk = false;
+    c.write_failed = false;
+    wheel_.schedule(c, config_.timeouts.write);
+    write_step(c);
+  }
+
+  // Submit the next part of the response, or finish it: the buffers left
+  // in one sendmsg, linked to the next piece of a file body.
+  void write_step(conn &c) {
+    for (;;) {
+      bool has_buffers = c.first < c.buffers.size();
+      const file_body *file = c.res.is_file() ? c.res.file.get() : nullptr;
+      if (has_buffers) {
+        bool link = file && c.in_pipe == 0 && c.file_read < file->size;
+        // MSG_MORE corks the headers until the first splice of the body.
+        submit_send(c, link, link && config_.tcp.cork);
+        if (link)
+          submit_file_piece(c, *file);
+        return;
+      }
+      if (file && c.in_pipe > 0) {
+        submit_splice_out(c, c.in_pipe);
+        return;
+      }
+      if (file && c.file_read < file->size) {
+        submit_file_piece(c, *file);
+        return;
+      }
+      if (c.res.is_streaming() && !c.last_chunk) {
+        next_chunk(c);
+        continue;
+      }
+      finish_request(c);
+      return;
+    }
+  }
+
+  void submit_send(conn &c, bool link, bool more = false) {
+    c.iov.clear();
+    for (std::size_t i = c.first; i < c.buffers.size(); ++i) {
+      const char *data = static_cast<const char*>(c.buffers[i].data());
+      std::size_t size = c.buffers[i].size();
+      if (i == c.first) {
+        data += c.offset;
+        size -= c.offset;
+      }
+      if (size)
+        c.iov.push_back(iovec{const_cast<char*>(data), size});
+    }
+    c.msg = msghdr{};
+    c.msg.msg_iov = c.iov.data();
+    c.msg.msg_iovlen = c.iov.size();
+
+    io_uring_sqe *e = sqe(op_send, c.slot);
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = static_cast<int>(c.slot);
+    e->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    e->addr = reinterpret_cast<uint64_t>(&c.msg);
+    e->len = 1;
+    e->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    ++c.write_ops;
+    ++c.inflight;
+  }
+
+  // The next piece of the file into the pipe, linked to moving it on to
+  // the socket.
+  void submit_file_piece(conn &c, const file_body &file) {
+    if (c.pipe[0] < 0) {
+      if (::pipe2(c.pipe, O_CLOEXEC) != 0) {
+        c.write_failed = true;
+        if (!c.write_ops)
+          close(c);
+        return;
+      }
+      int size = ::fcntl(c.pipe[1], F_SETPIPE_SZ, static_cast<int>(splice_size));
+      if (size < 0)
+        size = ::fcntl(c.pipe[1], F_GETPIPE_SZ);
+      c.pipe_size = static_cast<std::size_t>(size);
+    }
+    std::size_t n = std::min(file.size - c.file_read, c.pipe_size);
+
+    io_uring_sqe *e = sqe(op_splice_in, c.slot);
+    e->opcode = IORING_OP_SPLICE;
+    e->splice_fd_in = file.fd;
+    e->splice_off_in = static_cast<uint64_t>(file.offset + static_cast<off_t>(c.file_read));
+    e->fd = c.pipe[1];
+    e->off = static_cast<uint64_t>(-1);
+    e->len = static_cast<uint32_t>(n);
+    e->flags = IOSQE_IO_LINK;
+    ++c.write_ops;
+    ++c.inflight;
+    submit_splice_out(c, n);
+  }
+
+  void submit_splice_out(conn &c, std::size_t n) {
+    io_uring_sqe *e = sqe(op_splice_out, c.slot);
+    e->opcode = IORING_OP_SPLICE;
+    e->splice_fd_in = c.pipe[0];
+    e->splice_off_in = static_cast<uint64_t>(-1);
+    e->fd = static_cast<int>(c.slot);
+    e->off = static_cast<uint64_t>(-1);
+    e->len = static_cast<uint32_t>(n);
+    e->flags = IOSQE_FIXED_FILE;
+    ++c.write_ops;
+    ++c.inflight;
+  }
+
+  // Chunked framing of the producer's next chunk, as connection does.
+  void next_chunk(conn &c) {
+    c.chunk.clear();
+    bool more = c.res.producer(c.chunk);
+    c.buffers.clear();
+    c.first = c.offset = 0;
+    if (!c.chunk.empty()) {
+      char size_line[sizeof(std::size_t) * 2 + 2];
+      int n = std::snprintf(size_line, sizeof(size_line), "%zx", c.chunk.size());
+      c.chunk_size.assign(size_line, n).append("\r\n", 2);
+      c.buffers.push_back(boost::asio::buffer(c.chunk_size));
+      c.buffers.push_back(boost::asio::buffer(c.chunk));
+      c.buffers.push_back(boost::asio::buffer(misc_strings::crlf, sizeof(misc_strings::crlf)));
+    }
+    if (!more) {
+      c.buffers.push_back(boost::asio::buffer(misc_strings::last_chunk, sizeof(misc_strings::last_chunk) - 1));
+      c.last_chunk = true;
+    }
+    wheel_.schedule(c, config_.timeouts.write);
+  }
+
+  void on_write(conn &c, op o, int res) {
+    --c.write_ops;
+    --c.inflight;
+    // A short result cancels the rest of its chain; what is left is
+    // submitted again once the whole chain is back.
+    if (res < 0 && res != -ECANCELED) {
+      c.write_failed = true;
+    }
+    else if (res > 0) {
+      std::size_t n = static_cast<std::size_t>(res);
+      if (o == op_send) {
+        c.bytes_sent += n;
+        advance_buffers(c, n);
+      }
+      else if (o == op_splice_in) {
+        c.file_read += n;
+        c.in_pipe += n;
+      }
+      else {
+        c.bytes_sent += n;
+        c.in_pipe -= n;
+      }
+    }
+    else if (res == 0 && o == op_splice_in) {
+      // The file shrank under us.
+      c.write_failed = true;
+    }
+
+    if (c.write_ops || c.st == state::closing)
+      return;
+    if (c.write_failed) {
+      close(c);
+      return;
+    }
+    wheel_.schedule(c, config_.timeouts.write);
+    write_step(c);
+  }
+
+  static void advance_buffers(conn &c, std::size_t n) {
+    while (n && c.first < c.buffers.size()) {
+      std::size_t left = c.buffers[c.first].size() - c.offset;
+      if (n < left) {
+        c.offset += n;
+        return;
+      }
+      n -= left;
+      ++c.first;
+      c.offset = 0;
+    }
+    // Skip empty buffers so that an exhausted list reads as done.
+    while (c.first < c.buffers.size() && c.buffers[c.first].size() == c.offset) {
+      ++c.first;
+      c.offset = 0;
+    }
+  }
+
+  void finish_request(conn &c) {
+    c.cancel();
+    log_access(c);
+    if (!c.res.keep_alive || draining_) {
+      close(c);
+      return;
+    }
+    c.req.clear();
+    c.res.clear();
+    c.memory.reset();
+    c.parser.reset(&c.req);
+    c.buffers.clear();
+    c.bytes_sent = 0;
+    c.st = state::idle;
+    if (!c.in.empty())
+      parse_pending(c);
+    else
+      wheel_.schedule(c, config_.timeouts.keep_alive);
+    resume_recv(c);
+  }
+
+  // Shut the socket down, which ends the receive and any write under way;
+  // the slot is released once their completions are in.
+  void close(conn &c) {
+    if (c.st == state::closing)
+      return;
+    c.st = state::closing;
+    c.cancel();
+    ::shutdown(c.fd, SHUT_RDWR);
+    if (c.inflight == 0 && !c.awaiting)
+      release(c);
+  }
+
+  void release(conn &c) {
+    ::close(c.fd);
+    c.fd = -1;
+    // Data left in the pipe would go out to the next client.
+    if (c.in_pipe)
+      c.close_pipe();
+    io_uring_sqe *e = sqe(op_unregister, c.slot);
+    e->opcode = IORING_OP_FILES_UPDATE;
+    e->fd = -1;
+    e->addr = reinterpret_cast<uint64_t>(&no_file_);
+    e->len = 1;
+    e->off = c.slot;
+    c.inflight = 1;
+  }
+
+  // The table no longer holds the socket: the slot is free.
+  void recycle(conn &c) {
+    c.inflight = 0;
+    c.st = state::idle;
+    c.req.clear();
+    c.res.clear();
+    c.memory.reset();
+    c.parser.reset(&c.req);
+    c.in.clear();
+    c.receive_paused = false;
+    c.buffers.clear();
+    c.bytes_sent = 0;
+    c.in_pipe = 0;
+    c.write_ops = 0;
+    free_.push_back(c.slot);
+    --active_;
+
+    if (draining_) {
+      if (active_ == 0)
+        stopped_ = true;
+      return;
+    }
+    if (accept_paused_ && active_ < conns_.size()) {
+      accept_paused_ = false;
+      if (!accepting_)
+        arm_accept();
+    }
+  }
+
+  // Before the ring goes away: nothing may still write into our buffers.
+  void cancel_all() {
+    for (auto &c : conns_) {
+      if (c && c->fd >= 0)
+        ::shutdown(c->fd, SHUT_RDWR);
+    }
+    io_uring_sqe *e = sqe(op_cancel, 0);
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (std::chrono::steady_clock::now() < deadline && busy()) {
+      ring_.submit(1);
+      ring_.for_each_cqe([this](const io_uring_cqe &cqe) { complete(cqe); });
+    }
+  }
+
+  bool busy() const {
+    if (accepting_ || waking_)
+      return true;
+    for (auto &c : conns_) {
+      if (c && c->inflight)
+        return true;
+    }
+    return false;
+  }
+
+  void log_access(conn &c) {
+    if (!log_ || !log_->sample())
+      return;
+    access_record *rec = log_->reserve();
+    if (!rec)
+      return;
+
+    using namespace std::chrono;
+    int64_t duration = duration_cast<microseconds>(steady_clock::now() - c.start).count();
+    rec->timestamp_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() - duration;
+    rec->duration_us = static_cast<uint32_t>(duration);
+    rec->status = static_cast<uint16_t>(c.res.status_);
+    rec->method = static_cast<uint8_t>(c.req.method_code);
+    rec->bytes_sent = c.bytes_sent;
+
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    rec->address_family = 0;
+    if (::getpeername(c.fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+      if (addr.ss_family == AF_INET) {
+        rec->address_family = 4;
+        std::memcpy(rec->address, &reinterpret_cast<sockaddr_in*>(&addr)->sin_addr, 4);
+      }
+      else if (addr.ss_family == AF_INET6) {
+        rec->address_family = 6;
+        std::memcpy(rec->address, &reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr, 16);
+      }
+    }
+
+    rec->uri_length = static_cast<uint16_t>(std::min(c.req.uri.size(), sizeof(rec->uri)));
+    std::memcpy(rec->uri, c.req.uri.data(), rec->uri_length);
+    log_->commit();
+  }
+
+  // The asio side: listening socket setup, signals, the drain deadline and
+  // hot restarts, all run from the tick.
+  boost::asio::io_service io_service_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::signal_set signals_;
+  boost::asio::steady_timer drain_timer_;
+  detail::handoff_point handoff_;
+
+  server_config config_;
+  Handler *handler_;
+  access_log *log_;
+
+  uring::ring ring_;
+  uring::buffer_ring buffers_;
+  __kernel_timespec tick_{0, 100 * 1000 * 1000};
+  int wake_fd_ = ::eventfd(0, EFD_CLOEXEC);
+  uint64_t wake_count_ = 0;
+  bool waking_ = false;
+  const int no_file_ = -1;
+  timer_wheel wheel_;
+
+  // Connections by slot in the registered file table, created on first use
+  // and kept for the next client.
+  std::vector<std::unique_ptr<conn>> conns_;
+  std::vector<unsigned> free_;
+  std::size_t active_ = 0;
+
+  bool accepting_ = false;
+  bool accept_paused_ = false;
+  bool accept_failed_ = false;
+  bool draining_ = false;
+  bool stopped_ = false;
+};
+
+} // namespace zion
+
+#endif // ZION_HAS_IO_URING
+
+#endif //ZION_URING_SERVER_H
@@ -6,6 +6,10 @@
 #define ZION_UTILITY_H
 
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "arena.h"
 
 namespace zion {
 namespace util {
@@ -147,11 +151,22 @@ struct arguments<0>
   using type = S<>;
 };
 
+// URL args of the matched route, allocated from the request's arena when
+// there is one.
 struct routing_param
 {
-  std::vector<int64_t> int_params;
-  std::vector<float_t> float_params;
-  std::vector<std::string> string_params;
+  routing_param() = default;
+
+  explicit routing_param(zion::arena *a)
+      : int_params(arena_allocator<int64_t>(a)),
+        float_params(arena_allocator<float_t>(a)),
+        string_params(arena_allocator<arena_string>(a))
+  {
+  }
+
+  std::vector<int64_t, arena_allocator<int64_t>> int_params;
+  std::vector<float_t, arena_allocator<float_t>> float_params;
+  std::vector<arena_string, arena_allocator<arena_string>> string_params;
 
   template <typename T>
   T get(unsigned) const;
@@ -173,7 +188,141 @@ float_t routing_param::get<float_t>(unsigned index) const
 template<>
 std::string routing_param::get<std::string>(unsigned index) const
 {
-  return string_params[index];
+  return std::string(string_params[index].data(), string_params[index].size());
+}
+
+namespace detail {
+
+// Byte classification for url_decode: hex digit values (-1 for non-hex) and
+// which bytes need rewriting ('%' always, '+' only in query strings).
+struct url_table
+{
+  enum { percent = 1, plus = 2 };
+
+  signed char hex[256];
+  unsigned char special[256];
+
+  constexpr url_table() : hex(), special() {
+    for (int i = 0; i < 256; ++i) {
+      hex[i] = -1;
+      special[i] = 0;
+    }
+    for (int i = '0'; i <= '9'; ++i)
+      hex[i] = static_cast<signed char>(i - '0');
+    for (int i = 'a'; i <= 'f'; ++i)
+      hex[i] = static_cast<signed char>(i - 'a' + 10);
+    for (int i = 'A'; i <= 'F'; ++i)
+      hex[i] = static_cast<signed char>(i - 'A' + 10);
+    special['%'] = percent;
+    special['+'] = plus;
+  }
+};
+
+inline const url_table& get_url_table() {
+  static constexpr url_table table{};
+  return table;
+}
+
+} // namespace detail
+
+// Percent-decode [first, last) in place, validating escapes in the same pass.
+// Returns the new end of the decoded range, or nullptr if an escape is
+// truncated or not hex. '+' becomes ' ' only when plus_as_space is set.
+inline char* url_decode(char *first, char *last, bool plus_as_space = false) {
+  const detail::url_table &table = detail::get_url_table();
+  const unsigned char mask = plus_as_space ? (detail::url_table::percent | detail::url_table::plus)
+                                           : detail::url_table::percent;
+
+  // Nothing moves until the first escape, so skip the clean prefix without writing.
+  while (first != last && !(table.special[static_cast<unsigned char>(*first)] & mask))
+    ++first;
+
+  char *out = first;
+  while (first != last) {
+    unsigned char c = static_cast<unsigned char>(*first);
+    if (!(table.special[c] & mask)) {
+      *out++ = *first++;
+    }
+    else if (c == '+') {
+      *out++ = ' ';
+      ++first;
+    }
+    else {
+      if (last - first < 3)
+        return nullptr;
+      int hi = table.hex[static_cast<unsigned char>(first[1])];
+      int lo = table.hex[static_cast<unsigned char>(first[2])];
+      if ((hi | lo) < 0)
+        return nullptr;
+      *out++ = static_cast<char>((hi << 4) | lo);
+      first += 3;
+    }
+  }
+  return out;
+}
+
+// Percent-decode a string in place. Returns false if the encoding was invalid,
+// in which case the contents of s are unspecified.
+template <typename String>
+bool url_decode(String &s, bool plus_as_space = false) {
+  char *begin = &s[0];
+  char *end = url_decode(begin, begin + s.size(), plus_as_space);
+  if (!end)
+    return false;
+  s.resize(end - begin);
+  return true;
+}
+
+// Normalize an absolute URL path in place in a single pass: collapse repeated
+// slashes, drop "." segments and resolve ".." against the segments already
+// written. A trailing slash (or trailing "." / "..") is kept so callers can
+// still tell a directory request apart. Returns false for relative paths,
+// embedded NULs, or a ".." that would climb above the root.
+inline bool normalize_path(std::string &path) {
+  if (path.empty() || path[0] != '/')
+    return false;
+
+  char *base = &path[0];
+  const char *in = base;
+  const char *end = base + path.size();
+  // Every segment written is preceded by the slash that was consumed before
+  // it, so out never overtakes in.
+  char *out = base;
+  bool trailing_slash = false;
+
+  while (in != end) {
+    while (in != end && *in == '/')
+      ++in;
+    const char *seg = in;
+    while (in != end && *in != '/') {
+      if (*in == '\0')
+        return false;
+      ++in;
+    }
+    std::size_t len = in - seg;
+
+    if (len == 0 || (len == 1 && seg[0] == '.')) {
+      trailing_slash = true;
+    }
+    else if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+      if (out == base)
+        return false;
+      while (*--out != '/') {
+      }
+      trailing_slash = true;
+    }
+    else {
+      *out++ = '/';
+      std::memmove(out, seg, len);
+      out += len;
+      trailing_slash = false;
+    }
+  }
+
+  if (out == base || trailing_slash)
+    *out++ = '/';
+  path.resize(out - base);
+  return true;
 }
 
 } // namespace util
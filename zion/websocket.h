@@ -0,0 +1,492 @@
+//
+// Created by Shihao Jing on 8/6/17.
+//
+
+#ifndef ZION_WEBSOCKET_H
+#define ZION_WEBSOCKET_H
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace zion {
+namespace websocket {
+
+enum opcode : uint8_t
+{
+  continuation = 0x0,
+  text = 0x1,
+  binary = 0x2,
+  close = 0x8,
+  ping = 0x9,
+  pong = 0xA
+};
+
+enum close_code : uint16_t
+{
+  normal_closure = 1000,
+  going_away = 1001,
+  protocol_error = 1002,
+  unsupported_data = 1003,
+  abnormal_closure = 1006,
+  message_too_big = 1009
+};
+
+/// A complete frame as it goes on the wire. Server frames are never masked,
+/// so one frame can be queued on any number of sessions without copying.
+using frame_ptr = std::shared_ptr<const std::string>;
+
+/// Build an unfragmented server frame.
+inline frame_ptr make_frame(opcode op, const char *data, std::size_t size) {
+  auto frame = std::make_shared<std::string>();
+  frame->reserve(size + 10);
+  frame->push_back(static_cast<char>(0x80 | op));
+  if (size < 126) {
+    frame->push_back(static_cast<char>(size));
+  }
+  else if (size <= 0xFFFF) {
+    frame->push_back(static_cast<char>(126));
+    frame->push_back(static_cast<char>(size >> 8));
+    frame->push_back(static_cast<char>(size));
+  }
+  else {
+    frame->push_back(static_cast<char>(127));
+    for (int shift = 56; shift >= 0; shift -= 8)
+      frame->push_back(static_cast<char>(static_cast<uint64_t>(size) >> shift));
+  }
+  frame->append(data, size);
+  return frame;
+}
+
+inline frame_ptr make_frame(opcode op, const std::string &payload) {
+  return make_frame(op, payload.data(), payload.size());
+}
+
+/// XOR a client payload with its masking key in place. The key is widened to
+/// 16 and 8 byte lanes so the bulk of the payload is unmasked a block at a time.
+inline void unmask(char *data, std::size_t size, const unsigned char key[4]) {
+  uint32_t key32;
+  std::memcpy(&key32, key, 4);
+  std::size_t i = 0;
+#ifdef __SSE2__
+  const __m128i key128 = _mm_set1_epi32(static_cast<int>(key32));
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(block, key128));
+  }
+#endif
+  const uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t block;
+    std::memcpy(&block, data + i, 8);
+    block ^= key64;
+    std::memcpy(data + i, &block, 8);
+  }
+  for (; i < size; ++i)
+    data[i] ^= key[i & 3];
+}
+
+struct frame_header
+{
+  bool fin;
+  uint8_t opcode;
+  bool masked;
+  unsigned char mask[4];
+  uint64_t payload_length;
+  std::size_t size;     // bytes taken by the header itself
+};
+
+/// Decode a frame header from the start of [data, data + size). Returns 1 when
+/// a header was decoded, 0 when more bytes are needed and -1 when reserved
+/// bits are set (no extensions are negotiated).
+inline int parse_frame_header(const char *data, std::size_t size, frame_header &h) {
+  if (size < 2)
+    return 0;
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+  if (p[0] & 0x70)
+    return -1;
+  h.fin = (p[0] & 0x80) != 0;
+  h.opcode = p[0] & 0x0F;
+  h.masked = (p[1] & 0x80) != 0;
+
+  std::size_t pos = 2;
+  uint64_t length = p[1] & 0x7F;
+  if (length == 126) {
+    if (size < 4)
+      return 0;
+    length = (static_cast<uint64_t>(p[2]) << 8) | p[3];
+    pos = 4;
+  }
+  else if (length == 127) {
+    if (size < 10)
+      return 0;
+    length = 0;
+    for (int i = 2; i < 10; ++i)
+      length = (length << 8) | p[i];
+    pos = 10;
+  }
+  if (h.masked) {
+    if (size < pos + 4)
+      return 0;
+    std::memcpy(h.mask, p + pos, 4);
+    pos += 4;
+  }
+  h.payload_length = length;
+  h.size = pos;
+  return 1;
+}
+
+namespace detail {
+
+inline void sha1(const std::string &input, unsigned char digest[20]) {
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+  std::string msg = input;
+  uint64_t bit_length = static_cast<uint64_t>(input.size()) * 8;
+  msg.push_back(static_cast<char>(0x80));
+  while (msg.size() % 64 != 56)
+    msg.push_back('\0');
+  for (int shift = 56; shift >= 0; shift -= 8)
+    msg.push_back(static_cast<char>(bit_length >> shift));
+
+  auto rol = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+  for (std::size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      const unsigned char *b = reinterpret_cast<const unsigned char*>(msg.data() + chunk + i * 4);
+      w[i] = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+    }
+    for (int i = 16; i < 80; ++i)
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+      uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d; d = c; c = rol(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+
+  for (int i = 0; i < 5; ++i) {
+    digest[i * 4] = static_cast<unsigned char>(h[i] >> 24);
+    digest[i * 4 + 1] = static_cast<unsigned char>(h[i] >> 16);
+    digest[i * 4 + 2] = static_cast<unsigned char>(h[i] >> 8);
+    digest[i * 4 + 3] = static_cast<unsigned char>(h[i]);
+  }
+}
+
+inline std::string base64_encode(const unsigned char *data, std::size_t size) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((size + 2) / 3 * 4);
+  for (std::size_t i = 0; i < size; i += 3) {
+    uint32_t n = uint32_t(data[i]) << 16;
+    if (i + 1 < size) n |= uint32_t(data[i + 1]) << 8;
+    if (i + 2 < size) n |= data[i + 2];
+    out.push_back(alphabet[(n >> 18) & 63]);
+    out.push_back(alphabet[(n >> 12) & 63]);
+    out.push_back(i + 1 < size ? alphabet[(n >> 6) & 63] : '=');
+    out.push_back(i + 2 < size ? alphabet[n & 63] : '=');
+  }
+  return out;
+}
+
+} // namespace detail
+
+/// Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key.
+inline std::string accept_key(const std::string &client_key) {
+  unsigned char digest[20];
+  detail::sha1(client_key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", digest);
+  return detail::base64_encode(digest, sizeof(digest));
+}
+
+/// One upgraded client connection. Sending is safe from any thread; the
+/// callbacks run on the connection's io thread. Callbacks should not capture
+/// a shared_ptr to their own session, or the session can never be freed.
+class session
+{
+public:
+  using message_handler = std::function<void(session&, const std::string &data, bool is_binary)>;
+  using close_handler = std::function<void(session&, uint16_t code)>;
+
+  session() = default;
+  session(const session&) = delete;
+  session& operator=(const session&) = delete;
+
+  virtual ~session() = default;
+
+  void on_message(message_handler handler) { on_message_ = std::move(handler); }
+  void on_close(close_handler handler) { on_close_ = std::move(handler); }
+
+  void send_text(const std::string &data) { send(make_frame(text, data)); }
+  void send_binary(const std::string &data) { send(make_frame(binary, data)); }
+
+  /// Queue a prebuilt frame. The same frame can be sent to many sessions.
+  virtual void send(frame_ptr frame) = 0;
+
+  /// Start the closing handshake.
+  virtual void close(uint16_t code = normal_closure) = 0;
+
+protected:
+  message_handler on_message_;
+  close_handler on_close_;
+};
+
+template <typename Socket>
+class session_impl : public session, public std::enable_shared_from_this<session_impl<Socket>>
+{
+public:
+  /// Largest message accepted from a client, fragments included.
+  static const std::size_t max_message_size = 16 * 1024 * 1024;
+
+  explicit session_impl(Socket socket)
+      : socket_(std::move(socket)),
+        buffer_(8192)
+  {
+  }
+
+  ~session_impl() {
+    // The owner is let go on the io thread, whichever thread drops the
+    // session last.
+    if (owner_)
+      boost::asio::post(socket_.get_executor(), [owner = std::move(owner_)] {});
+  }
+
+  void start() {
+    do_read();
+  }
+
+  /// Keep owner alive for as long as the session, typically the connection
+  /// the session was upgraded from, which then still counts as open.
+  void set_owner(std::shared_ptr<void> owner) {
+    owner_ = std::move(owner);
+  }
+
+  void send(frame_ptr frame) override {
+    auto self = this->shared_from_this();
+    boost::asio::dispatch(socket_.get_executor(), [this, self, frame]
+    {
+      if (close_sent_)
+        return;
+      queue_.push_back(std::move(frame));
+      do_write();
+    });
+  }
+
+  void close(uint16_t code) override {
+    auto self = this->shared_from_this();
+    boost::asio::dispatch(socket_.get_executor(), [this, self, code]
+    {
+      send_close(code);
+    });
+  }
+
+private:
+  void do_read() {
+    if (buffer_end_ == buffer_.size())
+      buffer_.resize(buffer_.size() * 2);
+
+    auto self = this->shared_from_this();
+    socket_.async_read_some(boost::asio::buffer(buffer_.data() + buffer_end_, buffer_.size() - buffer_end_),
+                            [this, self](boost::system::error_code ec, std::size_t bytes_transferred)
+                            {
+                              if (ec) {
+                                finish(abnormal_closure);
+                                return;
+                              }
+                              buffer_end_ += bytes_transferred;
+                              if (process_frames())
+                                do_read();
+                            });
+  }
+
+  // Handle every complete frame in the buffer. Returns false once the session
+  // should stop reading.
+  bool process_frames() {
+    std::size_t pos = 0;
+    for (;;) {
+      frame_header h;
+      int parsed = parse_frame_header(buffer_.data() + pos, buffer_end_ - pos, h);
+      if (parsed < 0 || (parsed > 0 && !h.masked))
+        return fail(protocol_error);
+      if (parsed == 0)
+        break;
+      if (h.payload_length > max_message_size)
+        return fail(message_too_big);
+      std::size_t frame_size = h.size + static_cast<std::size_t>(h.payload_length);
+      if (buffer_end_ - pos < frame_size) {
+        // Make room for the rest of this frame before reading again.
+        if (frame_size > buffer_.size())
+          buffer_.resize(frame_size);
+        break;
+      }
+
+      char *payload = buffer_.data() + pos + h.size;
+      std::size_t size = static_cast<std::size_t>(h.payload_length);
+      unmask(payload, size, h.mask);
+      pos += frame_size;
+      if (!handle_frame(h, payload, size))
+        return false;
+    }
+
+    // Keep the unconsumed tail at the front of the buffer.
+    std::memmove(buffer_.data(), buffer_.data() + pos, buffer_end_ - pos);
+    buffer_end_ -= pos;
+    return true;
+  }
+
+  bool handle_frame(const frame_header &h, const char *payload, std::size_t size) {
+    switch (h.opcode) {
+      case text:
+      case binary:
+      case continuation:
+        if ((h.opcode == continuation) != in_message_)
+          return fail(protocol_error);
+        if (h.opcode != continuation)
+          message_binary_ = h.opcode == binary;
+        if (message_.size() + size > max_message_size)
+          return fail(message_too_big);
+        message_.append(payload, size);
+        in_message_ = !h.fin;
+        if (h.fin) {
+          if (on_message_)
+            on_message_(*this, message_, message_binary_);
+          message_.clear();
+        }
+        return true;
+
+      case ping:
+      case pong:
+      case websocket::close:
+        // Control frames may interleave with fragments but are never fragmented.
+        if (!h.fin || size > 125)
+          return fail(protocol_error);
+        if (h.opcode == ping) {
+          if (!close_sent_) {
+            queue_.push_back(make_frame(pong, payload, size));
+            do_write();
+          }
+          return true;
+        }
+        if (h.opcode == pong)
+          return true;
+
+        close_received_ = true;
+        close_code_ = size >= 2 ? static_cast<uint16_t>((static_cast<unsigned char>(payload[0]) << 8) |
+                                                        static_cast<unsigned char>(payload[1]))
+                                : static_cast<uint16_t>(normal_closure);
+        if (close_sent_)
+          finish(close_code_);
+        else
+          send_close(close_code_);
+        return false;
+
+      default:
+        return fail(protocol_error);
+    }
+  }
+
+  bool fail(uint16_t code) {
+    failed_ = true;
+    send_close(code);
+    return false;
+  }
+
+  void send_close(uint16_t code) {
+    if (close_sent_)
+      return;
+    close_sent_ = true;
+    char payload[2] = { static_cast<char>(code >> 8), static_cast<char>(code) };
+    queue_.push_back(make_frame(websocket::close, payload, sizeof(payload)));
+    if (!close_received_)
+      close_code_ = code;
+    do_write();
+  }
+
+  // Write everything queued in one gathered write; frames queued meanwhile go
+  // out with the next one.
+  void do_write() {
+    if (writing_ || queue_.empty())
+      return;
+    writing_ = true;
+    writing_frames_.assign(queue_.begin(), queue_.end());
+    queue_.clear();
+    write_buffers_.clear();
+    for (auto &frame : writing_frames_)
+      write_buffers_.push_back(boost::asio::buffer(*frame));
+
+    auto self = this->shared_from_this();
+    boost::asio::async_write(socket_, write_buffers_,
+                             [this, self](boost::system::error_code ec, std::size_t)
+                             {
+                               writing_ = false;
+                               writing_frames_.clear();
+                               if (ec) {
+                                 finish(abnormal_closure);
+                                 return;
+                               }
+                               // Our close frame is out; the connection ends once the
+                               // peer's close has arrived too, or right away if the
+                               // peer broke the protocol and is no longer read.
+                               if (close_sent_ && (close_received_ || failed_) && queue_.empty()) {
+                                 finish(close_code_);
+                                 return;
+                               }
+                               do_write();
+                             });
+  }
+
+  void finish(uint16_t code) {
+    if (finished_)
+      return;
+    finished_ = true;
+    boost::system::error_code ignored;
+    socket_.lowest_layer().close(ignored);
+    if (on_close_)
+      on_close_(*this, code);
+    on_message_ = nullptr;
+    on_close_ = nullptr;
+  }
+
+  Socket socket_;
+
+  // Received bytes; [0, buffer_end_) is filled.
+  std::vector<char> buffer_;
+  std::size_t buffer_end_ = 0;
+
+  // Message being reassembled from fragments.
+  std::string message_;
+  bool message_binary_ = false;
+  bool in_message_ = false;
+
+  std::deque<frame_ptr> queue_;
+  std::vector<frame_ptr> writing_frames_;
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  bool writing_ = false;
+
+  bool close_sent_ = false;
+  bool close_received_ = false;
+  bool failed_ = false;
+  bool finished_ = false;
+  uint16_t close_code_ = normal_closure;
+
+  std::shared_ptr<void> owner_;
+};
+
+} // namespace websocket
+} // namespace zion
+
+#endif //ZION_WEBSOCKET_H
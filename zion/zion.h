@@ -5,17 +5,34 @@
 #ifndef ZION_ZION_H
 #define ZION_ZION_H
 
+// Boost 1.74's awaitable.hpp uses std::exchange without including it.
+#include <utility>
+#include "access_log.h"
 #include "app.h"
+#include "arena.h"
+#include "buffer_pool.h"
 #include "connection.h"
+#include "connection_pool.h"
+#include "cpu_pool.h"
+#include "handoff.h"
 #include "header.h"
+#include "hpack.h"
+#include "http2.h"
 #include "http_parser.h"
 #include "mime.h"
 #include "request.h"
-//#include "request_handler.h"
+#include "request_handler.h"
 #include "request_parser.h"
 #include "response.h"
 #include "routing.h"
 #include "server.h"
+#include "socket_adaptors.h"
+#include "sse.h"
+#include "task.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "uring_server.h"
 #include "utility.h"
+#include "websocket.h"
 
 #endif //ZION_ZION_H